@@ -0,0 +1,408 @@
+/*
+ * Batch images of the P2MP-FTP client and server. See batch.h.
+ *
+ * The client reserves the whole image as anonymous memory, writes the
+ * manifest and reads the small files into it, and maps each large file over
+ * its place with MAP_FIXED, so the image is one contiguous range however
+ * large the files are and a large file is never copied. The server copies
+ * each file out of the received image with copy_file_range, which the file
+ * system may carry out without moving the data at all.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "batch.h"
+
+/* Most directories nftw keeps open while walking a tree */
+#define WALK_FDS 64
+/* Size of the buffer files are copied through without copy_file_range */
+#define COPY_BUFFER (64 * 1024)
+
+/* One file or directory of the batch being built */
+typedef struct member_t {
+  char *source;
+  char *name;
+  uint64_t length;
+  uint32_t mode;
+  uint64_t offset;
+} Member;
+
+/* Members of the batch being built, which nftw gives no other way to reach */
+static Member *members;
+static int numMembers;
+static int maxMembers;
+static size_t rootLength;
+static time_t latestMtime;
+
+/*
+ * Returns whether a path of the given length is relative and stays below
+ * the top of the batch, with no empty, . or .. components
+ */
+static bool safePath(const char *path, size_t length) {
+  size_t start = 0;
+
+  if (length == 0 || length >= PATH_MAX)
+    return false;
+  for (size_t i = 0; i <= length; i++) {
+    if (i < length && path[i] != '/')
+      continue;
+    size_t size = i - start;
+    if (size == 0 || (size == 1 && path[start] == '.')
+        || (size == 2 && path[start] == '.' && path[start + 1] == '.'))
+      return false;
+    start = i + 1;
+  }
+  return memchr(path, '\0', length) == NULL;
+}
+
+/*
+ * Adds the file or directory at source to the batch as name
+ */
+static void addMember(const char *source, const char *name, const struct stat *fileStat) {
+  if (!S_ISREG(fileStat->st_mode) && !S_ISDIR(fileStat->st_mode)) {
+    printf("Skipping %s, not a regular file or directory\n", source);
+    return;
+  }
+  if (!safePath(name, strlen(name))) {
+    printf("Fatal Error %s cannot be named %s in a batch\n", source, name);
+    exit(1);
+  }
+  if (numMembers == maxMembers) {
+    maxMembers = maxMembers > 0 ? 2 * maxMembers : 256;
+    if ((members = realloc(members, maxMembers * sizeof(Member))) == NULL) {
+      printf("Fatal Error allocating the batch\n");
+      exit(3);
+    }
+  }
+
+  Member *member = &members[numMembers++];
+  member->source = strdup(source);
+  member->name = strdup(name);
+  if (member->source == NULL || member->name == NULL) {
+    printf("Fatal Error allocating the batch\n");
+    exit(3);
+  }
+  member->length = S_ISREG(fileStat->st_mode) ? (uint64_t) fileStat->st_size : 0;
+  member->mode = fileStat->st_mode;
+  member->offset = 0;
+  if (fileStat->st_mtime > latestMtime)
+    latestMtime = fileStat->st_mtime;
+}
+
+/*
+ * Adds an entry of the tree being walked, named by its path below the root
+ */
+static int walkEntry(const char *path, const struct stat *fileStat, int type, struct FTW *ftw) {
+  if (ftw->level == 0)
+    return 0;
+  if (type == FTW_NS || type == FTW_DNR) {
+    printf("Fatal Error reading %s\n", path);
+    exit(1);
+  }
+  addMember(path, path + rootLength + 1, fileStat);
+  return 0;
+}
+
+/*
+ * Adds every file the list at path names, one per line. An absolute path,
+ * or one starting with ./, is stored without that prefix.
+ */
+static void readList(const char *path) {
+  FILE *list = fopen(path, "r");
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+
+  if (list == NULL) {
+    printf("Fatal Error opening the file list: %s\n", path);
+    exit(1);
+  }
+  while ((length = getline(&line, &size, list)) >= 0) {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+    if (length == 0)
+      continue;
+
+    struct stat fileStat;
+    if (stat(line, &fileStat) < 0) {
+      printf("Fatal Error opening the file: %s\n", line);
+      exit(1);
+    }
+    const char *name = line;
+    while (*name == '/' || (name[0] == '.' && name[1] == '/'))
+      name += *name == '/' ? 1 : 2;
+    addMember(line, name, &fileStat);
+  }
+  free(line);
+  fclose(list);
+}
+
+/*
+ * Reads the whole of a small file into its place in the image
+ */
+static void readMember(Member *member, int fd, char *data) {
+  uint64_t done = 0;
+
+  while (done < member->length) {
+    ssize_t n = read(fd, data + done, member->length - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      printf("Fatal Error reading the file: %s\n", member->source);
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+/*
+ * Builds and maps the image of a tree or a list of files
+ */
+const char *mapBatch(const char *path, bool list, size_t *length, time_t *mtime) {
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  numMembers = 0;
+  latestMtime = 0;
+  if (list) {
+    readList(path);
+  } else {
+    // nftw names every entry with the root as given, so strip a trailing slash
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%s", path);
+    rootLength = strlen(root);
+    while (rootLength > 1 && root[rootLength - 1] == '/')
+      root[--rootLength] = '\0';
+    if (nftw(root, walkEntry, WALK_FDS, FTW_PHYS) < 0) {
+      printf("Fatal Error reading %s\n", path);
+      exit(1);
+    }
+  }
+  if (numMembers == 0) {
+    printf("Fatal Error %s holds no files to send\n", path);
+    exit(1);
+  }
+
+  // small files are packed behind the manifest, large ones on their own pages
+  uint64_t manifestLength = sizeof(BatchHeader);
+  for (int i = 0; i < numMembers; i++)
+    manifestLength += sizeof(BatchEntry) + strlen(members[i].name);
+  uint64_t offset = manifestLength;
+  for (int i = 0; i < numMembers; i++) {
+    Member *member = &members[i];
+    if (member->length >= BATCH_MAP_SIZE) {
+      offset = (offset + page - 1) / page * page;
+      member->offset = offset;
+      offset = (offset + member->length + page - 1) / page * page;
+    } else {
+      member->offset = offset;
+      offset += member->length;
+    }
+  }
+  if (offset > SIZE_MAX) {
+    printf("Fatal Error the batch is too large\n");
+    exit(1);
+  }
+
+  char *image = mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (image == MAP_FAILED) {
+    printf("Fatal Error allocating the batch\n");
+    exit(3);
+  }
+
+  BatchHeader *header = (BatchHeader *) image;
+  header->magic = htobe32(BATCH_MAGIC);
+  header->numEntries = htobe32(numMembers);
+  header->manifestLength = htobe64(manifestLength);
+  char *next = image + sizeof(BatchHeader);
+  for (int i = 0; i < numMembers; i++) {
+    Member *member = &members[i];
+    BatchEntry *entry = (BatchEntry *) next;
+    size_t nameLength = strlen(member->name);
+    entry->offset = htobe64(member->offset);
+    entry->length = htobe64(member->length);
+    entry->mode = htobe32(member->mode);
+    entry->pathLength = htobe16(nameLength);
+    memcpy(entry + 1, member->name, nameLength);
+    next += sizeof(BatchEntry) + nameLength;
+  }
+
+  for (int i = 0; i < numMembers; i++) {
+    Member *member = &members[i];
+    if (member->length > 0) {
+      int fd = open(member->source, O_RDONLY);
+      if (fd < 0) {
+        printf("Fatal Error opening the file: %s\n", member->source);
+        exit(1);
+      }
+      if (member->length < BATCH_MAP_SIZE)
+        readMember(member, fd, image + member->offset);
+      else if (mmap(image + member->offset, member->length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        printf("Fatal Error mapping the file: %s\n", member->source);
+        exit(2);
+      }
+      close(fd);
+    }
+    free(member->source);
+    free(member->name);
+  }
+  free(members);
+  members = NULL;
+  maxMembers = 0;
+
+  mprotect(image, offset, PROT_READ);
+  *length = offset;
+  *mtime = latestMtime;
+  return image;
+}
+
+/*
+ * Unmaps an image and the files mapped into it
+ */
+void unmapBatch(const char *image, size_t length) {
+  munmap((void *) image, length);
+}
+
+/*
+ * Creates every directory on the way to a path below dirFd that is not
+ * there yet
+ */
+static void makeParents(int dirFd, char *path) {
+  for (char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdirat(dirFd, path, 0755);
+    *slash = '/';
+  }
+}
+
+/*
+ * Copies length bytes at offset of in to the start of out, in the kernel if
+ * it can
+ */
+static bool copyData(int in, off_t offset, int out, uint64_t length) {
+  while (length > 0) {
+    ssize_t n = copy_file_range(in, &offset, out, NULL, length, 0);
+    if (n > 0) {
+      length -= n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP))
+      return false;
+    break;
+  }
+
+  // the file system cannot copy between these files, so copy through memory
+  char buffer[COPY_BUFFER];
+  while (length > 0) {
+    ssize_t n = pread(in, buffer, length < sizeof(buffer) ? length : sizeof(buffer), offset);
+    if (n <= 0 || write(out, buffer, n) != n)
+      return false;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+/*
+ * Unpacks every entry of the manifest of the image in fd, size bytes long,
+ * into the directory dirFd. Returns the number of entries, or -1 if any of
+ * them is invalid.
+ */
+static int unpackEntries(int fd, off_t size, int dirFd) {
+  BatchHeader header;
+
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || be32toh(header.magic) != BATCH_MAGIC)
+    return -1;
+  uint32_t numEntries = be32toh(header.numEntries);
+  uint64_t manifestLength = be64toh(header.manifestLength);
+  if (manifestLength < sizeof(header) || manifestLength > (uint64_t) size
+      || (manifestLength - sizeof(header)) / sizeof(BatchEntry) < numEntries || numEntries > INT_MAX)
+    return -1;
+
+  char *manifest = malloc(manifestLength);
+  if (manifest == NULL || pread(fd, manifest, manifestLength, 0) != (ssize_t) manifestLength) {
+    free(manifest);
+    return -1;
+  }
+
+  bool valid = true;
+  uint64_t next = sizeof(header);
+  for (uint32_t i = 0; i < numEntries && valid; i++) {
+    BatchEntry entry;
+    char path[PATH_MAX];
+
+    if (manifestLength - next < sizeof(entry)) {
+      valid = false;
+      break;
+    }
+    memcpy(&entry, manifest + next, sizeof(entry));
+    uint64_t offset = be64toh(entry.offset);
+    uint64_t length = be64toh(entry.length);
+    uint32_t mode = be32toh(entry.mode);
+    size_t pathLength = be16toh(entry.pathLength);
+    next += sizeof(entry);
+    if (pathLength > manifestLength - next || !safePath(manifest + next, pathLength)) {
+      valid = false;
+      break;
+    }
+    memcpy(path, manifest + next, pathLength);
+    path[pathLength] = '\0';
+    next += pathLength;
+
+    makeParents(dirFd, path);
+    if (S_ISDIR(mode)) {
+      valid = (mkdirat(dirFd, path, (mode & 0777) | 0700) == 0 || errno == EEXIST) && length == 0;
+      continue;
+    }
+    if (offset < manifestLength || offset > (uint64_t) size || length > (uint64_t) size - offset) {
+      valid = false;
+      break;
+    }
+    int out = openat(dirFd, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode & 0777);
+    valid = out >= 0 && copyData(fd, offset, out, length);
+    if (out >= 0)
+      close(out);
+  }
+  free(manifest);
+  return valid ? (int) numEntries : -1;
+}
+
+/*
+ * Moves the image at path aside to path.batch and unpacks it into a new
+ * directory at path, which nothing else can have placed links in
+ */
+int unpackBatch(const char *path) {
+  char imagePath[PATH_MAX + sizeof(".batch")];
+  struct stat imageStat;
+
+  snprintf(imagePath, sizeof(imagePath), "%s.batch", path);
+  if (rename(path, imagePath) < 0)
+    return -1;
+  int fd = open(imagePath, O_RDONLY);
+  if (fd < 0 || fstat(fd, &imageStat) < 0 || mkdir(path, 0755) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  int dirFd = open(path, O_RDONLY | O_DIRECTORY);
+  int count = dirFd >= 0 ? unpackEntries(fd, imageStat.st_size, dirFd) : -1;
+  if (dirFd >= 0)
+    close(dirFd);
+  close(fd);
+  if (count >= 0)
+    unlink(imagePath);
+  return count;
+}
@@ -0,0 +1,75 @@
+/*
+ * Batch images for sending many files over one P2MP-FTP transfer.
+ *
+ * A batch of files, the tree under a directory or the files named in a
+ * list, is sent as a single file, its image, so the whole batch takes one
+ * handshake and one session however many files it holds. The image starts
+ * with a manifest, a BatchHeader followed by one BatchEntry per file or
+ * directory, each followed by its relative path. The contents of the files
+ * follow the manifest. Small files are packed back to back, so many of them
+ * share a segment, while large files start and end on a page boundary so
+ * the client can map them straight from disk into the image. Every field of
+ * the manifest is in network byte order, as in the packets (see p2mp.h).
+ *
+ * The client marks the syn and its answer to a join with FLAG_BATCH, and a
+ * server that received the whole image unpacks it into a directory of the
+ * name it would have written the file to.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BATCH_MAGIC 0x50324D42
+/* Files at least this large are mapped into the image instead of read */
+#define BATCH_MAP_SIZE (1 << 20)
+
+/*
+ * BatchHeader structure at the start of an image, giving the number of
+ * entries in the manifest and its length in bytes, this header included
+ */
+typedef struct __attribute__((packed)) batch_header_t {
+  uint32_t magic;
+  uint32_t numEntries;
+  uint64_t manifestLength;
+} BatchHeader;
+
+/*
+ * BatchEntry structure for one file of the image, whose length bytes start
+ * at offset in the image, or one directory, which has none. The mode holds
+ * its type and permissions as stat reports them, and the entry is followed
+ * by pathLength bytes of its path, relative to the top of the batch.
+ */
+typedef struct __attribute__((packed)) batch_entry_t {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t mode;
+  uint16_t pathLength;
+} BatchEntry;
+
+/*
+ * Builds the image of the tree under path, or with list set of the files
+ * path names one per line, and maps it read-only in memory. Returns the
+ * image, and sets length to its length and mtime to the latest modification
+ * time of its files. Exits if a file cannot be read.
+ */
+const char *mapBatch(const char *path, bool list, size_t *length, time_t *mtime);
+
+/*
+ * Unmaps an image built by mapBatch(), along with the files mapped into it
+ */
+void unmapBatch(const char *image, size_t length);
+
+/*
+ * Unpacks the complete image in the file at path into a new directory of
+ * the same name, and removes the image. Returns the number of entries
+ * unpacked, or -1 if the image is invalid, in which case it is kept in
+ * path.batch.
+ */
+int unpackBatch(const char *path);
+
+#endif
@@ -0,0 +1,97 @@
+#!/bin/sh
+# Benchmark of the P2MP-FTP client and servers over loopback, run with
+#   $ make bench
+# Every combination of MSS, window size, number of servers and path profile
+# is one transfer of a random file to servers on 127.0.0.2 and up, each
+# emulating the profile's path with a seed of its own so that the servers
+# lose different packets, and prints one CSV row:
+# the goodput, the share of data packets that were retransmissions, and the
+# median and 99th percentile time for a segment to be acknowledged.
+#
+# The sweep is set with space separated lists in the environment:
+#   BENCH_MSS       segment sizes (default "500 1400 8000")
+#   BENCH_WINDOWS   window sizes of the client and servers (default "8 64 256")
+#   BENCH_SERVERS   numbers of servers (default "1 4")
+#   BENCH_PROFILES  path profiles (default "clean loss delay reorder wan")
+# and BENCH_SIZE is the file size in bytes (default 4000000), BENCH_SEED the
+# emulator seed of the first server, the others taking the seeds after it
+# (default 1), BENCH_PORT the port (default 7735),
+# BENCH_TIMEOUT the seconds a transfer may take (default 120), and
+# BENCH_CLIENT_OPTS extra client options, such as "-C bbr".
+#
+# The profiles are:
+#   clean    no loss, no delay
+#   loss     1% loss
+#   delay    2 ms delay with 0.5 ms jitter
+#   reorder  0.5 ms delay, 5% of packets held back 2 ms more
+#   wan      1% loss, 5 ms delay with 1 ms jitter, 1% held back 5 ms more
+
+cd "$(dirname "$0")" || exit 1
+
+MSS_LIST=${BENCH_MSS:-"500 1400 8000"}
+WINDOW_LIST=${BENCH_WINDOWS:-"8 64 256"}
+SERVER_LIST=${BENCH_SERVERS:-"1 4"}
+PROFILE_LIST=${BENCH_PROFILES:-"clean loss delay reorder wan"}
+SIZE=${BENCH_SIZE:-4000000}
+SEED=${BENCH_SEED:-1}
+PORT=${BENCH_PORT:-7735}
+LIMIT=${BENCH_TIMEOUT:-120}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+head -c "$SIZE" /dev/urandom > "$DIR/in"
+
+# prints the loss probability and the emulator options of a profile
+profile() {
+  case $1 in
+    clean) echo "0" ;;
+    loss) echo "0.01" ;;
+    delay) echo "0 -D 2000:500" ;;
+    reorder) echo "0 -D 500 -R 0.05:2000" ;;
+    wan) echo "0.01 -D 5000:1000 -R 0.01:5000" ;;
+    *) echo "unknown profile $1" >&2; exit 1 ;;
+  esac
+}
+
+# runs one transfer and prints its row
+run() {
+  mss=$1; window=$2; count=$3; name=$4
+  set -- $(profile "$name")
+  loss=$1; shift
+  hosts=""
+  pids=""
+
+  for i in $(seq 1 "$count"); do
+    host=127.0.0.$((i + 1))
+    ./p2mpserver -w "$window" -s "$((SEED + i - 1))" "$@" -b "$host" "$PORT" "$DIR/out.$i" "$loss" > "$DIR/server.$i.log" 2>&1 &
+    pids="$pids $!"
+    hosts="$hosts $host"
+  done
+  sleep 0.2
+
+  status=ok
+  timeout "$LIMIT" ./p2mpclient -w "$window" -m sr $BENCH_CLIENT_OPTS $hosts "$PORT" "$DIR/in" "$mss" > "$DIR/client.log" 2>&1 || status=failed
+  for pid in $pids; do
+    kill "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+  done
+  for i in $(seq 1 "$count"); do
+    cmp -s "$DIR/in" "$DIR/out.$i" || status=corrupt
+  done
+
+  # Summary: B bytes in S s, G Mbit/s, P packets sent, R retransmitted (F), completion latency p50 X us p99 Y us
+  row=$(sed -n 's/^Summary: \([0-9]*\) bytes in \([0-9.]*\) s, \([0-9.]*\) Mbit\/s, \([0-9]*\) packets sent, \([0-9]*\) retransmitted (\([0-9.]*\)), completion latency p50 \([0-9]*\) us p99 \([0-9]*\) us$/\1,\2,\3,\4,\5,\6,\7,\8/p' "$DIR/client.log")
+  echo "$mss,$window,$count,$name,${row:-,,,,,,,},$status"
+  rm -f "$DIR"/out.*
+}
+
+echo "mss,window,servers,profile,bytes,seconds,goodput_mbps,packets,retransmitted,retransmit_ratio,p50_us,p99_us,status"
+for mss in $MSS_LIST; do
+  for window in $WINDOW_LIST; do
+    for count in $SERVER_LIST; do
+      for name in $PROFILE_LIST; do
+        run "$mss" "$window" "$count" "$name"
+      done
+    done
+  done
+done
@@ -0,0 +1,312 @@
+/*
+ * Checksum kernels shared by the P2MP-FTP client and server. See checksum.h
+ * for the checksum types.
+ *
+ * The one's complement sum is accumulated in 64 bits, eight bytes at a time
+ * on the scalar path and sixteen or thirty-two bytes at a time on the SIMD
+ * paths, and only folded down to 16 bits with end-around carry at the end.
+ * Since 2^16 = 1 modulo 2^16 - 1, summing wider words gives the same result
+ * as summing 16-bit words, and summing words in host byte order gives the
+ * byte swapped result on a little endian host (RFC 1071, section 2).
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CHECKSUM_NEON
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CHECKSUM_ARM_CRC
+#endif
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+/* Kernels picked by initChecksum() for the CPU the program runs on */
+static uint64_t (*inetSumKernel)(const unsigned char *buffer, size_t bufferSize, size_t *done);
+static uint32_t (*crc32cKernel)(uint32_t crc, const unsigned char *buffer, size_t bufferSize);
+
+/* Lookup table for the portable CRC32C kernel */
+static uint32_t crc32cTable[256];
+
+/*
+ * Adds word to sum with end-around carry
+ */
+static inline uint64_t addCarry(uint64_t sum, uint64_t word) {
+  sum += word;
+  return sum + (sum < word);
+}
+
+/*
+ * Folds a 64-bit one's complement sum down to 16 bits
+ */
+static uint16_t foldSum(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t) sum;
+}
+
+/*
+ * Portable one's complement sum of buffer, eight bytes at a time. The last
+ * odd byte is padded with a zero byte as RFC 1071 requires.
+ */
+static uint64_t inetSumScalar(const unsigned char *buffer, size_t bufferSize) {
+  uint64_t sum = 0;
+  uint64_t word64;
+  uint32_t word32;
+  uint16_t word16;
+
+  while (bufferSize >= 8) {
+    memcpy(&word64, buffer, 8);
+    sum = addCarry(sum, word64);
+    buffer += 8;
+    bufferSize -= 8;
+  }
+  if (bufferSize >= 4) {
+    memcpy(&word32, buffer, 4);
+    sum = addCarry(sum, word32);
+    buffer += 4;
+    bufferSize -= 4;
+  }
+  if (bufferSize >= 2) {
+    memcpy(&word16, buffer, 2);
+    sum = addCarry(sum, word16);
+    buffer += 2;
+    bufferSize -= 2;
+  }
+  if (bufferSize == 1) {
+    word16 = 0;
+    memcpy(&word16, buffer, 1);
+    sum = addCarry(sum, word16);
+  }
+  return sum;
+}
+
+/*
+ * Kernel used when no SIMD path is available, which sums the whole buffer
+ */
+static uint64_t inetSumPortable(const unsigned char *buffer, size_t bufferSize, size_t *done) {
+  *done = bufferSize;
+  return inetSumScalar(buffer, bufferSize);
+}
+
+#ifdef CHECKSUM_X86
+/*
+ * SSE2 one's complement sum. Each 32-bit word of a 16 byte block is widened
+ * to 64 bits and added to one of two 64-bit lanes, which cannot overflow for
+ * any buffer a datagram can hold. Returns the sum of the first *done bytes.
+ */
+__attribute__((target("sse2")))
+static uint64_t inetSumSse2(const unsigned char *buffer, size_t bufferSize, size_t *done) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = zero;
+  __m128i acc1 = zero;
+  size_t i = 0;
+
+  for (; i + 32 <= bufferSize; i += 32) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *) (buffer + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i *) (buffer + i + 16));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v0, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v0, zero));
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v1, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v1, zero));
+  }
+
+  uint64_t lanes[4];
+  _mm_storeu_si128((__m128i *) lanes, acc0);
+  _mm_storeu_si128((__m128i *) (lanes + 2), acc1);
+  *done = i;
+  return addCarry(addCarry(lanes[0], lanes[1]), addCarry(lanes[2], lanes[3]));
+}
+
+/*
+ * AVX2 one's complement sum, the same as the SSE2 kernel with 32 byte blocks
+ */
+__attribute__((target("avx2")))
+static uint64_t inetSumAvx2(const unsigned char *buffer, size_t bufferSize, size_t *done) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = zero;
+  __m256i acc1 = zero;
+  size_t i = 0;
+
+  for (; i + 64 <= bufferSize; i += 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *) (buffer + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *) (buffer + i + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+  }
+
+  uint64_t lanes[8];
+  _mm256_storeu_si256((__m256i *) lanes, acc0);
+  _mm256_storeu_si256((__m256i *) (lanes + 4), acc1);
+  *done = i;
+  uint64_t sum = 0;
+  for (int lane = 0; lane < 8; lane++)
+    sum = addCarry(sum, lanes[lane]);
+  return sum;
+}
+
+/*
+ * CRC32C using the SSE4.2 crc32 instruction, eight bytes at a time on x86-64
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *buffer, size_t bufferSize) {
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  uint64_t word64;
+
+  while (bufferSize >= 8) {
+    memcpy(&word64, buffer, 8);
+    crc64 = _mm_crc32_u64(crc64, word64);
+    buffer += 8;
+    bufferSize -= 8;
+  }
+  crc = (uint32_t) crc64;
+#endif
+  while (bufferSize > 0) {
+    crc = _mm_crc32_u8(crc, *buffer);
+    buffer++;
+    bufferSize--;
+  }
+  return crc;
+}
+#endif
+
+#ifdef CHECKSUM_NEON
+/*
+ * NEON one's complement sum. Pairs of 32-bit words are added into 64-bit
+ * lanes with vpadalq, which cannot overflow for any datagram sized buffer.
+ */
+static uint64_t inetSumNeon(const unsigned char *buffer, size_t bufferSize, size_t *done) {
+  uint64x2_t acc0 = vdupq_n_u64(0);
+  uint64x2_t acc1 = vdupq_n_u64(0);
+  size_t i = 0;
+
+  for (; i + 32 <= bufferSize; i += 32) {
+    acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(buffer + i)));
+    acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(buffer + i + 16)));
+  }
+
+  *done = i;
+  return addCarry(addCarry(vgetq_lane_u64(acc0, 0), vgetq_lane_u64(acc0, 1)),
+                  addCarry(vgetq_lane_u64(acc1, 0), vgetq_lane_u64(acc1, 1)));
+}
+#endif
+
+#ifdef CHECKSUM_ARM_CRC
+/*
+ * CRC32C using the ARMv8 crc32c instructions, eight bytes at a time
+ */
+__attribute__((target("+crc")))
+static uint32_t crc32cArm(uint32_t crc, const unsigned char *buffer, size_t bufferSize) {
+  uint64_t word64;
+
+  while (bufferSize >= 8) {
+    memcpy(&word64, buffer, 8);
+    crc = __builtin_aarch64_crc32cx(crc, word64);
+    buffer += 8;
+    bufferSize -= 8;
+  }
+  while (bufferSize > 0) {
+    crc = __builtin_aarch64_crc32cb(crc, *buffer);
+    buffer++;
+    bufferSize--;
+  }
+  return crc;
+}
+#endif
+
+/*
+ * Portable table driven CRC32C, one byte at a time
+ */
+static uint32_t crc32cPortable(uint32_t crc, const unsigned char *buffer, size_t bufferSize) {
+  while (bufferSize > 0) {
+    crc = crc32cTable[(crc ^ *buffer) & 0xFF] ^ (crc >> 8);
+    buffer++;
+    bufferSize--;
+  }
+  return crc;
+}
+
+/*
+ * Picks the checksum kernels for the CPU before main() runs, so the choice
+ * is made once and never races with threads calling calculateChecksum()
+ */
+__attribute__((constructor))
+static void initChecksum(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32cTable[i] = crc;
+  }
+
+  inetSumKernel = inetSumPortable;
+  crc32cKernel = crc32cPortable;
+
+#ifdef CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    inetSumKernel = inetSumAvx2;
+  else if (__builtin_cpu_supports("sse2"))
+    inetSumKernel = inetSumSse2;
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32cKernel = crc32cSse42;
+#endif
+
+#ifdef CHECKSUM_NEON
+  inetSumKernel = inetSumNeon;
+#endif
+
+#ifdef CHECKSUM_ARM_CRC
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    crc32cKernel = crc32cArm;
+#endif
+}
+
+/*
+ * Calculates the checksum of the given type over bufferSize bytes of buffer
+ */
+uint32_t calculateChecksum(int type, const void *buffer, size_t bufferSize) {
+  const unsigned char *bytes = buffer;
+
+  if (type == CHECKSUM_CRC32C)
+    return ~crc32cKernel(0xFFFFFFFF, bytes, bufferSize);
+
+  // the SIMD kernel sums whole blocks, and the scalar path sums the rest
+  size_t done;
+  uint64_t sum = inetSumKernel(bytes, bufferSize, &done);
+  sum = addCarry(sum, inetSumScalar(bytes + done, bufferSize - done));
+
+  // take the one's complement, as the value of sum over big endian words
+  return ntohs((uint16_t) ~foldSum(sum));
+}
+
+/*
+ * Returns the checksum type with the given name ("inet" or "crc32c"),
+ * or -1 if the name is not known
+ */
+int checksumType(const char *name) {
+  if (strcmp(name, "inet") == 0)
+    return CHECKSUM_INET;
+  if (strcmp(name, "crc32c") == 0)
+    return CHECKSUM_CRC32C;
+  return -1;
+}
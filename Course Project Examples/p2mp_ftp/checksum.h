@@ -0,0 +1,37 @@
+/*
+ * Checksums shared by the P2MP-FTP client and server to detect corrupted
+ * data packets.
+ *
+ * CHECKSUM_INET is the 16-bit one's complement sum of RFC 1071 taken over big
+ * endian 16-bit words, as in the IP header, so both ends agree on its value
+ * on any architecture. CHECKSUM_CRC32C is the Castagnoli CRC used by iSCSI
+ * and SCTP, which catches far more errors at the cost of a 32-bit field.
+ *
+ * Both are computed with the fastest kernel the CPU supports, which is picked
+ * once at runtime: SSE2 or AVX2 on x86 and NEON on ARM for the one's
+ * complement sum, and the SSE4.2 or ARMv8 CRC instructions for CRC32C, with
+ * portable fallbacks for everything else.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHECKSUM_INET 0
+#define CHECKSUM_CRC32C 1
+#define SUPPORTED_CHECKSUMS (1u << CHECKSUM_INET | 1u << CHECKSUM_CRC32C)
+
+/*
+ * Calculates the checksum of the given type over bufferSize bytes of buffer
+ */
+uint32_t calculateChecksum(int type, const void *buffer, size_t bufferSize);
+
+/*
+ * Returns the checksum type with the given name ("inet" or "crc32c"),
+ * or -1 if the name is not known
+ */
+int checksumType(const char *name);
+
+#endif
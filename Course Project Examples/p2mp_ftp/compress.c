@@ -0,0 +1,232 @@
+/*
+ * LZ4 block codec shared by the P2MP-FTP client and server. See compress.h.
+ *
+ * Every sequence starts with a token whose upper half is the number of
+ * literals and lower half the match length less LZ4_MIN_MATCH, either half
+ * continued in extra bytes of 255 when it is 15. The literals follow, then
+ * the 16-bit little endian offset of the match and the extra match length
+ * bytes. The last sequence has literals only, and as the format requires
+ * the last LZ4_LAST_LITERALS bytes are always literals and no match starts
+ * within LZ4_MFLIMIT bytes of the end.
+ *
+ * The compressor hashes every four bytes to the last position they were
+ * seen at. It steps through data without matches faster and faster, by one
+ * more byte every 2^LZ4_SKIP_TRIGGER misses times the speed, so that
+ * incompressible data costs little time.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_SKIP_TRIGGER 6
+#define LZ4_MAX_OFFSET 65535
+
+/*
+ * Reads four bytes from any alignment
+ */
+static uint32_t read32(const unsigned char *p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+/*
+ * Returns the hash table slot of the four bytes at p
+ */
+static uint32_t lz4Hash(const unsigned char *p) {
+  return (read32(p) * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/*
+ * Writes the extra bytes of a length of at least 15, returning the output
+ * position after them
+ */
+static unsigned char *writeLength(unsigned char *op, size_t length) {
+  for (length -= 15; length >= 255; length -= 255)
+    *op++ = 255;
+  *op++ = (unsigned char) length;
+  return op;
+}
+
+/*
+ * Writes one sequence of literals from anchor, followed by a match of
+ * matchLength bytes at offset unless matchLength is 0. Returns the output
+ * position after it, or NULL if it does not fit before opEnd.
+ */
+static unsigned char *writeSequence(unsigned char *op, unsigned char *opEnd, const unsigned char *anchor,
+                                    size_t literals, size_t offset, size_t matchLength) {
+  size_t needed = 1 + literals + literals / 255 + 1 + (matchLength > 0 ? 2 + matchLength / 255 + 1 : 0);
+  if (needed > (size_t) (opEnd - op))
+    return NULL;
+
+  size_t extra = matchLength > 0 ? matchLength - LZ4_MIN_MATCH : 0;
+  unsigned char *token = op++;
+  *token = (unsigned char) ((literals < 15 ? literals : 15) << 4 | (extra < 15 ? extra : 15));
+  if (literals >= 15)
+    op = writeLength(op, literals);
+  memcpy(op, anchor, literals);
+  op += literals;
+
+  if (matchLength > 0) {
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    if (extra >= 15)
+      op = writeLength(op, extra);
+  }
+  return op;
+}
+
+/*
+ * Compresses size bytes of src into the LZ4 block format
+ */
+static int lz4Compress(const unsigned char *src, int size, unsigned char *dst, int capacity, int speed) {
+  uint32_t table[1 << LZ4_HASH_LOG];
+  const unsigned char *ip = src;
+  const unsigned char *anchor = src;
+  const unsigned char *end = src + size;
+  const unsigned char *matchLimit = end - LZ4_LAST_LITERALS;
+  const unsigned char *mfLimit = end - LZ4_MFLIMIT;
+  unsigned char *op = dst;
+  unsigned char *opEnd = dst + capacity;
+
+  if (size > LZ4_MFLIMIT) {
+    memset(table, '\0', sizeof(table));
+    ip++;
+
+    while (ip < mfLimit) {
+      // look for a match, stepping faster the longer there is none
+      const unsigned char *match;
+      int searches = speed << LZ4_SKIP_TRIGGER;
+      int step = 1;
+      while (true) {
+        uint32_t slot = lz4Hash(ip);
+        match = src + table[slot];
+        table[slot] = (uint32_t) (ip - src);
+        if (match < ip && ip - match <= LZ4_MAX_OFFSET && read32(match) == read32(ip))
+          break;
+        ip += step;
+        step = searches++ >> LZ4_SKIP_TRIGGER;
+        if (ip >= mfLimit)
+          goto lastLiterals;
+      }
+
+      // extend it backwards over the literals and forwards as far as it goes
+      while (ip > anchor && match > src && ip[-1] == match[-1]) {
+        ip--;
+        match--;
+      }
+      const unsigned char *matchEnd = ip + LZ4_MIN_MATCH;
+      const unsigned char *reference = match + LZ4_MIN_MATCH;
+      while (matchEnd < matchLimit && *matchEnd == *reference) {
+        matchEnd++;
+        reference++;
+      }
+
+      op = writeSequence(op, opEnd, anchor, ip - anchor, ip - match, matchEnd - ip);
+      if (op == NULL)
+        return 0;
+      ip = matchEnd;
+      anchor = ip;
+      if (ip < mfLimit)
+        table[lz4Hash(ip - 2)] = (uint32_t) (ip - 2 - src);
+    }
+  }
+
+lastLiterals:
+  op = writeSequence(op, opEnd, anchor, end - anchor, 0, 0);
+  return op == NULL ? 0 : (int) (op - dst);
+}
+
+/*
+ * Reads the extra bytes of a length that is 15 in its token. Returns false
+ * if the input ends first.
+ */
+static bool readLength(const unsigned char **ip, const unsigned char *end, size_t *length) {
+  unsigned char byte;
+  do {
+    if (*ip >= end)
+      return false;
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/*
+ * Decompresses an LZ4 block, checking every length and offset against the
+ * buffers
+ */
+static int lz4Decompress(const unsigned char *src, int size, unsigned char *dst, int capacity) {
+  const unsigned char *ip = src;
+  const unsigned char *end = src + size;
+  unsigned char *op = dst;
+  unsigned char *opEnd = dst + capacity;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !readLength(&ip, end, &literals))
+      return -1;
+    if (literals > (size_t) (end - ip) || literals > (size_t) (opEnd - op))
+      return -1;
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+
+    // the last sequence has no match
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return -1;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t length = token & 0x0F;
+    if (length == 15 && !readLength(&ip, end, &length))
+      return -1;
+    length += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > (size_t) (op - dst) || length > (size_t) (opEnd - op))
+      return -1;
+
+    // byte by byte, as the match may overlap what it is copied to
+    const unsigned char *match = op - offset;
+    for (size_t i = 0; i < length; i++)
+      op[i] = match[i];
+    op += length;
+  }
+  return (int) (op - dst);
+}
+
+/*
+ * Returns the codec with the given name, or -1 if the name is not known
+ */
+int codecType(const char *name) {
+  if (strcmp(name, "lz4") == 0)
+    return CODEC_LZ4;
+  return -1;
+}
+
+/*
+ * Compresses size bytes of src into dst with the given codec
+ */
+int compressData(int codec, int speed, const void *src, int size, void *dst, int capacity) {
+  if (codec != CODEC_LZ4 || size > LZ4_MAX_OFFSET + 1)
+    return 0;
+  return lz4Compress(src, size, dst, capacity, speed > 0 ? speed : 1);
+}
+
+/*
+ * Decompresses size bytes of src into dst with the given codec
+ */
+int decompressData(int codec, const void *src, int size, void *dst, int capacity) {
+  if (codec != CODEC_LZ4)
+    return -1;
+  return lz4Decompress(src, size, dst, capacity);
+}
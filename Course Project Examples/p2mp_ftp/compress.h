@@ -0,0 +1,41 @@
+/*
+ * Segment compression shared by the P2MP-FTP client and server.
+ *
+ * CODEC_LZ4 is the LZ4 block format: a sequence of literal runs, each
+ * followed by a back reference into the last 64 KiB of output. It is
+ * compressed with a single probe hash table, which keeps the compressor
+ * well above network speed, and the speed can be raised further at the
+ * cost of ratio by skipping ahead faster through data that does not match.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#define CODEC_NONE 0
+#define CODEC_LZ4 1
+
+#define CODEC_MASK(codec) (1u << (codec))
+/* Codecs this build can decompress, advertised by the server in its acks */
+#define SUPPORTED_CODECS CODEC_MASK(CODEC_LZ4)
+
+/*
+ * Returns the codec with the given name ("lz4"), or -1 if the name is not
+ * known
+ */
+int codecType(const char *name);
+
+/*
+ * Compresses size bytes of src into dst with the given codec, skipping
+ * ahead faster through unmatched data the higher speed is, starting at 1.
+ * Returns the compressed size, or 0 if it would not fit in capacity bytes.
+ */
+int compressData(int codec, int speed, const void *src, int size, void *dst, int capacity);
+
+/*
+ * Decompresses size bytes of src into dst with the given codec. Returns the
+ * decompressed size, or -1 if src is corrupt or would not fit in capacity
+ * bytes.
+ */
+int decompressData(int codec, const void *src, int size, void *dst, int capacity);
+
+#endif
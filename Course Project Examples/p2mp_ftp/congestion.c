@@ -0,0 +1,245 @@
+/*
+ * Congestion controllers of the P2MP-FTP client. See congestion.h for the
+ * algorithms.
+ *
+ * Every algorithm is a table of the functions that update the window and
+ * the pacing rate on acks and losses, picked by name when the client
+ * starts. Pacing itself is shared: every segment sent moves the earliest
+ * time of the next one on by one interval at the pacing rate. A sender that
+ * wakes up late may catch up on at most PACING_SLACK_USEC worth of segments
+ * at once, which keeps bursts short without losing rate to timer slack.
+ */
+
+#include <string.h>
+
+#include "congestion.h"
+
+#define INITIAL_WINDOW 10
+#define MIN_WINDOW 2
+#define PACING_SLACK_USEC 1000
+#define RENO_SLOW_START_GAIN 2.0
+#define RENO_AVOIDANCE_GAIN 1.25
+#define BBR_HIGH_GAIN 2.885
+#define BBR_CWND_GAIN 2.0
+#define BBR_FULL_BW_GROWTH 1.25
+#define BBR_FULL_BW_ROUNDS 3
+#define BBR_MIN_RTT_USEC 10000000
+#define BBR_CYCLE_LENGTH 8
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+
+/*
+ * Functions of one congestion control algorithm
+ */
+struct congestion_ops_t {
+  const char *name;
+  void (*acked)(Congestion *cc, int acked, long long srtt, long long rttSample, int inFlight, long long now);
+  void (*lost)(Congestion *cc, bool repeated);
+};
+
+/* Pacing gains of the rounds of BBR's bandwidth probing cycle */
+static const double bbrCycleGains[BBR_CYCLE_LENGTH] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+/*
+ * Keeps the window between the smallest useful one and maxWindow
+ */
+static void clampWindow(Congestion *cc) {
+  if (cc->cwnd < MIN_WINDOW)
+    cc->cwnd = MIN_WINDOW;
+  if (cc->cwnd > cc->maxWindow)
+    cc->cwnd = cc->maxWindow;
+}
+
+/*
+ * Reno grows the window exponentially below the slow start threshold and by
+ * about one segment per round trip above it, pacing a little faster than
+ * the window drains so that pacing never limits the window
+ */
+static void renoAcked(Congestion *cc, int acked, long long srtt, long long rttSample, int inFlight, long long now) {
+  (void) rttSample;
+  (void) inFlight;
+  (void) now;
+
+  if (cc->cwnd < cc->ssthresh)
+    cc->cwnd += acked;
+  else
+    cc->cwnd += (double) acked / cc->cwnd;
+  clampWindow(cc);
+
+  if (srtt > 0) {
+    double gain = cc->cwnd < cc->ssthresh ? RENO_SLOW_START_GAIN : RENO_AVOIDANCE_GAIN;
+    cc->pacingRate = gain * cc->cwnd * 1000000.0 / srtt;
+  }
+}
+
+/*
+ * Reno halves the window on loss, and starts over from the smallest window
+ * when the timeout keeps expiring
+ */
+static void renoLost(Congestion *cc, bool repeated) {
+  cc->ssthresh = cc->cwnd / 2 > MIN_WINDOW ? cc->cwnd / 2 : MIN_WINDOW;
+  cc->cwnd = repeated ? MIN_WINDOW : cc->ssthresh;
+  clampWindow(cc);
+}
+
+/*
+ * Returns BBR's estimate of the bottleneck bandwidth in segments per
+ * second, the highest delivery rate of the last BBR_BW_ROUNDS rounds
+ */
+static double bbrBandwidth(Congestion *cc) {
+  double bw = 0;
+  for (int i = 0; i < BBR_BW_ROUNDS; i++)
+    bw = cc->bwSamples[i] > bw ? cc->bwSamples[i] : bw;
+  return bw;
+}
+
+/*
+ * BBR measures the delivery rate once a round, a propagation delay long,
+ * and sets the pacing rate and the window from the bandwidth and delay it
+ * has seen. It starts up doubling the rate every round until the bandwidth
+ * stops growing, drains the queue that built up, then cycles the pacing
+ * gain to probe for more bandwidth and drain what the probe queued.
+ */
+static void bbrAcked(Congestion *cc, int acked, long long srtt, long long rttSample, int inFlight, long long now) {
+  if (rttSample > 0 && (cc->minRtt == 0 || rttSample <= cc->minRtt || now - cc->minRttTime > BBR_MIN_RTT_USEC)) {
+    cc->minRtt = rttSample;
+    cc->minRttTime = now;
+  }
+
+  if (cc->roundStart == 0)
+    cc->roundStart = now;
+  cc->roundDelivered += acked;
+
+  long long roundLength = cc->minRtt > 0 ? cc->minRtt : srtt;
+  if (roundLength > 0 && now - cc->roundStart >= roundLength) {
+    double sample = cc->roundDelivered * 1000000.0 / (now - cc->roundStart);
+    cc->round++;
+    cc->bwSamples[cc->round % BBR_BW_ROUNDS] = sample;
+    cc->roundStart = now;
+    cc->roundDelivered = 0;
+
+    double bw = bbrBandwidth(cc);
+    if (cc->mode == BBR_STARTUP) {
+      if (bw >= cc->fullBw * BBR_FULL_BW_GROWTH) {
+        cc->fullBw = bw;
+        cc->fullBwRounds = 0;
+      } else if (++cc->fullBwRounds >= BBR_FULL_BW_ROUNDS) {
+        cc->mode = BBR_DRAIN;
+      }
+    } else if (cc->mode == BBR_PROBE_BW) {
+      cc->cycleIndex = (cc->cycleIndex + 1) % BBR_CYCLE_LENGTH;
+    }
+  }
+
+  double bw = bbrBandwidth(cc);
+  if (bw == 0 || cc->minRtt == 0) {
+    // no estimate yet, so pace the initial window out over a round trip
+    if (srtt > 0)
+      cc->pacingRate = BBR_HIGH_GAIN * cc->cwnd * 1000000.0 / srtt;
+    return;
+  }
+
+  double bdp = bw * cc->minRtt / 1000000.0;
+  if (cc->mode == BBR_DRAIN && inFlight <= bdp)
+    cc->mode = BBR_PROBE_BW;
+
+  double pacingGain = cc->mode == BBR_STARTUP ? BBR_HIGH_GAIN
+                    : cc->mode == BBR_DRAIN ? 1 / BBR_HIGH_GAIN : bbrCycleGains[cc->cycleIndex];
+  double cwndGain = cc->mode == BBR_PROBE_BW ? BBR_CWND_GAIN : BBR_HIGH_GAIN;
+  cc->pacingRate = pacingGain * bw;
+  cc->cwnd = cwndGain * bdp;
+  clampWindow(cc);
+}
+
+/*
+ * BBR does not take loss as a sign of congestion, since its model already
+ * bounds the queue it builds, other than falling back to the smallest
+ * window while the timeout keeps expiring
+ */
+static void bbrLost(Congestion *cc, bool repeated) {
+  if (repeated) {
+    cc->cwnd = MIN_WINDOW;
+    clampWindow(cc);
+  }
+}
+
+/* Algorithms by type, the first of which leaves the window open */
+static const CongestionOps algorithms[] = {
+  [CONGESTION_NONE] = { "none", NULL, NULL },
+  [CONGESTION_RENO] = { "reno", renoAcked, renoLost },
+  [CONGESTION_BBR] = { "bbr", bbrAcked, bbrLost },
+};
+
+/*
+ * Returns the congestion control type with the given name, or -1 if the
+ * name is not known
+ */
+int congestionType(const char *name) {
+  for (int type = 0; type < (int) (sizeof(algorithms) / sizeof(algorithms[0])); type++) {
+    if (strcmp(name, algorithms[type].name) == 0)
+      return type;
+  }
+  return -1;
+}
+
+/*
+ * Starts the controller of a path with the initial window, unpaced until
+ * the first round trip time sample
+ */
+void initCongestion(Congestion *cc, int type, int maxWindow) {
+  memset(cc, '\0', sizeof(Congestion));
+  cc->ops = &algorithms[type];
+  cc->maxWindow = maxWindow;
+  cc->cwnd = type == CONGESTION_NONE ? maxWindow : INITIAL_WINDOW;
+  cc->ssthresh = maxWindow;
+  cc->recoverySeqNum = -1;
+  clampWindow(cc);
+}
+
+/*
+ * Passes newly acknowledged segments on to the algorithm
+ */
+void congestionAcked(Congestion *cc, int acked, long long srtt, long long rttSample, int inFlight, long long now) {
+  if (cc->ops->acked != NULL && acked > 0)
+    cc->ops->acked(cc, acked, srtt, rttSample, inFlight, now);
+}
+
+/*
+ * Passes a loss on to the algorithm, unless it was in flight before the
+ * window was last cut back, as the cut already accounts for it
+ */
+void congestionLost(Congestion *cc, int seqNum, int nextSeqNum, bool repeated) {
+  if (cc->ops->lost == NULL || (seqNum < cc->recoverySeqNum && !repeated))
+    return;
+  cc->recoverySeqNum = nextSeqNum;
+  cc->ops->lost(cc, repeated);
+}
+
+/*
+ * Returns the number of segments the congestion window lets be in flight
+ */
+int congestionWindow(Congestion *cc) {
+  return (int) cc->cwnd;
+}
+
+/*
+ * Returns the number of microseconds until pacing lets the next segment be
+ * sent, or 0 if it may be sent now
+ */
+long long congestionSendDelay(Congestion *cc, long long now) {
+  if (cc->pacingRate <= 0 || cc->nextSendTime <= now)
+    return 0;
+  return (long long) (cc->nextSendTime - now) + 1;
+}
+
+/*
+ * Charges a segment sent now against the pacing rate
+ */
+void congestionSent(Congestion *cc, long long now) {
+  if (cc->pacingRate <= 0)
+    return;
+  if (cc->nextSendTime < now - PACING_SLACK_USEC)
+    cc->nextSendTime = now - PACING_SLACK_USEC;
+  cc->nextSendTime += 1000000.0 / cc->pacingRate;
+}
@@ -0,0 +1,102 @@
+/*
+ * Congestion control and pacing for the P2MP-FTP client.
+ *
+ * Every server is sent to through its own controller, which bounds the
+ * segments in flight on the path to it with a congestion window and spaces
+ * them out at a pacing rate, so that a large send window fills the path
+ * instead of flooding its bottleneck queue.
+ *
+ * CONGESTION_NONE leaves only the send window in place, as without
+ * congestion control. CONGESTION_RENO grows the window by one segment per
+ * acked segment in slow start and by one segment per round trip after,
+ * halves it when a timer expires, and paces at twice or 1.25 times the
+ * window per round trip. CONGESTION_BBR estimates the bottleneck bandwidth
+ * as the highest delivery rate of the last rounds and the propagation delay
+ * as the lowest round trip time, paces near their product and keeps the
+ * window at twice it, probing for more bandwidth in a cycle of gains.
+ */
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <stdbool.h>
+
+#define CONGESTION_NONE 0
+#define CONGESTION_RENO 1
+#define CONGESTION_BBR 2
+
+#define BBR_BW_ROUNDS 10
+
+typedef struct congestion_ops_t CongestionOps;
+
+/*
+ * State of the controller of one path. The window and the pacing rate are
+ * in segments, the pacing rate in segments per second, where 0 disables
+ * pacing, and the time the next segment may be sent in fractional
+ * microseconds, so that short intervals add up exactly.
+ */
+typedef struct congestion_t {
+  const CongestionOps *ops;
+  double cwnd;
+  double maxWindow;
+  double ssthresh;
+  int recoverySeqNum;
+  double pacingRate;
+  double nextSendTime;
+
+  // the bandwidth filter, round counting and state of BBR
+  int mode;
+  double bwSamples[BBR_BW_ROUNDS];
+  int round;
+  long long roundStart;
+  int roundDelivered;
+  double fullBw;
+  int fullBwRounds;
+  long long minRtt;
+  long long minRttTime;
+  int cycleIndex;
+} Congestion;
+
+/*
+ * Returns the congestion control type with the given name ("none", "reno"
+ * or "bbr"), or -1 if the name is not known
+ */
+int congestionType(const char *name);
+
+/*
+ * Starts the controller of a path with the given type, never letting the
+ * window grow beyond maxWindow segments
+ */
+void initCongestion(Congestion *cc, int type, int maxWindow);
+
+/*
+ * Tells the controller that acked segments were newly acknowledged, with
+ * the smoothed round trip time of the path, a new round trip time sample
+ * or 0, and the number of segments still in flight
+ */
+void congestionAcked(Congestion *cc, int acked, long long srtt, long long rttSample, int inFlight, long long now);
+
+/*
+ * Tells the controller that the timer of segment seqNum expired while
+ * segments up to nextSeqNum were in flight, repeatedly if the timeout has
+ * already been backed off. Only one loss per window of data is reacted to.
+ */
+void congestionLost(Congestion *cc, int seqNum, int nextSeqNum, bool repeated);
+
+/*
+ * Returns the number of segments the congestion window lets be in flight
+ */
+int congestionWindow(Congestion *cc);
+
+/*
+ * Returns the number of microseconds until pacing lets the next segment be
+ * sent, or 0 if it may be sent now
+ */
+long long congestionSendDelay(Congestion *cc, long long now);
+
+/*
+ * Charges a segment sent now against the pacing rate
+ */
+void congestionSent(Congestion *cc, long long now);
+
+#endif
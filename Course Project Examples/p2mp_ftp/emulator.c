@@ -0,0 +1,175 @@
+/*
+ * Network emulator for the P2MP-FTP server. See emulator.h for what it
+ * emulates.
+ *
+ * Held datagrams are kept in a binary min-heap ordered by the time they are
+ * due, and by arrival among those due at the same time, so a path with a
+ * fixed delay and no jitter never reorders. Decisions are drawn from
+ * splitmix64, which gives full resolution probabilities from any seed, a
+ * seed of zero included.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+
+/* Most datagrams held at once, past which the path drops them */
+#define MAX_HELD 65536
+
+/* One datagram waiting for its path delay to pass */
+typedef struct held_t {
+  long long due;
+  uint64_t order;
+  int size;
+  struct sockaddr_in addr;
+  char *data;
+} Held;
+
+struct emulator_t {
+  double lossProb;
+  long long delayUsec;
+  long long jitterUsec;
+  double reorderProb;
+  long long reorderUsec;
+  uint64_t state;
+  uint64_t arrivals;
+  Held *heap;
+  int numHeld;
+};
+
+/*
+ * Returns the next 64 bits of the splitmix64 sequence
+ */
+static uint64_t nextRandom(Emulator *emulator) {
+  uint64_t z = (emulator->state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+/*
+ * Returns a uniformly distributed double in [0, 1)
+ */
+static double nextUniform(Emulator *emulator) {
+  return (nextRandom(emulator) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Returns whether held datagram a is due before b
+ */
+static bool dueBefore(const Held *a, const Held *b) {
+  return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+/*
+ * Starts an emulator with the given path and seed
+ */
+Emulator *startEmulator(double lossProb, long long delayUsec, long long jitterUsec,
+                        double reorderProb, long long reorderUsec, uint64_t seed) {
+  Emulator *emulator = calloc(1, sizeof(Emulator));
+  if (emulator == NULL) {
+    printf("Fatal Error allocating the network emulator\n");
+    exit(1);
+  }
+  emulator->lossProb = lossProb;
+  emulator->delayUsec = delayUsec;
+  emulator->jitterUsec = jitterUsec;
+  emulator->reorderProb = reorderProb;
+  emulator->reorderUsec = reorderUsec;
+  emulator->state = seed;
+  return emulator;
+}
+
+/*
+ * Returns whether the next datagram is to be dropped
+ */
+bool emulateLoss(Emulator *emulator) {
+  return emulator->lossProb > 0 && nextUniform(emulator) < emulator->lossProb;
+}
+
+/*
+ * Holds a copy of a datagram for its path delay, if it has any
+ */
+bool holdDatagram(Emulator *emulator, const void *datagram, int size, const struct sockaddr_in *addr, long long now) {
+  long long delay = emulator->delayUsec;
+
+  if (emulator->jitterUsec > 0)
+    delay += nextRandom(emulator) % (uint64_t) (emulator->jitterUsec + 1);
+  if (emulator->reorderProb > 0 && nextUniform(emulator) < emulator->reorderProb)
+    delay += emulator->reorderUsec;
+  if (delay == 0)
+    return false;
+
+  if (emulator->heap == NULL && (emulator->heap = malloc(MAX_HELD * sizeof(Held))) == NULL) {
+    printf("Fatal Error allocating the network emulator\n");
+    exit(1);
+  }
+  // a path holding too much drops what arrives, as a full queue would
+  if (emulator->numHeld == MAX_HELD)
+    return true;
+
+  Held held = { .due = now + delay, .order = emulator->arrivals++, .size = size, .addr = *addr };
+  if ((held.data = malloc(size > 0 ? size : 1)) == NULL) {
+    printf("Fatal Error allocating a held datagram\n");
+    exit(1);
+  }
+  memcpy(held.data, datagram, size);
+
+  // sift the new datagram up to its place in the heap
+  int i = emulator->numHeld++;
+  while (i > 0 && dueBefore(&held, &emulator->heap[(i - 1) / 2])) {
+    emulator->heap[i] = emulator->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  emulator->heap[i] = held;
+  return true;
+}
+
+/*
+ * Returns the first held datagram if it is due by now
+ */
+void *releaseDatagram(Emulator *emulator, long long now, int *size, struct sockaddr_in *addr) {
+  if (emulator->numHeld == 0 || emulator->heap[0].due > now)
+    return NULL;
+
+  Held first = emulator->heap[0];
+  Held last = emulator->heap[--emulator->numHeld];
+
+  // sift the last datagram down from the root into the hole
+  int i = 0;
+  while (2 * i + 1 < emulator->numHeld) {
+    int child = 2 * i + 1;
+    if (child + 1 < emulator->numHeld && dueBefore(&emulator->heap[child + 1], &emulator->heap[child]))
+      child++;
+    if (!dueBefore(&emulator->heap[child], &last))
+      break;
+    emulator->heap[i] = emulator->heap[child];
+    i = child;
+  }
+  emulator->heap[i] = last;
+
+  *size = first.size;
+  *addr = first.addr;
+  return first.data;
+}
+
+/*
+ * Returns the time the first held datagram is due, or -1 if none is held
+ */
+long long nextRelease(Emulator *emulator) {
+  return emulator->numHeld > 0 ? emulator->heap[0].due : -1;
+}
+
+/*
+ * Frees the emulator and every datagram it still holds
+ */
+void stopEmulator(Emulator *emulator) {
+  for (int i = 0; i < emulator->numHeld; i++)
+    free(emulator->heap[i].data);
+  free(emulator->heap);
+  free(emulator);
+}
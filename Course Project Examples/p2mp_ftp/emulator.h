@@ -0,0 +1,61 @@
+/*
+ * Network emulator for the P2MP-FTP server, which stands in for a lossy,
+ * slow and reordering path on loopback so transfers can be measured under
+ * known conditions.
+ *
+ * Every datagram the server receives is passed through it. A datagram is
+ * dropped with the loss probability, and otherwise held for the delay plus
+ * a uniformly distributed share of the jitter before it is handed on. With
+ * the reorder probability a datagram is held for the reorder gap on top of
+ * that, so the ones behind it overtake it. Every decision comes from a
+ * generator seeded on start, so runs with the same seed and the same arrival
+ * order make the same decisions.
+ */
+
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct emulator_t Emulator;
+
+/*
+ * Starts an emulator dropping datagrams with probability lossProb, holding
+ * them delayUsec plus up to jitterUsec microseconds, and reorderUsec more
+ * with probability reorderProb
+ */
+Emulator *startEmulator(double lossProb, long long delayUsec, long long jitterUsec,
+                        double reorderProb, long long reorderUsec, uint64_t seed);
+
+/*
+ * Returns whether the next datagram is to be dropped
+ */
+bool emulateLoss(Emulator *emulator);
+
+/*
+ * Holds a copy of a datagram received at now from addr if its path has any
+ * delay, and returns whether it did. A datagram that is not held is to be
+ * handled right away.
+ */
+bool holdDatagram(Emulator *emulator, const void *datagram, int size, const struct sockaddr_in *addr, long long now);
+
+/*
+ * Returns the held datagram that is due first if it is due by now, along
+ * with its size and source address, or NULL if none is. The caller frees
+ * the datagram.
+ */
+void *releaseDatagram(Emulator *emulator, long long now, int *size, struct sockaddr_in *addr);
+
+/*
+ * Returns the time the first held datagram is due, or -1 if none is held
+ */
+long long nextRelease(Emulator *emulator);
+
+/*
+ * Frees the emulator and every datagram it still holds
+ */
+void stopEmulator(Emulator *emulator);
+
+#endif
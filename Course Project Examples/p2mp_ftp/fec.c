@@ -0,0 +1,321 @@
+/*
+ * Reed-Solomon erasure code shared by the P2MP-FTP client and server. See
+ * fec.h for how blocks are coded.
+ *
+ * GF(256) is taken modulo the polynomial x^8 + x^4 + x^3 + x^2 + 1. Parity
+ * symbol j of a block is the sum over the data symbols i of C[j][i] times
+ * data symbol i, where C[j][i] = 1 / (x_j + y_i) with x_j = 255 - j and
+ * y_i = i. Every square submatrix of a Cauchy matrix is invertible, so the
+ * missing data symbols can be solved for from any parity symbols that are
+ * present.
+ *
+ * Multiplying a symbol by a constant c is done a byte at a time with two 16
+ * entry tables, the products of c with the low and with the high half of a
+ * byte, whose sum is the product with the whole byte. The SIMD kernels look
+ * up 16 or 32 bytes at once with a byte shuffle.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FEC_NEON
+#endif
+
+#define GF_POLY 0x11D
+
+/* Logarithms and powers of the generator 2, the powers doubled up so the
+ * sum of two logarithms needs no reduction */
+static unsigned char gfLog[256];
+static unsigned char gfExp[510];
+
+/* Kernel picked by initFec() for the CPU the program runs on */
+static void (*mulAddKernel)(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size);
+
+/*
+ * Multiplies two elements of GF(256)
+ */
+static unsigned char gfMul(unsigned char a, unsigned char b) {
+  if (a == 0 || b == 0)
+    return 0;
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+/*
+ * Returns the inverse of a non-zero element of GF(256)
+ */
+static unsigned char gfInv(unsigned char a) {
+  return gfExp[255 - gfLog[a]];
+}
+
+/*
+ * Returns element j, i of the Cauchy matrix parity symbols are made with
+ */
+static unsigned char cauchy(int j, int i) {
+  return gfInv((unsigned char) ((255 - j) ^ i));
+}
+
+/*
+ * Fills in the products of c with every low and every high half of a byte
+ */
+static void mulTables(unsigned char c, unsigned char *low, unsigned char *high) {
+  for (int x = 0; x < 16; x++) {
+    low[x] = gfMul(c, (unsigned char) x);
+    high[x] = gfMul(c, (unsigned char) (x << 4));
+  }
+}
+
+/*
+ * Portable kernel adding c times src to dst, one byte at a time
+ */
+static void mulAddPortable(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size) {
+  unsigned char low[16], high[16];
+
+  mulTables(c, low, high);
+  for (size_t i = 0; i < size; i++)
+    dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+}
+
+#ifdef FEC_X86
+/*
+ * SSSE3 kernel adding c times src to dst, 16 bytes at a time
+ */
+__attribute__((target("ssse3")))
+static void mulAddSsse3(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size) {
+  unsigned char low[16], high[16];
+  size_t i = 0;
+
+  mulTables(c, low, high);
+  __m128i lowTable = _mm_loadu_si128((const __m128i *) low);
+  __m128i highTable = _mm_loadu_si128((const __m128i *) high);
+  __m128i mask = _mm_set1_epi8(0x0F);
+
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i lo = _mm_shuffle_epi8(lowTable, _mm_and_si128(v, mask));
+    __m128i hi = _mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(v, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, _mm_xor_si128(lo, hi)));
+  }
+  for (; i < size; i++)
+    dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+}
+
+/*
+ * AVX2 kernel adding c times src to dst, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static void mulAddAvx2(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size) {
+  unsigned char low[16], high[16];
+  size_t i = 0;
+
+  mulTables(c, low, high);
+  __m256i lowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) low));
+  __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) high));
+  __m256i mask = _mm256_set1_epi8(0x0F);
+
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i lo = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(v, mask));
+    __m256i hi = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask));
+    __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, _mm256_xor_si256(lo, hi)));
+  }
+  for (; i < size; i++)
+    dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+}
+#endif
+
+#ifdef FEC_NEON
+/*
+ * NEON kernel adding c times src to dst, 16 bytes at a time
+ */
+static void mulAddNeon(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size) {
+  unsigned char low[16], high[16];
+  size_t i = 0;
+
+  mulTables(c, low, high);
+  uint8x16_t lowTable = vld1q_u8(low);
+  uint8x16_t highTable = vld1q_u8(high);
+  uint8x16_t mask = vdupq_n_u8(0x0F);
+
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t v = vld1q_u8(src + i);
+    uint8x16_t lo = vqtbl1q_u8(lowTable, vandq_u8(v, mask));
+    uint8x16_t hi = vqtbl1q_u8(highTable, vshrq_n_u8(v, 4));
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), veorq_u8(lo, hi)));
+  }
+  for (; i < size; i++)
+    dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+}
+#endif
+
+/*
+ * Adds c times src to dst, skipping the trivial products
+ */
+static void mulAdd(unsigned char *dst, const unsigned char *src, unsigned char c, size_t size) {
+  if (c == 0)
+    return;
+  if (c == 1) {
+    for (size_t i = 0; i < size; i++)
+      dst[i] ^= src[i];
+    return;
+  }
+  mulAddKernel(dst, src, c, size);
+}
+
+/*
+ * Builds the field tables and picks the kernel for the CPU before main()
+ * runs, so the choice is made once and never races with other threads
+ */
+__attribute__((constructor))
+static void initFec(void) {
+  int x = 1;
+
+  for (int i = 0; i < 255; i++) {
+    gfExp[i] = (unsigned char) x;
+    gfExp[i + 255] = (unsigned char) x;
+    gfLog[x] = (unsigned char) i;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= GF_POLY;
+  }
+
+  mulAddKernel = mulAddPortable;
+
+#ifdef FEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    mulAddKernel = mulAddAvx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    mulAddKernel = mulAddSsse3;
+#endif
+
+#ifdef FEC_NEON
+  mulAddKernel = mulAddNeon;
+#endif
+}
+
+/*
+ * Computes the m parity symbols of a block of k data symbols
+ */
+void fecEncode(int k, int m, unsigned char *const *data, unsigned char **parity, size_t symbolSize) {
+  for (int j = 0; j < m; j++) {
+    memset(parity[j], '\0', symbolSize);
+    for (int i = 0; i < k; i++)
+      mulAdd(parity[j], data[i], cauchy(j, i), symbolSize);
+  }
+}
+
+/*
+ * Inverts the n by n matrix a in place with Gauss-Jordan elimination. The
+ * matrix is a square submatrix of a Cauchy matrix, so it is never singular.
+ */
+static void invertMatrix(unsigned char *a, int n) {
+  unsigned char *inverse = calloc((size_t) n * n, 1);
+
+  for (int i = 0; i < n; i++)
+    inverse[i * n + i] = 1;
+
+  for (int col = 0; col < n; col++) {
+    int pivot = col;
+    while (a[pivot * n + col] == 0)
+      pivot++;
+    if (pivot != col) {
+      for (int i = 0; i < n; i++) {
+        unsigned char t = a[col * n + i];
+        a[col * n + i] = a[pivot * n + i];
+        a[pivot * n + i] = t;
+        t = inverse[col * n + i];
+        inverse[col * n + i] = inverse[pivot * n + i];
+        inverse[pivot * n + i] = t;
+      }
+    }
+
+    unsigned char scale = gfInv(a[col * n + col]);
+    for (int i = 0; i < n; i++) {
+      a[col * n + i] = gfMul(a[col * n + i], scale);
+      inverse[col * n + i] = gfMul(inverse[col * n + i], scale);
+    }
+
+    for (int row = 0; row < n; row++) {
+      unsigned char factor = a[row * n + col];
+      if (row == col || factor == 0)
+        continue;
+      for (int i = 0; i < n; i++) {
+        a[row * n + i] ^= gfMul(factor, a[col * n + i]);
+        inverse[row * n + i] ^= gfMul(factor, inverse[col * n + i]);
+      }
+    }
+  }
+
+  memcpy(a, inverse, (size_t) n * n);
+  free(inverse);
+}
+
+/*
+ * Rebuilds the missing data symbols of a block. Taking the present data out
+ * of as many present parity symbols as there are missing data symbols
+ * leaves the missing ones times a square Cauchy submatrix, so multiplying
+ * by its inverse gives them back.
+ */
+int fecDecode(int k, int m, unsigned char **data, const bool *dataPresent,
+              unsigned char *const *parity, const bool *parityPresent, size_t symbolSize) {
+  int missing[FEC_MAX_SYMBOLS];
+  int rows[FEC_MAX_SYMBOLS];
+  int numMissing = 0;
+  int numRows = 0;
+
+  for (int i = 0; i < k; i++) {
+    if (!dataPresent[i])
+      missing[numMissing++] = i;
+  }
+  if (numMissing == 0)
+    return 0;
+  for (int j = 0; j < m && numRows < numMissing; j++) {
+    if (parityPresent[j])
+      rows[numRows++] = j;
+  }
+  if (numRows < numMissing)
+    return -1;
+
+  // syndromes: the parity symbols with the present data taken out
+  unsigned char *syndromes = malloc((size_t) numMissing * symbolSize);
+  unsigned char *matrix = malloc((size_t) numMissing * numMissing);
+  if (syndromes == NULL || matrix == NULL) {
+    free(syndromes);
+    free(matrix);
+    return -1;
+  }
+
+  for (int r = 0; r < numMissing; r++) {
+    unsigned char *syndrome = syndromes + (size_t) r * symbolSize;
+    memcpy(syndrome, parity[rows[r]], symbolSize);
+    for (int i = 0; i < k; i++) {
+      if (dataPresent[i])
+        mulAdd(syndrome, data[i], cauchy(rows[r], i), symbolSize);
+    }
+    for (int e = 0; e < numMissing; e++)
+      matrix[r * numMissing + e] = cauchy(rows[r], missing[e]);
+  }
+
+  invertMatrix(matrix, numMissing);
+
+  for (int e = 0; e < numMissing; e++) {
+    memset(data[missing[e]], '\0', symbolSize);
+    for (int r = 0; r < numMissing; r++)
+      mulAdd(data[missing[e]], syndromes + (size_t) r * symbolSize, matrix[e * numMissing + r], symbolSize);
+  }
+
+  free(syndromes);
+  free(matrix);
+  return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Reed-Solomon erasure code over GF(256) shared by the P2MP-FTP client and
+ * server to repair lost segments without retransmitting them.
+ *
+ * A block of k data symbols is protected by m parity symbols, every symbol
+ * being the same number of bytes. The code is systematic and built from a
+ * Cauchy matrix, so the data symbols are sent as they are and any k of the
+ * k + m symbols of a block are enough to rebuild all of its data, as long as
+ * k + m is at most 256.
+ *
+ * Symbols are multiplied and added with the fastest kernel the CPU supports,
+ * which is picked once at runtime: SSSE3 or AVX2 on x86 and NEON on ARM,
+ * each looking up the products of both halves of every byte with one byte
+ * shuffle, and a portable table driven kernel for everything else.
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FEC_MAX_SYMBOLS 256
+
+/*
+ * Computes the m parity symbols of a block of k data symbols, each
+ * symbolSize bytes long
+ */
+void fecEncode(int k, int m, unsigned char *const *data, unsigned char **parity, size_t symbolSize);
+
+/*
+ * Rebuilds the data symbols of a block that are not present from the parity
+ * symbols that are. Every data pointer must point at a symbol sized buffer,
+ * which is filled in for the missing ones. Returns 0 on success, or -1 if
+ * fewer parity symbols are present than data symbols are missing.
+ */
+int fecDecode(int k, int m, unsigned char **data, const bool *dataPresent,
+              unsigned char *const *parity, const bool *parityPresent, size_t symbolSize);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+ * BLAKE3 hasher shared by the P2MP-FTP client and server. See hash.h.
+ *
+ * This is the portable form of the reference implementation: every 64 byte
+ * block goes through the 7 round compression function, every full chunk
+ * leaves a chaining value, and two subtrees of the same size are merged into
+ * their parent as soon as both are complete, which the number of chunks so
+ * far tells: a chunk completes a new pair for every trailing zero bit of
+ * the count. Only the root node is compressed with ROOT, so the tree is
+ * folded from the right once the input ends.
+ */
+
+#include <string.h>
+
+#include "hash.h"
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t IV[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* Order each round takes the message words in, every one permuting the last */
+static const uint8_t SCHEDULE[7][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+  { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+  { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t rotateRight(uint32_t word, int bits) {
+  return word >> bits | word << (32 - bits);
+}
+
+/*
+ * Mixes the message words x and y into four words of the state
+ */
+static inline void mix(uint32_t *state, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+  state[a] = state[a] + state[b] + x;
+  state[d] = rotateRight(state[d] ^ state[a], 16);
+  state[c] = state[c] + state[d];
+  state[b] = rotateRight(state[b] ^ state[c], 12);
+  state[a] = state[a] + state[b] + y;
+  state[d] = rotateRight(state[d] ^ state[a], 8);
+  state[c] = state[c] + state[d];
+  state[b] = rotateRight(state[b] ^ state[c], 7);
+}
+
+/*
+ * Compresses one block of message words into the chaining value cv, and
+ * leaves the 16 words of output in out, the first 8 of which are the new
+ * chaining value
+ */
+static void compress(const uint32_t *cv, const uint32_t *block, uint64_t counter, uint32_t blockLength,
+                     uint32_t flags, uint32_t *out) {
+  uint32_t state[16] = {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    IV[0], IV[1], IV[2], IV[3], (uint32_t) counter, (uint32_t) (counter >> 32), blockLength, flags,
+  };
+
+  for (int round = 0; round < 7; round++) {
+    const uint8_t *s = SCHEDULE[round];
+    mix(state, 0, 4, 8, 12, block[s[0]], block[s[1]]);
+    mix(state, 1, 5, 9, 13, block[s[2]], block[s[3]]);
+    mix(state, 2, 6, 10, 14, block[s[4]], block[s[5]]);
+    mix(state, 3, 7, 11, 15, block[s[6]], block[s[7]]);
+    mix(state, 0, 5, 10, 15, block[s[8]], block[s[9]]);
+    mix(state, 1, 6, 11, 12, block[s[10]], block[s[11]]);
+    mix(state, 2, 7, 8, 13, block[s[12]], block[s[13]]);
+    mix(state, 3, 4, 9, 14, block[s[14]], block[s[15]]);
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i] = state[i] ^ state[i + 8];
+    out[i + 8] = state[i + 8] ^ cv[i];
+  }
+}
+
+/*
+ * Loads a block of bytes as little endian message words
+ */
+static void loadWords(const uint8_t *bytes, uint32_t *words) {
+  for (int i = 0; i < 16; i++)
+    words[i] = (uint32_t) bytes[4 * i] | (uint32_t) bytes[4 * i + 1] << 8
+               | (uint32_t) bytes[4 * i + 2] << 16 | (uint32_t) bytes[4 * i + 3] << 24;
+}
+
+/*
+ * Returns the flags of the next block compressed in the chunk being hashed,
+ * CHUNK_START for its first
+ */
+static uint32_t chunkFlags(const Hasher *hasher) {
+  return hasher->blocksCompressed == 0 ? CHUNK_START : 0;
+}
+
+/*
+ * Returns the chaining value of the parent of two subtrees in out
+ */
+static void parentCv(const uint32_t *left, const uint32_t *right, uint32_t flags, uint32_t *out) {
+  uint32_t block[16];
+  uint32_t words[16];
+
+  memcpy(block, left, 8 * sizeof(uint32_t));
+  memcpy(block + 8, right, 8 * sizeof(uint32_t));
+  compress(IV, block, 0, HASH_BLOCK_LEN, PARENT | flags, words);
+  memcpy(out, words, 8 * sizeof(uint32_t));
+}
+
+/*
+ * Starts a hash
+ */
+void initHasher(Hasher *hasher) {
+  memcpy(hasher->chunkCv, IV, sizeof(IV));
+  hasher->chunkCounter = 0;
+  memset(hasher->block, '\0', sizeof(hasher->block));
+  hasher->blockLength = 0;
+  hasher->blocksCompressed = 0;
+  hasher->cvStackLength = 0;
+}
+
+/*
+ * Ends the chunk being hashed, which is full: pushes its chaining value,
+ * merging it with the subtrees it completes, and starts the next chunk
+ */
+static void endChunk(Hasher *hasher) {
+  uint32_t block[16];
+  uint32_t words[16];
+  uint32_t cv[8];
+
+  loadWords(hasher->block, block);
+  compress(hasher->chunkCv, block, hasher->chunkCounter, hasher->blockLength,
+           chunkFlags(hasher) | CHUNK_END, words);
+  memcpy(cv, words, sizeof(cv));
+
+  uint64_t totalChunks = hasher->chunkCounter + 1;
+  while ((totalChunks & 1) == 0) {
+    parentCv(hasher->cvStack[--hasher->cvStackLength], cv, 0, cv);
+    totalChunks >>= 1;
+  }
+  memcpy(hasher->cvStack[hasher->cvStackLength++], cv, sizeof(cv));
+
+  memcpy(hasher->chunkCv, IV, sizeof(IV));
+  hasher->chunkCounter++;
+  memset(hasher->block, '\0', sizeof(hasher->block));
+  hasher->blockLength = 0;
+  hasher->blocksCompressed = 0;
+}
+
+/*
+ * Hashes the next size bytes of data. A full block is only compressed once
+ * more input follows it, since the last block of a chunk, and of the input,
+ * is compressed with flags of its own.
+ */
+void updateHasher(Hasher *hasher, const void *data, size_t size) {
+  const uint8_t *input = data;
+
+  while (size > 0) {
+    if (hasher->blockLength == HASH_BLOCK_LEN) {
+      if (hasher->blocksCompressed == HASH_CHUNK_LEN / HASH_BLOCK_LEN - 1) {
+        endChunk(hasher);
+      } else {
+        uint32_t block[16];
+        uint32_t words[16];
+        loadWords(hasher->block, block);
+        compress(hasher->chunkCv, block, hasher->chunkCounter, HASH_BLOCK_LEN, chunkFlags(hasher), words);
+        memcpy(hasher->chunkCv, words, sizeof(hasher->chunkCv));
+        hasher->blocksCompressed++;
+        memset(hasher->block, '\0', sizeof(hasher->block));
+        hasher->blockLength = 0;
+      }
+    }
+
+    size_t take = HASH_BLOCK_LEN - hasher->blockLength;
+    if (take > size)
+      take = size;
+    memcpy(hasher->block + hasher->blockLength, input, take);
+    hasher->blockLength += take;
+    input += take;
+    size -= take;
+  }
+}
+
+/*
+ * Writes the digest of everything hashed so far: the last chunk's output
+ * folded into every subtree to its left in turn, with the last compression
+ * being the root's
+ */
+void finishHasher(const Hasher *hasher, uint8_t *digest) {
+  uint32_t inputCv[8];
+  uint32_t block[16];
+  uint32_t words[16];
+  uint64_t counter = hasher->chunkCounter;
+  uint32_t blockLength = hasher->blockLength;
+  uint32_t flags = chunkFlags(hasher) | CHUNK_END;
+
+  memcpy(inputCv, hasher->chunkCv, sizeof(inputCv));
+  loadWords(hasher->block, block);
+  for (int level = hasher->cvStackLength - 1; level >= 0; level--) {
+    uint32_t cv[8];
+    compress(inputCv, block, counter, blockLength, flags, words);
+    memcpy(cv, words, sizeof(cv));
+    memcpy(block, hasher->cvStack[level], sizeof(cv));
+    memcpy(block + 8, cv, sizeof(cv));
+    memcpy(inputCv, IV, sizeof(IV));
+    counter = 0;
+    blockLength = HASH_BLOCK_LEN;
+    flags = PARENT;
+  }
+
+  compress(inputCv, block, counter, blockLength, flags | ROOT, words);
+  for (int i = 0; i < HASH_SIZE / 4; i++) {
+    digest[4 * i] = words[i];
+    digest[4 * i + 1] = words[i] >> 8;
+    digest[4 * i + 2] = words[i] >> 16;
+    digest[4 * i + 3] = words[i] >> 24;
+  }
+}
+
+/*
+ * Writes the digest of size bytes of data
+ */
+void hashData(const void *data, size_t size, uint8_t *digest) {
+  Hasher hasher;
+
+  initHasher(&hasher);
+  updateHasher(&hasher, data, size);
+  finishHasher(&hasher, digest);
+}
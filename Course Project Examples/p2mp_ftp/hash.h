@@ -0,0 +1,66 @@
+/*
+ * Strong hash shared by the P2MP-FTP client and server to verify a file end
+ * to end.
+ *
+ * The checksum of a data packet only catches the damage a packet takes on
+ * the way, not a segment that is taken whole but ends up wrong on disk, or
+ * one rebuilt wrong from parity. A transfer the client hashes with -H is
+ * split into blocks of HASH_SEGMENTS segments, and every block's BLAKE3
+ * digest travels with its last segment, so a server verifies each block as
+ * soon as it is written and fetches just that block again if it does not
+ * match (see p2mp.h).
+ *
+ * BLAKE3 hashes its input in chunks of 1024 bytes that are chained into a
+ * binary tree, so the hasher below can take the input in pieces of any size
+ * and only ever keeps the chaining values of one path down the tree.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SIZE 32
+#define HASH_BLOCK_LEN 64
+#define HASH_CHUNK_LEN 1024
+/* Chaining values a hasher keeps at most, one per level of a 2^54 chunk tree */
+#define HASH_MAX_DEPTH 54
+
+/*
+ * Hasher structure for a BLAKE3 hash in progress: the chunk being hashed,
+ * its chaining value, counter and the bytes of its last block, and the
+ * chaining values of the subtrees completed to its left
+ */
+typedef struct hasher_t {
+  uint32_t chunkCv[8];
+  uint64_t chunkCounter;
+  uint8_t block[HASH_BLOCK_LEN];
+  int blockLength;
+  int blocksCompressed;
+  uint32_t cvStack[HASH_MAX_DEPTH][8];
+  int cvStackLength;
+} Hasher;
+
+/*
+ * Starts a hash
+ */
+void initHasher(Hasher *hasher);
+
+/*
+ * Hashes the next size bytes of data
+ */
+void updateHasher(Hasher *hasher, const void *data, size_t size);
+
+/*
+ * Writes the HASH_SIZE byte digest of everything hashed so far. The hasher
+ * is left as it was and can still be updated.
+ */
+void finishHasher(const Hasher *hasher, uint8_t *digest);
+
+/*
+ * Writes the digest of size bytes of data
+ */
+void hashData(const void *data, size_t size, uint8_t *digest);
+
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Packet formats shared by the P2MP-FTP client and server.
+ *
+ * Every packet starts with a Header. A data packet carries a segment of the
+ * file after its header, and an acknowledgement carries a cumulative ack in
+ * its header followed by a selective ack bitmap of the segments received
+ * beyond it, so one ack can describe every hole in the receive window.
+ *
+ * Every structure here is packed, with no padding, and every field of more
+ * than one byte is in network byte order, so the two ends agree on the
+ * layout on any architecture. Packets are built and read in place, with the
+ * byte order converted as each field is stored or loaded, and never copied
+ * to be serialized. The header starts with the PROTOCOL_VERSION, and a
+ * packet of any other version is ignored. Sequence numbers and ranges are
+ * 64-bit on the wire.
+ *
+ * A packet may end with extLength bytes of extensions, each a type, a
+ * length and that many bytes of value. A receiver skips the ones it does
+ * not know, so new ones can be added without breaking older peers. The
+ * checksum of a data packet does not cover them, so a segment's checksum
+ * stays the same whatever extensions it is sent with. The client stamps
+ * every data packet with the time it was sent in an EXT_TIMESTAMP, and the
+ * server echoes the latest one in an EXT_ECHO on its acks. That times the
+ * transmission that was actually acknowledged, retransmissions included,
+ * except for a repair, which a parent resends with the timestamp of the
+ * client's first transmission still in it.
+ *
+ * A transfer opens with a handshake before any data flows: the client sends
+ * every server a syn packet with the size of the file, or STREAM_LENGTH for a
+ * stream, the MSS, its window, and how it will checksum, protect and
+ * compress the segments, and repeats it until the server answers with a syn
+ * ack. The answer carries the server's cumulative ack, the window it can
+ * buffer, and the checksums, codecs and features it supports, so the client
+ * only turns on what the server can take, and the server knows the size of
+ * every segment, the last one included, before the first one arrives.
+ *
+ * A server that first hears of a transfer in the middle of it asks the
+ * client to join with a join packet, and the client answers with another
+ * one telling it the size of the file and the MSS, so that the server can
+ * store every segment where it belongs while it fetches the ones it missed.
+ * A stream, whose length is not known up front, is answered with a length of
+ * STREAM_LENGTH, and the server then takes it in sequence from the start.
+ *
+ * A server that already holds segments beyond its cumulative ack, as when it
+ * joined late or resumed a transfer from its journal, tells the client which
+ * ranges it is still missing with a ranges packet, so the client only sends
+ * it those.
+ *
+ * When forward error correction is on, the client follows each block of data
+ * packets with parity packets, from which a server rebuilds the segments of
+ * the block it lost without waiting for them to be sent again (see fec.h).
+ * A segment is coded as a symbol holding its 16-bit little endian size, its
+ * bytes, and zeros up to the MSS, so segments of any size share one code.
+ *
+ * A segment that compresses well may be sent as a compressed data packet,
+ * with the codec and its size before compression ahead of the compressed
+ * bytes. Servers list the codecs they can decompress in every ack, and the
+ * client only compresses for servers that have listed its codec.
+ *
+ * Servers may relay a transfer to each other down a tree the client lays
+ * out. The syn of a server with children lists them in an EXT_CHILDREN
+ * extension, and the server then passes every data and parity packet it
+ * takes for the first time on to each of them, as it arrived but flagged
+ * FLAG_RELAYED. A relayed packet keeps the client's timestamp, so the acks
+ * of a child still go to the client and time the whole path. The client
+ * asks a parent to resend a segment a child lost with a repair packet,
+ * which the parent answers from the copies it keeps of what it relayed.
+ *
+ * The syn and join answer of a transfer the client hashes are flagged
+ * FLAG_HASHED. Its file is then split into blocks of HASH_SEGMENTS
+ * segments, the last data segment of every block carries the BLAKE3 digest
+ * of the block in an EXT_DIGEST extension, and the EOF segment carries the
+ * digest of the file: of its 64-bit length followed by the digests of all
+ * of its blocks in order (see hash.h). A server only takes the EOF segment
+ * once every block it wrote matches its digest, and tells the client a
+ * block that does not as missing in its ranges, so only that block is sent
+ * again.
+ */
+
+#ifndef P2MP_H
+#define P2MP_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#include "hash.h"
+
+#define DATA_PKT 0b0101010101010101
+#define ACK_PKT  0b1010101010101010
+#define JOIN_PKT 0b0110011001100110
+#define FEC_PKT  0b1001100110011001
+#define ZDATA_PKT 0b1100110011001100
+#define RANGES_PKT 0b0011001100110011
+#define SYN_PKT 0b0000111100001111
+#define SYNACK_PKT 0b1111000011110000
+#define REPAIR_PKT 0b0011110000111100
+#define PROTOCOL_VERSION 2
+#define FLAG_RETRANSMIT 0x01
+#define FLAG_BATCH 0x02
+#define FLAG_RELAYED 0x04
+#define FLAG_HASHED 0x08
+#define EXT_TIMESTAMP 1
+#define EXT_ECHO 2
+#define EXT_CHILDREN 3
+#define EXT_DIGEST 4
+#define MAX_UDP_PAYLOAD 65507
+#define INVALID_SEQ_NO -1
+#define MAX_WINDOW 4096
+/* Segments a transfer can have, which both sides number with an int: a few
+ * windows past the last one must still fit */
+#define MAX_SEGMENTS (INT_MAX - 4 * MAX_WINDOW)
+#define SACK_BITS 64
+#define FEC_SIZE_BYTES 2
+#define MAX_RANGES 32
+#define STREAM_LENGTH UINT64_MAX
+#define CAP_FEC 0x1
+#define CAP_RANGES 0x2
+#define MAX_CHILDREN 8
+#define HASH_SEGMENTS 256
+
+/*
+ * Header structure which starts with the protocol version and the flags of
+ * the packet, FLAG_RETRANSMIT on a data packet that was sent before,
+ * FLAG_RELAYED on one a server passed on, FLAG_BATCH on a syn or join answer
+ * for the image of a batch, or FLAG_HASHED on one for a transfer whose blocks
+ * are hashed, a 16-bit field which determines the type of the packet sent
+ * (data packet vs. ack packet), and the 32-bit ID of the transfer the packet
+ * belongs to, which the client picks at random and acks echo back. The 64-bit
+ * sequence number is followed by a 32-bit checksum of the data part being
+ * sent, a field which tells the receiver how the checksum was calculated, and
+ * the number of bytes of extensions at the end of the packet.
+ */
+typedef struct __attribute__((packed)) header_t {
+  uint8_t version;
+  uint8_t flags;
+  uint16_t type;
+  uint32_t sessionId;
+  uint64_t seqNum;
+  uint32_t checksum;
+  uint8_t checksumType;
+  uint8_t extLength;
+  uint16_t reserved;
+} Header;
+
+/*
+ * Timestamp structure for an extension holding a time in microseconds, as
+ * the sender's clock tells it
+ */
+typedef struct __attribute__((packed)) timestamp_t {
+  uint8_t type;
+  uint8_t length;
+  uint64_t usec;
+} Timestamp;
+
+/*
+ * Digest structure for an extension holding the BLAKE3 digest of a block
+ * or of a whole file
+ */
+typedef struct __attribute__((packed)) digest_t {
+  uint8_t type;
+  uint8_t length;
+  uint8_t hash[HASH_SIZE];
+} Digest;
+
+/*
+ * Acknowledgement structure. The header's seqNum is the cumulative ack: every
+ * segment up to and including it has been received, or INVALID_SEQ_NO if
+ * none has. Bit i of sackBits is set when segment sackBase + i has also been
+ * received out of sequence. Bit c of codecs is set when the server can
+ * decompress segments compressed with codec c (see compress.h).
+ */
+typedef struct __attribute__((packed)) ack_t {
+  Header hdr;
+  uint64_t sackBase;
+  uint64_t sackBits;
+  uint32_t codecs;
+} Ack;
+
+/*
+ * Join structure. A server's join request has an mss of 0; the client's
+ * answer carries the length of the file, or STREAM_LENGTH for a stream, and
+ * the MSS of the transfer.
+ */
+typedef struct __attribute__((packed)) join_t {
+  Header hdr;
+  uint64_t fileLength;
+  uint32_t mss;
+} Join;
+
+/*
+ * Syn structure opening a transfer. It carries the length of the file, or
+ * STREAM_LENGTH for a stream, the MSS and the client's window, the block
+ * shape of its forward error correction, or zeros without it, and a bitmap
+ * of the codecs it may compress with. The header's checksumType is the
+ * checksum its data packets carry.
+ */
+typedef struct __attribute__((packed)) syn_t {
+  Header hdr;
+  uint64_t fileLength;
+  uint32_t mss;
+  uint32_t window;
+  uint16_t fecData;
+  uint8_t fecParity;
+  uint8_t reserved;
+  uint32_t codecs;
+} Syn;
+
+/*
+ * SynAck structure answering a syn. The header's seqNum is the server's
+ * cumulative ack, which a server that resumed a transfer from its journal
+ * is already past the start of. The window is the number of segments the
+ * server can take beyond it, and bit c of checksums and of codecs is set
+ * when it can verify checksum type c and decompress codec c. The
+ * capabilities are CAP_FEC when it rebuilds segments from parity, and
+ * CAP_RANGES when it reports the ranges it is missing.
+ */
+typedef struct __attribute__((packed)) syn_ack_t {
+  Header hdr;
+  uint32_t window;
+  uint32_t checksums;
+  uint32_t codecs;
+  uint32_t capabilities;
+} SynAck;
+
+/*
+ * Compressed structure, which follows the header of a compressed data packet
+ * and is itself followed by the compressed segment. The checksum covers
+ * this structure and the compressed bytes.
+ */
+typedef struct __attribute__((packed)) compressed_t {
+  uint16_t size;
+  uint8_t codec;
+  uint8_t reserved;
+} Compressed;
+
+/*
+ * Parity structure, which follows the header of a parity packet and is itself
+ * followed by the parity symbol. The header's seqNum is the first segment of
+ * the block, which is numData segments long and protected by numParity parity
+ * symbols, of which this one is number index. The checksum covers this
+ * structure and the symbol.
+ */
+typedef struct __attribute__((packed)) parity_t {
+  uint16_t numData;
+  uint8_t numParity;
+  uint8_t index;
+} Parity;
+
+/*
+ * Ranges structure listing the segments a server is missing. The header's
+ * seqNum is its cumulative ack, and the missing segments are the numRanges
+ * ranges from ranges[2 * i] up to but not including ranges[2 * i + 1], in
+ * order. Every segment past the last range has been received; when there are
+ * more holes than ranges, the last range runs to the end of the file.
+ */
+typedef struct __attribute__((packed)) ranges_t {
+  Header hdr;
+  uint32_t numRanges;
+  uint64_t ranges[2 * MAX_RANGES];
+} Ranges;
+
+/*
+ * Peer structure naming a server by its IPv4 address and port, both kept in
+ * network byte order as in a sockaddr_in
+ */
+typedef struct __attribute__((packed)) peer_t {
+  uint32_t address;
+  uint16_t port;
+} Peer;
+
+/*
+ * Children structure for the value of an EXT_CHILDREN extension, the first
+ * numChildren of its peers being the servers to relay to
+ */
+typedef struct __attribute__((packed)) children_t {
+  uint8_t numChildren;
+  Peer peers[MAX_CHILDREN];
+} Children;
+
+/*
+ * Repair structure asking a server to resend a segment it relayed to the
+ * child named by peer. The header's seqNum is the segment.
+ */
+typedef struct __attribute__((packed)) repair_t {
+  Header hdr;
+  Peer peer;
+} Repair;
+
+/*
+ * Fills in a header in place, with no flags and no extensions
+ */
+static inline void fillHeader(Header *hdr, uint16_t type, uint32_t sessionId, int64_t seqNum,
+                              int checksumType, uint32_t checksum) {
+  hdr->version = PROTOCOL_VERSION;
+  hdr->flags = 0;
+  hdr->type = htobe16(type);
+  hdr->sessionId = htobe32(sessionId);
+  hdr->seqNum = htobe64((uint64_t) seqNum);
+  hdr->checksum = htobe32(checksum);
+  hdr->checksumType = checksumType;
+  hdr->extLength = 0;
+  hdr->reserved = 0;
+}
+
+/*
+ * Returns the type of a packet
+ */
+static inline uint16_t headerType(const Header *hdr) {
+  return be16toh(hdr->type);
+}
+
+/*
+ * Returns the session ID of a packet
+ */
+static inline uint32_t headerSessionId(const Header *hdr) {
+  return be32toh(hdr->sessionId);
+}
+
+/*
+ * Returns the sequence number of a packet
+ */
+static inline int64_t headerSeqNum(const Header *hdr) {
+  return (int64_t) be64toh(hdr->seqNum);
+}
+
+/*
+ * Returns the size of a received packet of size bytes without the
+ * extensions at its end, or -1 if it is not of this version of the protocol
+ * or too short to hold its header and extensions
+ */
+static inline int packetLength(const Header *hdr, int size) {
+  if (size < (int) sizeof(Header) || hdr->version != PROTOCOL_VERSION
+      || size - (int) sizeof(Header) < hdr->extLength)
+    return -1;
+  return size - hdr->extLength;
+}
+
+/*
+ * Returns the value of the first extension of the given type and length at
+ * the end of a packet of size bytes whose packetLength() was valid, or NULL
+ * if it has none
+ */
+static inline const void *findExtension(const Header *hdr, int size, uint8_t type, uint8_t length) {
+  const uint8_t *end = (const uint8_t *) hdr + size;
+  const uint8_t *ext = end - hdr->extLength;
+
+  while (end - ext >= 2 && end - ext - 2 >= ext[1]) {
+    if (ext[0] == type && ext[1] == length)
+      return ext + 2;
+    ext += 2 + ext[1];
+  }
+  return NULL;
+}
+
+/*
+ * Returns the time in an extension of the given type at the end of a packet
+ * of size bytes, in host byte order, or 0 if it has none
+ */
+static inline uint64_t findTimestamp(const Header *hdr, int size, uint8_t type) {
+  const void *value = findExtension(hdr, size, type, sizeof(uint64_t));
+  uint64_t usec;
+
+  if (value == NULL)
+    return 0;
+  memcpy(&usec, value, sizeof(usec));
+  return be64toh(usec);
+}
+
+#endif
@@ -1,217 +1,2526 @@
 /*
  * The P2MP-FTP client implements the sender in the reliable data transfer.
- * When the client starts, it reads data from a file specified in the command
- * line arguments.
+ * When the client starts, it maps a file specified in the command line
+ * arguments into memory, and every packet is sent straight from the mapping
+ * with its header in a separate buffer, so the data is never copied in user
+ * space and retransmissions never read the file again.
+ *
+ * A file name of "-" streams standard input instead, and so does any file
+ * that is not a regular file, such as a pipe. A reader thread then reads
+ * the stream into a ring of segments as fast as the servers acknowledge
+ * them, so the producer and the transfer overlap in bounded memory, and the
+ * end of the stream is sent as the usual empty EOF segment once the reader
+ * reaches it. A stream cannot be replayed, so servers that lag behind with
+ * -L catchup are not supported while streaming, and a server that joins or
+ * resumes a stream is only kept if it has not acknowledged anything yet.
  *
  * This client uses udp to transfer the data to the P2MP-FTP servers using a
- * stop-and-wait ARQ.
+ * stop-and-wait ARQ by default. Passing a send window larger than one switches
+ * to a sliding window ARQ, either Go-Back-N or selective repeat. Servers ack
+ * cumulatively with a selective ack bitmap, so both modes skip segments a
+ * server already has, and selective repeat makes the most of servers started
+ * with a receive window that buffers out-of-sequence segments.
+ *
+ * Every server has its own state machine: its own window of outstanding
+ * segments, acks and retransmission timers, which only advances as that
+ * server acks. The windows are bounded by the group window, which starts at
+ * the oldest segment not yet acked by every server, since a server can only
+ * be sent what is still in the group window. Segment data is never copied
+ * per server, every server is sent straight from the one mapping of the
+ * file, and segment checksums are computed once and shared.
+ *
+ * With -l the servers that keep up may run up to that many segments further
+ * ahead of the slowest one, and with -L a server that falls more than that
+ * many segments behind the median server stops holding the group back: it is
+ * either dropped from the transfer or handed to a catch-up stream of its own,
+ * sent unicast from the mapped file at its own pace.
+ *
+ * Before any data flows, every server is sent a syn with the file size, the
+ * MSS, the window, and the checksum, forward error correction and codec
+ * the client will use, repeated until the server answers with a syn ack or
+ * HANDSHAKE_TRIES have gone unanswered. The answer's window caps the
+ * server's send window, its codecs let compression start with the first
+ * segment, a server that cannot verify the checksum is dropped up front,
+ * and one that already holds part of the file is sent only the rest. The
+ * first syn of a server also gives its first round trip time sample. A
+ * server that does not answer in time is still sent the transfer, and
+ * joins it when it comes up as any late server does.
+ *
+ * A server that starts after the transfer has begun asks to join it when it
+ * first hears of it. The client tells it the file size and the MSS, and
+ * sends it the whole file from the start at its own pace, the way a lagging
+ * server catches up, while the server keeps whatever it receives of the
+ * ongoing transfer. Its cumulative acks let its window skip past what it
+ * already has, and once it has caught up with the group it rejoins it.
+ *
+ * A server that holds segments beyond its cumulative ack lists the ranges it
+ * is still missing, and its window skips everything outside them. A server
+ * resuming from its journal after a restart, or one that found a block of a
+ * hashed file damaged, may even be missing segments it had acknowledged, and
+ * is then caught up from the first one. With -r the session ID is derived
+ * from the file and the MSS instead of picked at random, so a restarted
+ * client resumes the transfer with servers that keep journals, and is only
+ * sent what they are missing.
+ *
+ * A directory is sent as a batch of the files under it, and so are the
+ * files named one per line in a list given with -F. The whole batch goes
+ * out as one image in one session (see batch.h), so it takes one handshake
+ * however many files it holds: small files share segments, large ones are
+ * mapped into the image straight from disk, and the segments of all of
+ * them are in flight at once in every window. A server unpacks the image
+ * into a directory once it has all of it.
+ *
+ * The state machines run on a pool of sender threads, one by default or as
+ * many as given with -T, each driving its own share of the servers from its
+ * own socket. On each socket the packets for a whole window are queued and
+ * handed to the kernel with one sendmmsg, and acks are drained in bursts
+ * with recvmmsg and matched to servers by source address, so the time to
+ * serve a segment to all servers does not grow with the number of servers.
+ * Where the kernel supports UDP GSO, every run of queued packets of the same
+ * length to the same address is handed over as a single message that the
+ * kernel only cuts into datagrams on its way out, so a run crosses the UDP
+ * stack once instead of once per packet.
+ *
+ * With -K every sender thread opens that many sockets, its paths, each with
+ * its own source port and optionally bound to one of the local addresses
+ * listed after the count, and stripes the packets it sends round robin
+ * across them. The window, timers and acks of a server stay shared by all
+ * of its paths, and a server acks along whichever path brought its latest
+ * packet, so a single transfer spreads over as many receive queues, ECMP
+ * paths or bonded links as the flows of its paths hash to.
+ *
+ * With -g the first transmission of every segment is sent once to an IP
+ * multicast group that all servers have joined instead of once per server,
+ * which takes all the servers on one sender thread. The servers still ack
+ * each segment over unicast, and retransmissions are unicast repairs to the
+ * servers that are missing the segment.
+ *
+ * With -P the servers relay the transfer to each other down a tree with
+ * that many children per server, laid out in the order they are given:
+ * the client only sends to the first ones, and every server passes what it
+ * takes on to its children (see p2mp.h). A relayed server's window starts
+ * a segment once its parent has been sent it, and all of the servers still
+ * ack to the client. A segment a relayed server lost is first asked of its
+ * parent with a repair, as long as the parent has acknowledged it, and only
+ * sent by the client if that repair times out too. A server whose parent
+ * did not answer the handshake, was dropped or is catching up on its own is
+ * sent the transfer directly, as are the children of a server that did not
+ * answer. Like multicast, a tree takes all the servers on one sender
+ * thread.
+ *
+ * With -z lz4 every segment is compressed with LZ4 before it is sent to a
+ * server whose acks say it can decompress it, once per segment and shared
+ * like the checksums, and sent as it is if it does not get smaller. After a
+ * run of segments that do not compress, only every COMPRESS_PROBE-th one is
+ * tried until one does, so incompressible data costs next to nothing. A
+ * speed given as -z lz4:speed trades ratio for compression speed.
+ *
+ * With -C reno or -C bbr the path to every server also gets its own
+ * congestion controller (see congestion.h), which keeps fewer segments than
+ * the send window in flight while the path cannot carry more, and paces
+ * them out evenly over the round trip instead of sending the window in one
+ * burst. With multicast the group is sent at the pace of its slowest path.
+ *
+ * Every packet carries a session ID picked at random for the transfer (or
+ * derived from the file with -r), which lets a server tell concurrent
+ * transfers apart, and acks for any other session are ignored.
+ *
+ * Once the transfer is over the client prints a summary of it: the goodput,
+ * the share of data packets that were retransmissions, and the median and
+ * 99th percentile of the time from a segment's first transmission to a
+ * server until that server acknowledged it. With -S the counters behind it
+ * are also written per server to the path given, or stderr for -, as a line
+ * of JSON every second or every msec milliseconds given, and once more
+ * marked final at the end: bytes and packets sent, retransmissions, timer
+ * expiries, duplicate acks, and the round trip and completion times. The
+ * sender threads only ever add to their own servers' counters, and a
+ * separate stats thread reads them, so exporting takes nothing from the
+ * send loop. Timeouts are logged at most LOG_BURST a second per thread.
+ *
+ * Data packets carry a 16-bit Internet checksum by default, or a CRC32C with
+ * -c crc32c. The servers check whichever one the header says was used.
+ *
+ * With -H the file is also hashed, by that many hasher threads, so the
+ * servers can verify it end to end (see hash.h): the threads take blocks of
+ * HASH_SEGMENTS segments in turn and digest them with BLAKE3, straight from
+ * the mapping, while the file is being sent. A block is only sent once it
+ * is digested and so are all the blocks before it, as the segments of a
+ * stream only once they are read, and the last segment of every block
+ * carries its digest. The digests are chained into the digest of the file
+ * as they come in, which the EOF segment carries. A server that finds a
+ * block does not match fetches only that block again, so a damaged file
+ * never has to be sent whole again. A stream is not hashed.
+ *
+ * With -f data:parity the file is split into blocks of that many data
+ * segments, and the first transmission of a block to the servers in the
+ * group window is followed by that many Reed-Solomon parity packets, from
+ * which a server rebuilds up to as many segments of the block as it lost
+ * without waiting for a timeout. Parity is computed once per block and
+ * shared by every server and thread, like the checksums.
  *
  * Run as:
- * ./p2mpclient <server-1 hostname> [server-n hostname...] <server port> <filename> <MSS>
+ * ./p2mpclient [-w window] [-m gbn|sr] [-l lag] [-L drop|catchup] [-T threads] [-K paths[:address,...]] [-P fanout] [-g group] [-c inet|crc32c] [-f data:parity] [-C none|reno|bbr] [-z lz4[:speed]] [-H hashers] [-r] [-F] [-S path[:msec]] <server-1 hostname> [server-n hostname...] <server port> <filename> <MSS>
  *
  * Author: Aasiyah Feisal (anfeisal)
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
-#define DATA_PKT 0b0101010101010101
-#define ACK_PKT  0b1010101010101010
+#include "checksum.h"
+#include "compress.h"
+#include "batch.h"
+#include "congestion.h"
+#include "fec.h"
+#include "hash.h"
+#include "p2mp.h"
+#include "stats.h"
+
 #define TIMEOUT_SEC 0
 #define TIMEOUT_USEC 120000
-#define MAX_SERVERS 10
-#define MAX_MSS 1024
-#define INVALID_SEQ_NO -1
+#define MIN_RTO_USEC 2000
+#define MAX_RTO_USEC 4000000
+#define CLOCK_GRANULARITY_USEC 1000
+#define MAX_MSS (MAX_UDP_PAYLOAD - (int) sizeof(Header) - (int) sizeof(Timestamp) - (int) sizeof(Digest))
+#define MAX_FEC_MSS (MAX_MSS - (int) sizeof(Parity) - FEC_SIZE_BYTES)
+#define GO_BACK_N 0
+#define SELECTIVE_REPEAT 1
+#define MULTICAST_TTL 16
+#define SEND_BATCH 1024
+#define GSO_SEGMENTS 64
+#define ACK_BATCH 64
+#define SOCKET_BUFFER_SIZE (8 * 1024 * 1024)
+#define MAX_THREADS 64
+#define MAX_PATHS 8
+#define LAG_RTOS 8
+#define SERVER_ACTIVE 0
+#define SERVER_CATCHUP 1
+#define SERVER_DROPPED 2
+#define LAG_NONE 0
+#define LAG_DROP 1
+#define LAG_CATCHUP 2
+#define STREAM_SEGMENTS MAX_SEGMENTS
+#define COMPRESS_SKIP 8
+#define COMPRESS_PROBE 16
+#define COMPRESS_BUSY 1
+#define COMPRESS_DONE 2
+#define COMPRESS_RAW 3
+#define STATS_INTERVAL_USEC 1000000
+#define HANDSHAKE_TRIES 10
 
 /*
- * Header structure which contains a 32-bit sequence number, a 16-bit
- * checksum of the data part being sent, and a 16-bit field which
- * determines the type of the packet sent (data packet vs. ack packet)
+ * Transmission structure for one slot of a server's send window, which holds
+ * the times the segment in it was first and last sent to the server, whether
+ * the server has acknowledged it, whether it was resent to the server, and
+ * whether it was asked of the server's parent in a repair
  */
-typedef struct header_t {
-  int32_t seqNum;
-  int16_t checksum;
-  int16_t type;
-} Header;
+typedef struct transmission_t {
+  long long firstSentTime;
+  long long sentTime;
+  bool acked;
+  bool retransmitted;
+  bool repaired;
+} Transmission;
 
 /*
- * Packet structure which contains header information and a buffer
- * array that holds data to be sent to server
+ * ServerStats structure for the counters of the transfer to one server: the
+ * bytes and data packets sent to it, by unicast or multicast, how many of
+ * those were retransmissions, the segments its parent relayed to it instead
+ * and the repairs of them asked of its parent, the rounds of expired timers,
+ * the acks that acknowledged nothing new, and histograms of its round trip
+ * time samples and of the time from a segment's first transmission to its
+ * ack. Only the thread driving the server writes them.
  */
-typedef struct packet_t {
-  Header hdr;
-  char data[MAX_MSS];
-} Packet;
-
-/* Acknowledgement structure which contains header information. */
-typedef struct ack_t {
-  Header hdr;
-} Ack;
+typedef struct server_stats_t {
+  uint64_t bytes;
+  uint64_t packets;
+  uint64_t retransmits;
+  uint64_t relayed;
+  uint64_t repairs;
+  uint64_t timeouts;
+  uint64_t duplicateAcks;
+  Histogram rtt;
+  Histogram completion;
+} ServerStats;
 
 /*
- * Server structure to keep track of server address, socket file
- * descriptor, and whether an acknowledgement has been sent for
- * every time that the server is sent data
+ * Server structure to keep track of server address and the state machine
+ * sending to it: the oldest segment it has not acknowledged, the next
+ * segment to send it, and a ring of windowSize transmission slots indexed by
+ * seqNum % windowSize, whether the server is still part of the group
+ * window, caught up on its own, or dropped, whether it has asked to join the
+ * transfer late, and since when it has been lagging behind the group.
+ * It also holds the smoothed round trip time and its variation measured on
+ * the path to this server, the retransmission timeout derived from them, and
+ * how many times that timeout has been doubled since the last forward
+ * progress, the congestion controller of the path, the server that relays
+ * the transfer to it down the tree, or -1 if none does, the codecs the
+ * server has said it can decompress, the ranges of segments it last said
+ * it is missing, if it has, whether it has answered the handshake, the
+ * window and capabilities it answered with, and the counters of the
+ * transfer to it.
  */
 typedef struct server_t {
   struct sockaddr_in serverAddr;
-  int sockfd;
-  bool ackReceived;
+  int base;
+  int nextSeqNum;
+  Transmission *window;
+  int state;
+  bool joined;
+  long long laggingSince;
+  long long srtt;
+  long long rttvar;
+  long long rto;
+  int backoff;
+  Congestion congestion;
+  int parent;
+  uint32_t codecs;
+  int numMissing;
+  int missing[2 * MAX_RANGES];
+  bool synced;
+  int receiveWindow;
+  uint32_t capabilities;
+  ServerStats stats;
 } Server;
 
+/*
+ * TreeSyn structure for the syn of a server with children in the relay
+ * tree, which names them in an EXT_CHILDREN extension
+ */
+typedef struct __attribute__((packed)) tree_syn_t {
+  Syn syn;
+  uint8_t extType;
+  uint8_t extLength;
+  Children children;
+} TreeSyn;
+
+/*
+ * Segment structure describing one packet to send, a segment of the file or
+ * a parity packet. It points at the segment's data in the mapped file and
+ * holds its checksum, so every server is sent the same bytes without them
+ * being read or summed again, and at the digest it carries, if any.
+ */
+typedef struct segment_t {
+  int seqNum;
+  uint16_t type;
+  uint8_t flags;
+  int size;
+  const char *data;
+  uint32_t checksum;
+  const Digest *digest;
+} Segment;
+
+/*
+ * Reply structure for one datagram a server sends back: an ack, a request to
+ * join the transfer, the ranges it is missing, or its answer to the syn,
+ * with room for as many bytes of extensions as a header can announce
+ */
+typedef union reply_t {
+  Header hdr;
+  Ack ack;
+  Join join;
+  Ranges ranges;
+  SynAck synAck;
+  uint8_t bytes[sizeof(Ranges) + UINT8_MAX];
+} Reply;
+
+/*
+ * CompressedSlot structure for one entry of the ring of compressed segments,
+ * which holds the compressed data packet of a segment, a Compressed followed
+ * by the compressed bytes, its size and its checksum. The tag is seqNum + 1
+ * shifted left by two, with the state of the entry in the low bits: being
+ * compressed, done, or left raw since the segment did not compress.
+ */
+typedef struct compressed_slot_t {
+  uint64_t tag;
+  int size;
+  uint32_t checksum;
+  char *packet;
+} CompressedSlot;
+
+/*
+ * ParityBlock structure for one entry of the ring of parity packets, which
+ * holds the packets of the given block, each a Parity followed by its
+ * symbol, and their checksums. A block of -1 marks an empty entry.
+ */
+typedef struct parity_block_t {
+  int block;
+  char *packets;
+  uint32_t *checksums;
+} ParityBlock;
+
 /* Server port to bind to supplied through a command line argument */
 int serverPort;
 /* Number of servers to connect to */
 int numServers;
-/* List representation of servers with max of 10 */
-Server servers[MAX_SERVERS];
+/* List representation of servers, one entry per server hostname */
+Server *servers;
 /* Maximum segment size supplied through a command line argument */
 int mss;
 /* Name of file supplied through a command line argument */
 char *filename;
-/* File pointer to file being read */
-FILE* file;
+/* Contents of the file being sent, mapped read-only into memory */
+const char *fileData;
+size_t fileLength;
+/*
+ * Number of segments, the last of which is an empty EOF segment. While a
+ * stream is still being read this is STREAM_SEGMENTS, and the reader sets it
+ * before it makes the EOF segment available.
+ */
+int numSegments;
+/* Number of segments that can be sent, which grows as a stream is read */
+int availableSegments;
+/* Whether the file is a stream read as it is sent, and its descriptor */
+bool streaming = false;
+/* Whether the file is the image of a batch, and whether -F names a list */
+bool batching = false;
+bool listMode = false;
+int streamFd;
+/*
+ * Segments of a stream read but not yet acknowledged by every server, each
+ * mss bytes at seqNum % streamRingSize, and their sizes. The reader waits on
+ * streamCond for room when the ring is full.
+ */
+char *streamData;
+int *streamSizes;
+int streamRingSize;
+pthread_mutex_t streamLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t streamCond = PTHREAD_COND_INITIALIZER;
+/* Number of segments that may be outstanding, supplied through -w */
+int windowSize = 1;
+/* Sliding window ARQ mode, GO_BACK_N or SELECTIVE_REPEAT, from -m */
+int arqMode = GO_BACK_N;
+/* Segments the group window extends past the slowest server, from -l */
+int lagBound = 0;
+/* What happens to a server lagging further behind, from -L */
+int lagPolicy = LAG_NONE;
+/* Codec segments are compressed with and its speed, supplied through -z */
+int compressCodec = CODEC_NONE;
+int compressSpeed = 1;
+/* Compressed segments of the group window, indexed by seqNum %
+ * groupWindowSize */
+CompressedSlot *compressRing;
+/* Number of segments in a row that did not compress */
+int incompressibleRun;
+/* Congestion control type of every path, supplied through -C */
+int congestionControl = CONGESTION_NONE;
+/* Checksum type used for data packets, supplied through -c */
+int dataChecksumType = CHECKSUM_INET;
+/* Session ID of this transfer, put in every packet and echoed by every ack */
+uint32_t sessionId;
+/* Whether the session ID is derived from the file so the transfer can be
+ * resumed, from -r */
+bool resumable = false;
+/*
+ * Checksums of the segments in the group window, indexed by seqNum %
+ * groupWindowSize, each tagged with seqNum + 1 in its upper half so a slot
+ * still holding an older segment is recognized
+ */
+uint64_t *checksumRing;
+int groupWindowSize;
+/* Data and parity segments per block for forward error correction, from -f,
+ * or 0 without it */
+int fecData = 0;
+int fecParity = 0;
+/*
+ * Parity of the blocks in the group window, indexed by block %
+ * parityRingSize, filled in by the first thread to send a block under
+ * parityLock. Every packet is parityPacketSize bytes.
+ */
+ParityBlock *parityRing;
+int parityRingSize;
+int parityPacketSize;
+pthread_mutex_t parityLock = PTHREAD_MUTEX_INITIALIZER;
+/* Number of threads hashing the file, supplied through -H, or 0 without
+ * hashing */
+int hashThreads = 0;
+/*
+ * Digests of the numBlocks blocks of a hashed file, followed by the digest
+ * of the file, or NULL without hashing. The hasher threads take the next
+ * block to hash from nextHashBlock, and under hashLock mark it hashed and
+ * chain the blocks hashed in order from the start, of which there are
+ * hashedBlocks, into fileHasher.
+ */
+Digest *blockDigests;
+int numBlocks;
+int nextHashBlock;
+bool *blocksHashed;
+int hashedBlocks;
+Hasher fileHasher;
+pthread_mutex_t hashLock = PTHREAD_MUTEX_INITIALIZER;
+/* Transmission slots of every server's window, allocated as one arena */
+Transmission *windowArena;
+/* Number of children of every server in the relay tree, supplied through
+ * -P, or 0 without a tree */
+int treeFanout = 0;
+/* Multicast group address supplied through -g, or NULL for unicast only */
+char *groupName;
+/* Address of the multicast group */
+struct sockaddr_in groupAddr;
+/* Open addressing table from server address to index in servers */
+int *serverTable;
+int serverTableSize;
+/* Number of sender threads, supplied through -T */
+int numThreads = 1;
+/* Number of paths of every sender thread, and the local addresses they are
+ * bound to in turn, supplied through -K */
+int numPaths = 1;
+char *pathAddrs[MAX_PATHS];
+int numPathAddrs = 0;
+/* Sockets of the paths of each sender thread, and an eventfd that wakes it */
+int threadSockets[MAX_THREADS][MAX_PATHS];
+int threadWakeFds[MAX_THREADS];
+/* Whether the kernel cuts runs of packets sent as one message into datagrams
+ * with UDP GSO, cleared the first time it refuses one */
+bool segmentOffload = true;
+/* Stream the statistics are exported to as JSON lines, from -S, and how
+ * often. The stats thread waits on statsCond, which is signalled once the
+ * transfer is over. */
+FILE *statsFile = NULL;
+long long statsIntervalUsec = STATS_INTERVAL_USEC;
+bool statsDone = false;
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t statsCond = PTHREAD_COND_INITIALIZER;
 
 /*
- * Calculates the checksum for the packet being sent
+ * Everything below is owned by one sender thread, so each thread has its own
+ * copy
  */
-int16_t calculateChecksum(char *buffer, int bufferSize) {
-  int16_t sum = 0; //initialize sum to zero
-  int16_t word16;
 
-  // make 16 bit words out of every two adjacent 8 bit words and
-  // calculate the sum of all 16 bit words
-  for (int i = 0; i < bufferSize - 1; i = i + 2) {
-    word16 = ((buffer[i] << 8) & 0xFF00) + (buffer[i+1] & 0xFF);
-    sum = sum + word16;
-  }
+/* Index of the thread, which drives every server whose index matches it
+ * modulo numThreads */
+__thread int threadNum;
+/* Socket of the thread's first path, which handshakes and answers go out on */
+__thread int sockfd;
+/* Oldest segment not yet acknowledged by every server, as last seen */
+__thread int groupBase;
+/* Next segment to multicast to the group */
+__thread int groupNextSeqNum;
+/* Scratch space for the bases of the servers in the group window */
+__thread int *activeBases;
+/*
+ * Packets queued for the next sendmmsg, with their headers, timestamps and
+ * iovecs, the last of which gathers the digest a packet carries. Each path
+ * queues into its own share of SEND_BATCH / numPaths entries, and the
+ * packets are dealt to the paths in turn.
+ */
+__thread struct mmsghdr sendQueue[SEND_BATCH];
+__thread struct iovec sendIov[SEND_BATCH][4];
+__thread Header sendHeaders[SEND_BATCH];
+__thread Timestamp sendStamps[SEND_BATCH];
+__thread int sendQueueLengths[MAX_PATHS];
+__thread int nextPath;
+/* Messages a path's queue is merged into for UDP GSO, with their iovecs, the
+ * GSO segment size each is cut at and the index of its first packet */
+__thread struct mmsghdr mergedQueue[SEND_BATCH];
+__thread struct iovec mergedIov[SEND_BATCH * 4];
+__thread union { char buf[CMSG_SPACE(sizeof(uint16_t))]; struct cmsghdr align; } mergedControl[SEND_BATCH];
+__thread int mergedFirst[SEND_BATCH + 1];
 
-  // if bufferSize is odd, add the last byte after shifting 8 bits
-  if ((bufferSize % 2) != 0) {
-    word16 = ((buffer[bufferSize - 1] << 8) & 0xFF00);
-    sum = sum + word16;
-  }
+/*
+ * Returns the current time of the monotonic clock in microseconds
+ */
+long long currentTimeUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Merges the given queued packets into mergedQueue for UDP GSO and returns
+ * the number of messages. A message gathers a run of packets to the same
+ * address that are all as long as its first, save a shorter last one, up to
+ * GSO_SEGMENTS of them and as many bytes as a datagram can carry, and tells
+ * the kernel to cut it back into datagrams of that length.
+ */
+int mergeSegments(struct mmsghdr *queue, int length) {
+  int numMerged = 0;
+  int numIov = 0;
 
-  // Take the one's complement of sum
-  sum = ~sum;
+  for (int i = 0; i < length; numMerged++) {
+    struct msghdr *merged = &mergedQueue[numMerged].msg_hdr;
+    size_t segmentSize = 0;
+    size_t total = 0;
+    int count = 0;
+
+    memset(merged, '\0', sizeof(struct msghdr));
+    merged->msg_name = queue[i].msg_hdr.msg_name;
+    merged->msg_namelen = queue[i].msg_hdr.msg_namelen;
+    merged->msg_iov = &mergedIov[numIov];
+    mergedFirst[numMerged] = i;
+
+    while (i < length && count < GSO_SEGMENTS) {
+      struct msghdr *msg = &queue[i].msg_hdr;
+      size_t size = 0;
+      for (size_t j = 0; j < msg->msg_iovlen; j++)
+        size += msg->msg_iov[j].iov_len;
+      if (count == 0)
+        segmentSize = size;
+      else if (size > segmentSize || total + size > MAX_UDP_PAYLOAD || msg->msg_name != merged->msg_name)
+        break;
+
+      memcpy(&mergedIov[numIov], msg->msg_iov, msg->msg_iovlen * sizeof(struct iovec));
+      numIov += msg->msg_iovlen;
+      merged->msg_iovlen += msg->msg_iovlen;
+      total += size;
+      count++;
+      i++;
+      // only the last datagram of a message may come out shorter
+      if (size < segmentSize)
+        break;
+    }
 
-  return sum;
+    if (count > 1) {
+      uint16_t gsoSize = segmentSize;
+      merged->msg_control = mergedControl[numMerged].buf;
+      merged->msg_controllen = sizeof(mergedControl[numMerged].buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(merged);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(gsoSize));
+      memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+    }
+  }
+  mergedFirst[numMerged] = length;
+  return numMerged;
 }
 
 /*
- * Sends packet of designated sequence number to all servers
- * and waits for ack response from each server.
+ * Hands every queued packet to the kernel, as few sendmmsg calls per path as
+ * the socket buffers allow, merged into runs for UDP GSO while the kernel
+ * takes them. When a buffer is full this waits for room rather than
+ * dropping packets that would only have to be retransmitted.
  */
-void sendPacket(int segmentNum, char *buffer, int bufferSize) {
-  Packet packet;
-  int packetSize = bufferSize + sizeof(Header);
-  Ack ack;
-  socklen_t serverAddrSize;
-  struct timeval tv;
+void flushSegments() {
+  int pathBatch = SEND_BATCH / numPaths;
 
-  packet.hdr.seqNum = segmentNum;
-  packet.hdr.type  = DATA_PKT;
-  strncpy(packet.data, buffer, bufferSize);
-  packet.hdr.checksum  = calculateChecksum(packet.data, bufferSize);
-  packet.data[bufferSize] = '\0';
+  for (int path = 0; path < numPaths; path++) {
+    int socketFd = threadSockets[threadNum][path];
+    struct mmsghdr *queue = sendQueue + path * pathBatch;
+    int length = sendQueueLengths[path];
+    bool merged = length > 1 && __atomic_load_n(&segmentOffload, __ATOMIC_RELAXED);
+    int sent = 0;
 
-  for (int serverNum = 0; serverNum < numServers; serverNum++) {
-    servers[serverNum].ackReceived = false;
-    while (!servers[serverNum].ackReceived) {
-      sendto(servers[serverNum].sockfd,
-             &packet,
-             packetSize,
-             MSG_DONTWAIT,
-             (struct sockaddr*)&servers[serverNum].serverAddr,
-             sizeof(struct sockaddr_in));
-      tv.tv_sec = TIMEOUT_SEC;
-      tv.tv_usec = TIMEOUT_USEC;
-      setsockopt(servers[serverNum].sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*) &tv, sizeof tv);
-      int f_recv_size = recvfrom(servers[serverNum].sockfd, &ack, sizeof(Ack),
-             0, (struct sockaddr*) &servers[serverNum].serverAddr, &serverAddrSize);
-      if (f_recv_size > 0 && ack.hdr.seqNum == segmentNum) {
-        servers[serverNum].ackReceived = true;
-      } else if (f_recv_size > 0) {
-        servers[serverNum].ackReceived = false;
-        // if server sends INVALID_SEQ_NO, it means it connected after first few packets were already sent
-        if (ack.hdr.seqNum == INVALID_SEQ_NO)
-          break;
+    if (merged) {
+      length = mergeSegments(queue, length);
+      queue = mergedQueue;
+    }
+    while (sent < length) {
+      int n = sendmmsg(socketFd, queue + sent, length - sent, MSG_DONTWAIT);
+      if (n > 0) {
+        sent += n;
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        struct pollfd pfd = { .fd = socketFd, .events = POLLOUT };
+        poll(&pfd, 1, 10);
+      } else if (merged && queue[sent].msg_hdr.msg_controllen > 0) {
+        // the path cannot offload segmentation, as when the MSS is larger
+        // than its MTU, so send the rest and everything after one by one
+        __atomic_store_n(&segmentOffload, false, __ATOMIC_RELAXED);
+        sent = mergedFirst[sent];
+        queue = sendQueue + path * pathBatch;
+        length = sendQueueLengths[path];
+        merged = false;
       } else {
-        printf("Timeout, sequence number = %d\n", segmentNum);
+        // skip a packet the kernel refuses, its timer will resend it
+        sent++;
       }
     }
+    sendQueueLengths[path] = 0;
   }
 }
 
 /*
- * Main method reads the file, calcultes the required number of segments
- * to be sent, and sends those packets to all servers until entire file
- * is sent to all servers.
+ * Returns the digest the segment with the given sequence number carries
+ * when the file is hashed: its block's if it is the last segment of one, or
+ * the file's if it is the EOF segment, or NULL if it carries none
  */
-int main(int argc, char **argv) {
+const Digest *segmentDigest(int seqNum) {
+  if (blockDigests == NULL)
+    return NULL;
+  if (seqNum == numSegments - 1)
+    return &blockDigests[numBlocks];
+  if (seqNum % HASH_SEGMENTS == HASH_SEGMENTS - 1 || seqNum == numSegments - 2)
+    return &blockDigests[seqNum / HASH_SEGMENTS];
+  return NULL;
+}
 
-  if(argc < 5) {
-    printf("Usage %s <server-i hostname> <server port> <filename> <MSS>\n", argv[0]);
-    exit(0);
+/*
+ * Describes the segment with the given sequence number, from the mapped
+ * file or the stream ring, with the digest it carries. Its checksum is
+ * taken from the ring shared by all threads when some thread has already
+ * computed it, and computed and published there otherwise.
+ */
+void loadSegment(int seqNum, Segment *segment) {
+  size_t remaining = fileLength - (size_t) mss * seqNum;
+
+  segment->seqNum = seqNum;
+  segment->type = DATA_PKT;
+  segment->flags = 0;
+  segment->digest = segmentDigest(seqNum);
+  if (streaming) {
+    segment->size = streamSizes[seqNum % streamRingSize];
+    segment->data = streamData + (size_t) (seqNum % streamRingSize) * mss;
+  } else if (seqNum == numSegments - 1) {
+    segment->size = 0;
+    segment->data = NULL;
+  } else {
+    segment->size = remaining < (size_t) mss ? (int) remaining : mss;
+    segment->data = fileData + (size_t) mss * seqNum;
   }
 
-  // parse serverPort, filename and mss
-  serverPort = atoi(argv[argc - 3]);
-  filename = argv[argc - 2];
-  mss = atoi(argv[argc - 1]);
+  uint64_t *slot = &checksumRing[seqNum % groupWindowSize];
+  uint64_t tagged = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if ((tagged >> 32) == (uint64_t) seqNum + 1) {
+    segment->checksum = (uint32_t) tagged;
+    return;
+  }
+  segment->checksum = calculateChecksum(dataChecksumType, segment->data, segment->size);
 
-  // calculate num of severs from number of arguments
-  numServers = argc -  4;
+  // a server catching up is behind the group window, and its segments would
+  // only evict the ones the group is still sending
+  if (seqNum >= groupBase) {
+    tagged = ((uint64_t) seqNum + 1) << 32 | segment->checksum;
+    __atomic_store_n(slot, tagged, __ATOMIC_RELEASE);
+  }
+}
 
-  // open datagram sockets to all servers & populate servers data structure
-  for (int serverNum = 0; serverNum <  numServers; serverNum++) {
+/*
+ * Queues the packet for a segment to the given address, on the next path in
+ * turn. The header, the segment's data in the mapped file, the timestamp
+ * extension and the digest extension, if the segment carries one, are
+ * gathered by the kernel, so the data is not copied here.
+ */
+void queueSegment(Segment *segment, struct sockaddr_in *addr) {
+  int path = nextPath;
+  int pathBatch = SEND_BATCH / numPaths;
 
-    servers[serverNum].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  nextPath = (nextPath + 1) % numPaths;
+  if (sendQueueLengths[path] == pathBatch)
+    flushSegments();
 
-    memset(&servers[serverNum].serverAddr, '\0', sizeof(struct sockaddr_in));
-    servers[serverNum].serverAddr.sin_family = AF_INET;
-    servers[serverNum].serverAddr.sin_port = htons(serverPort);
-    servers[serverNum].serverAddr.sin_addr.s_addr = inet_addr(argv[1 + serverNum]);
+  int entry = path * pathBatch + sendQueueLengths[path];
+  Header *hdr = &sendHeaders[entry];
+  Timestamp *stamp = &sendStamps[entry];
+  struct iovec *iov = sendIov[entry];
+  struct msghdr *msg = &sendQueue[entry].msg_hdr;
+
+  fillHeader(hdr, segment->type, sessionId, segment->seqNum, dataChecksumType, segment->checksum);
+  hdr->flags = segment->flags;
+  hdr->extLength = sizeof(Timestamp);
+  stamp->type = EXT_TIMESTAMP;
+  stamp->length = sizeof(stamp->usec);
+  stamp->usec = htobe64(currentTimeUsec());
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(Header);
+  iov[1].iov_base = (void *) segment->data;
+  iov[1].iov_len = segment->size;
+  iov[2].iov_base = stamp;
+  iov[2].iov_len = sizeof(Timestamp);
+
+  memset(msg, '\0', sizeof(struct msghdr));
+  msg->msg_name = addr;
+  msg->msg_namelen = sizeof(struct sockaddr_in);
+  msg->msg_iov = iov;
+  msg->msg_iovlen = 3;
+  if (segment->digest != NULL) {
+    hdr->extLength += sizeof(Digest);
+    iov[3].iov_base = (void *) segment->digest;
+    iov[3].iov_len = sizeof(Digest);
+    msg->msg_iovlen = 4;
+  }
+  sendQueueLengths[path]++;
+}
+
+/*
+ * Replaces a loaded segment with its compressed data packet if it
+ * compresses. A segment in the group window is compressed by the first
+ * thread to send it and shared through the ring; a thread finding it being
+ * compressed by another one sends it as it is rather than wait. A packet a
+ * thread has queued may be overwritten by a segment a group window later
+ * only once every server has acked it, and its checksum then has the server
+ * drop it.
+ */
+void compressSegment(Segment *segment) {
+  if (segment->size == 0 || segment->seqNum < groupBase)
+    return;
+
+  CompressedSlot *slot = &compressRing[segment->seqNum % groupWindowSize];
+  uint64_t key = ((uint64_t) segment->seqNum + 1) << 2;
+  uint64_t tag = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+
+  if ((tag & ~(uint64_t) 3) != key) {
+    if (__atomic_load_n(&incompressibleRun, __ATOMIC_RELAXED) >= COMPRESS_SKIP && segment->seqNum % COMPRESS_PROBE != 0)
+      return;
+    if (!__atomic_compare_exchange_n(&slot->tag, &tag, key | COMPRESS_BUSY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return;
+
+    // it is only worth sending compressed if it comes out smaller
+    Compressed *compressed = (Compressed *) slot->packet;
+    int capacity = segment->size - (int) sizeof(Compressed) - 1;
+    int size = capacity > 0 ? compressData(compressCodec, compressSpeed, segment->data, segment->size, compressed + 1, capacity) : 0;
+    if (size > 0) {
+      compressed->size = htobe16(segment->size);
+      compressed->codec = compressCodec;
+      compressed->reserved = 0;
+      slot->size = sizeof(Compressed) + size;
+      slot->checksum = calculateChecksum(dataChecksumType, slot->packet, slot->size);
+      __atomic_store_n(&incompressibleRun, 0, __ATOMIC_RELAXED);
+      tag = key | COMPRESS_DONE;
+    } else {
+      __atomic_add_fetch(&incompressibleRun, 1, __ATOMIC_RELAXED);
+      tag = key | COMPRESS_RAW;
+    }
+    __atomic_store_n(&slot->tag, tag, __ATOMIC_RELEASE);
   }
 
-  if((file = fopen(filename, "rb")) == NULL) {
-    printf("Fatal Error opening the file: %s\n", filename);
+  if ((tag & 3) != COMPRESS_DONE)
+    return;
+  segment->type = ZDATA_PKT;
+  segment->data = slot->packet;
+  segment->size = slot->size;
+  segment->checksum = slot->checksum;
+}
+
+/*
+ * Returns the entry of the parity ring holding the parity packets of the
+ * given block, computing them first if no thread has yet. Each segment of
+ * the block is coded as its size, its data and zeros up to the MSS.
+ */
+ParityBlock *loadParity(int block) {
+  ParityBlock *entry = &parityRing[block % parityRingSize];
+  int blockStart = block * fecData;
+  int numData = numSegments - blockStart < fecData ? numSegments - blockStart : fecData;
+  int symbolSize = mss + FEC_SIZE_BYTES;
+
+  pthread_mutex_lock(&parityLock);
+  if (entry->block == block) {
+    pthread_mutex_unlock(&parityLock);
+    return entry;
+  }
+
+  unsigned char *data[FEC_MAX_SYMBOLS];
+  unsigned char *parity[FEC_MAX_SYMBOLS];
+  unsigned char *symbols = calloc(numData, symbolSize);
+  if (symbols == NULL) {
+    printf("Fatal Error allocating parity\n");
+    exit(3);
+  }
+  for (int i = 0; i < numData; i++) {
+    Segment segment;
+    loadSegment(blockStart + i, &segment);
+    data[i] = symbols + (size_t) i * symbolSize;
+    data[i][0] = segment.size & 0xFF;
+    data[i][1] = segment.size >> 8;
+    if (segment.size > 0)
+      memcpy(data[i] + FEC_SIZE_BYTES, segment.data, segment.size);
+  }
+
+  for (int j = 0; j < fecParity; j++) {
+    Parity *info = (Parity *) (entry->packets + (size_t) j * parityPacketSize);
+    info->numData = htobe16(numData);
+    info->numParity = fecParity;
+    info->index = j;
+    parity[j] = (unsigned char *) (info + 1);
+  }
+  fecEncode(numData, fecParity, data, parity, symbolSize);
+  for (int j = 0; j < fecParity; j++)
+    entry->checksums[j] = calculateChecksum(dataChecksumType, entry->packets + (size_t) j * parityPacketSize, parityPacketSize);
+  free(symbols);
+
+  entry->block = block;
+  pthread_mutex_unlock(&parityLock);
+  return entry;
+}
+
+/*
+ * Queues the parity packets of the block ending with the given segment to
+ * the given address, if the segment ends a block
+ */
+void queueParity(int seqNum, struct sockaddr_in *addr) {
+  if (fecData == 0 || (seqNum % fecData != fecData - 1 && seqNum != numSegments - 1))
+    return;
+
+  ParityBlock *entry = loadParity(seqNum / fecData);
+  for (int j = 0; j < fecParity; j++) {
+    Segment segment;
+    segment.seqNum = entry->block * fecData;
+    segment.type = FEC_PKT;
+    segment.flags = 0;
+    segment.digest = NULL;
+    segment.size = parityPacketSize;
+    segment.data = entry->packets + (size_t) j * parityPacketSize;
+    segment.checksum = entry->checksums[j];
+    queueSegment(&segment, addr);
+  }
+}
+
+/*
+ * Queues a segment to a single server, compressed if the server can take
+ * it and flagged if it is a retransmission, and records the time it was
+ * sent for the retransmission timer.
+ */
+void sendSegment(int seqNum, int serverNum) {
+  Segment segment;
+
+  long long now = currentTimeUsec();
+
+  loadSegment(seqNum, &segment);
+  if (servers[serverNum].window[seqNum % windowSize].retransmitted)
+    segment.flags = FLAG_RETRANSMIT;
+  if (compressCodec != CODEC_NONE && (servers[serverNum].codecs & CODEC_MASK(compressCodec)))
+    compressSegment(&segment);
+  queueSegment(&segment, &servers[serverNum].serverAddr);
+  servers[serverNum].window[seqNum % windowSize].sentTime = now;
+  congestionSent(&servers[serverNum].congestion, now);
+  countStat(&servers[serverNum].stats.bytes, segment.size);
+  countStat(&servers[serverNum].stats.packets, 1);
+}
+
+/*
+ * Returns the slot of the server table where the given address is stored,
+ * or the empty slot where it would be inserted
+ */
+int serverTableSlot(struct sockaddr_in *addr) {
+  unsigned int hash = (ntohl(addr->sin_addr.s_addr) * 2654435761u) ^ ntohs(addr->sin_port);
+  int slot = hash & (serverTableSize - 1);
+
+  while (serverTable[slot] >= 0) {
+    Server *server = &servers[serverTable[slot]];
+    if (server->serverAddr.sin_addr.s_addr == addr->sin_addr.s_addr
+        && server->serverAddr.sin_port == addr->sin_port)
+      break;
+    slot = (slot + 1) & (serverTableSize - 1);
+  }
+  return slot;
+}
+
+/*
+ * Builds the table used to look up servers by address, sized to a power of
+ * two at least twice the number of servers so lookups stay short
+ */
+void buildServerTable() {
+  serverTableSize = 1;
+  while (serverTableSize < 2 * numServers)
+    serverTableSize *= 2;
+
+  serverTable = malloc(serverTableSize * sizeof(int));
+  if (serverTable == NULL) {
+    printf("Fatal Error allocating server list\n");
+    exit(3);
+  }
+  for (int slot = 0; slot < serverTableSize; slot++)
+    serverTable[slot] = -1;
+  for (int serverNum = 0; serverNum < numServers; serverNum++)
+    serverTable[serverTableSlot(&servers[serverNum].serverAddr)] = serverNum;
+}
+
+/*
+ * Returns the index of the server with the given address, or -1 if the
+ * address does not belong to any server
+ */
+int findServer(struct sockaddr_in *addr) {
+  return serverTable[serverTableSlot(addr)];
+}
+
+/*
+ * Sets up sending to the multicast group given through -g on the paths of
+ * the only sender thread. Acks for multicast packets come back to the path
+ * the packet went out on.
+ */
+void setupGroup() {
+  unsigned char ttl = MULTICAST_TTL;
+
+  memset(&groupAddr, '\0', sizeof(struct sockaddr_in));
+  groupAddr.sin_family = AF_INET;
+  groupAddr.sin_port = htons(serverPort);
+  groupAddr.sin_addr.s_addr = inet_addr(groupName);
+  if (!IN_MULTICAST(ntohl(groupAddr.sin_addr.s_addr))) {
+    printf("Fatal Error %s is not a multicast address\n", groupName);
     exit(1);
   }
-  fseek(file, 0, SEEK_END);           // Jump to the end of the file
-  size_t fileLength = ftell(file);    // Get the current byte offset in the file
-  fseek(file, 0, SEEK_SET);           // Jump back to the beginning of the file
 
-  int numSegments = (fileLength / mss) + 1;
-  int segmentNum = 0;
-  char buffer[MAX_MSS];
-  int bufferSize;
+  for (int path = 0; path < numPaths; path++)
+    setsockopt(threadSockets[0][path], IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+}
+
+/*
+ * Updates the round trip time estimate of a server with a new sample using
+ * the Jacobson/Karels algorithm (RFC 6298), and derives the server's
+ * retransmission timeout from it.
+ */
+void updateRtt(int serverNum, long long sample) {
+  Server *server = &servers[serverNum];
+
+  recordValue(&server->stats.rtt, sample);
+  if (server->srtt == 0) {
+    server->srtt = sample;
+    server->rttvar = sample / 2;
+  } else {
+    long long delta = server->srtt > sample ? server->srtt - sample : sample - server->srtt;
+    server->rttvar = (3 * server->rttvar + delta) / 4;
+    server->srtt = (7 * server->srtt + sample) / 8;
+  }
+
+  long long variance = 4 * server->rttvar;
+  server->rto = server->srtt + (variance > CLOCK_GRANULARITY_USEC ? variance : CLOCK_GRANULARITY_USEC);
+  if (server->rto < MIN_RTO_USEC)
+    server->rto = MIN_RTO_USEC;
+  if (server->rto > MAX_RTO_USEC)
+    server->rto = MAX_RTO_USEC;
+}
 
-  while (segmentNum < numSegments) {
-    if (segmentNum < (numSegments - 1)) {
-      bufferSize = mss;
-    } else {
-      bufferSize = fileLength - (mss * segmentNum);
+/*
+ * Returns the retransmission timeout of a server with exponential backoff
+ * applied. The backoff doubles the timeout once per round of expired timers
+ * and is cleared as soon as the server acknowledges new data.
+ */
+long long currentRto(int serverNum) {
+  long long rto = servers[serverNum].rto << servers[serverNum].backoff;
+  return rto < MAX_RTO_USEC ? rto : MAX_RTO_USEC;
+}
+
+/*
+ * Returns the oldest segment some server in the group window has not
+ * acknowledged yet, which is where the group window starts
+ */
+int findGroupBase() {
+  int base = numSegments;
+
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    if (__atomic_load_n(&servers[serverNum].state, __ATOMIC_ACQUIRE) != SERVER_ACTIVE)
+      continue;
+    int serverBase = __atomic_load_n(&servers[serverNum].base, __ATOMIC_ACQUIRE);
+    if (serverBase < base)
+      base = serverBase;
+  }
+  return base;
+}
+
+/*
+ * Compares two ints for qsort
+ */
+int compareInts(const void *a, const void *b) {
+  return (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b);
+}
+
+/*
+ * Takes the thread's servers that have stayed more than lagBound segments
+ * behind the median server in the group window out of it, so that they no
+ * longer hold the group back, and either drops them or leaves them to catch
+ * up on their own. A server only counts as lagging once it has been behind
+ * for LAG_RTOS of its retransmission timeouts, so that a server which just
+ * waits out one lost segment is not mistaken for a slow one.
+ */
+void checkLaggards() {
+  int numActive = 0;
+
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    if (__atomic_load_n(&servers[serverNum].state, __ATOMIC_ACQUIRE) == SERVER_ACTIVE)
+      activeBases[numActive++] = __atomic_load_n(&servers[serverNum].base, __ATOMIC_ACQUIRE);
+  }
+  if (numActive < 2)
+    return;
+  qsort(activeBases, numActive, sizeof(int), compareInts);
+  int median = activeBases[numActive / 2];
+
+  long long now = currentTimeUsec();
+  for (int serverNum = threadNum; serverNum < numServers; serverNum += numThreads) {
+    Server *server = &servers[serverNum];
+    if (server->state != SERVER_ACTIVE)
+      continue;
+    if (median - server->base <= lagBound) {
+      server->laggingSince = 0;
+      continue;
     }
+    if (server->laggingSince == 0)
+      server->laggingSince = now;
+    if (now - server->laggingSince <= LAG_RTOS * server->rto)
+      continue;
+    printf("Server %s is lagging at sequence number = %d, %s\n", inet_ntoa(server->serverAddr.sin_addr),
+           server->base, lagPolicy == LAG_DROP ? "dropping it" : "catching it up on its own");
+    __atomic_store_n(&server->state, lagPolicy == LAG_DROP ? SERVER_DROPPED : SERVER_CATCHUP, __ATOMIC_RELEASE);
+  }
+}
 
-    int nread = fread(buffer, 1, bufferSize, file);
-    if (nread != bufferSize) {
-      printf("Fatal Error nread %d, bufferSize %d\n", nread, bufferSize);
-      exit(2);
+/*
+ * Marks a segment as acknowledged by a server at now, counting the time it
+ * took to complete, and sets repaired if the segment was repaired. Returns
+ * the time the segment was sent if it gives a round trip time sample, which
+ * is only the case for its first ack when it was not retransmitted to that
+ * server, since the ack could otherwise belong to either transmission
+ * (Karn's rule). Returns zero otherwise.
+ */
+long long markAcked(int serverNum, int seqNum, long long now, bool *repaired) {
+  Transmission *transmission = &servers[serverNum].window[seqNum % windowSize];
+
+  if (transmission->acked)
+    return 0;
+  transmission->acked = true;
+  *repaired = *repaired || transmission->repaired;
+  recordValue(&servers[serverNum].stats.completion, now - transmission->firstSentTime);
+  return transmission->retransmitted ? 0 : transmission->sentTime;
+}
+
+/*
+ * Records an acknowledgement from a server. The cumulative ack covers every
+ * segment up to and including it, and the selective ack bitmap covers the
+ * segments received out of sequence beyond it. The server's window then
+ * slides past every segment it has acknowledged.
+ *
+ * Any newly acknowledged segment clears the server's backoff and gives a
+ * round trip time sample. The sample is timed from the echoed timestamp of
+ * the data packet that drew the ack when the server echoes one, which is
+ * exact even for retransmissions, and from the most recently sent of the
+ * segments otherwise. A repair is the parent's copy of the packet, which
+ * still carries the timestamp of the client's first transmission, so an ack
+ * of a repaired segment gives no sample from its echo. Both are passed on
+ * to the server's congestion controller.
+ */
+void handleAck(int serverNum, Ack *ack, long long echoed) {
+  Server *server = &servers[serverNum];
+  long long now = currentTimeUsec();
+  long long sampleTime = 0;
+  long long sentTime;
+  int64_t wireAck = headerSeqNum(&ack->hdr);
+  int64_t sackBase = (int64_t) be64toh(ack->sackBase);
+  uint64_t sackBits = be64toh(ack->sackBits);
+  int acked = 0;
+  bool repaired = false;
+
+  if (wireAck < INVALID_SEQ_NO || wireAck >= numSegments || sackBase < 0)
+    return;
+  int ackNum = (int) wireAck;
+  server->codecs = be32toh(ack->codecs);
+
+  // a server catching up, or resuming a transfer, may already have segments
+  // it was never sent on its own, so its window skips ahead to its cumulative
+  // ack, unless the group is sending it the segments in order
+  if (ackNum >= server->nextSeqNum && (server->state == SERVER_CATCHUP || groupName == NULL) && ackNum < numSegments) {
+    server->nextSeqNum = ackNum + 1;
+    __atomic_store_n(&server->base, ackNum + 1, __ATOMIC_RELEASE);
+    server->backoff = 0;
+    return;
+  }
+  if (ackNum >= server->nextSeqNum)
+    ackNum = server->nextSeqNum - 1;
+  for (int seqNum = server->base; seqNum <= ackNum; seqNum++) {
+    acked += !server->window[seqNum % windowSize].acked;
+    if ((sentTime = markAcked(serverNum, seqNum, now, &repaired)) > sampleTime)
+      sampleTime = sentTime;
+  }
+
+  for (int bit = 0; bit < SACK_BITS; bit++) {
+    int64_t seqNum = sackBase + bit;
+    if (!(sackBits & ((uint64_t) 1 << bit)) || seqNum < server->base || seqNum >= server->nextSeqNum)
+      continue;
+    acked += !server->window[seqNum % windowSize].acked;
+    if ((sentTime = markAcked(serverNum, seqNum, now, &repaired)) > sampleTime)
+      sampleTime = sentTime;
+  }
+
+  int base = server->base;
+  while (base < server->nextSeqNum && server->window[base % windowSize].acked)
+    base++;
+  __atomic_store_n(&server->base, base, __ATOMIC_RELEASE);
+
+  long long sample = sampleTime > 0 ? now - sampleTime : 0;
+  if (acked > 0 && !repaired && echoed > 0 && echoed <= now)
+    sample = now - echoed;
+  if (acked > 0)
+    server->backoff = 0;
+  else
+    countStat(&server->stats.duplicateAcks, 1);
+  if (sample > 0)
+    updateRtt(serverNum, sample);
+  congestionAcked(&server->congestion, acked, server->srtt, sample, server->nextSeqNum - base, now);
+}
+
+/*
+ * Answers a server's request to join the transfer late with the file size
+ * and the MSS. On the first request the server has none of the file, so its
+ * window starts over from the beginning, and it catches up on its own so
+ * that it does not hold the group back. A server that has acknowledged
+ * nothing yet, as one keeping a journal does when it joins from the start,
+ * only needs what was sent before it asked resent. The start of a stream is
+ * gone once the server has acknowledged some of it, so a server joining a
+ * stream later than that is dropped instead.
+ */
+void handleJoin(int serverNum) {
+  Server *server = &servers[serverNum];
+  Join answer;
+
+  memset(&answer, '\0', sizeof(answer));
+  fillHeader(&answer.hdr, JOIN_PKT, sessionId, INVALID_SEQ_NO, dataChecksumType, 0);
+  answer.hdr.flags = (batching ? FLAG_BATCH : 0) | (blockDigests != NULL ? FLAG_HASHED : 0);
+  answer.fileLength = htobe64(streaming ? STREAM_LENGTH : fileLength);
+  answer.mss = htobe32(mss);
+  sendto(sockfd, &answer, sizeof(answer), 0, (struct sockaddr *) &server->serverAddr, sizeof(struct sockaddr_in));
+
+  if (server->joined || server->state == SERVER_DROPPED)
+    return;
+  server->joined = true;
+  server->numMissing = 0;
+  if (server->base == 0) {
+    if (groupName == NULL || server->state == SERVER_CATCHUP)
+      server->nextSeqNum = 0;
+    server->backoff = 0;
+    return;
+  }
+  if (streaming) {
+    printf("Server %s cannot join a stream late, dropping it\n", inet_ntoa(server->serverAddr.sin_addr));
+    __atomic_store_n(&server->state, SERVER_DROPPED, __ATOMIC_RELEASE);
+    return;
+  }
+  printf("Server %s joined late, catching it up from the start\n", inet_ntoa(server->serverAddr.sin_addr));
+  server->nextSeqNum = 0;
+  server->backoff = 0;
+  server->laggingSince = 0;
+  __atomic_store_n(&server->base, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&server->state, SERVER_CATCHUP, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the first segment from the given one on that a server may be
+ * missing, by the ranges it last sent, which is numSegments if it has all
+ * of them
+ */
+int nextMissing(Server *server, int seqNum) {
+  if (server->numMissing == 0)
+    return seqNum;
+  for (int range = 0; range < server->numMissing; range++) {
+    if (seqNum < server->missing[2 * range + 1])
+      return seqNum > server->missing[2 * range] ? seqNum : server->missing[2 * range];
+  }
+  return numSegments;
+}
+
+/*
+ * Takes the ranges of segments a server says it is missing. The segments
+ * outstanding to it outside of them are as good as acknowledged, and those
+ * it has not been sent yet are skipped when their turn comes. A server
+ * missing segments it had acknowledged has lost them, as when it restarted
+ * from its journal, and catches up from the first one on its own, unless the
+ * transfer is a stream that no longer holds them.
+ */
+void handleRanges(int serverNum, Ranges *ranges) {
+  Server *server = &servers[serverNum];
+  uint32_t numRanges = be32toh(ranges->numRanges);
+
+  if (numRanges < 1 || numRanges > MAX_RANGES || server->state == SERVER_DROPPED)
+    return;
+  // the ranges are 64-bit on the wire, and none can run past the file
+  for (uint32_t i = 0; i < 2 * numRanges; i++) {
+    uint64_t seqNum = be64toh(ranges->ranges[i]);
+    server->missing[i] = seqNum < (uint64_t) numSegments ? (int) seqNum : numSegments;
+  }
+  server->numMissing = numRanges;
+
+  int first = server->missing[0];
+  if (first < server->base) {
+    if (streaming) {
+      printf("Server %s lost part of the stream, dropping it\n", inet_ntoa(server->serverAddr.sin_addr));
+      __atomic_store_n(&server->state, SERVER_DROPPED, __ATOMIC_RELEASE);
+      return;
     }
+    printf("Server %s is missing sequence number = %d again, catching it up\n", inet_ntoa(server->serverAddr.sin_addr), first);
+    server->nextSeqNum = first;
+    server->backoff = 0;
+    server->laggingSince = 0;
+    __atomic_store_n(&server->state, SERVER_CATCHUP, __ATOMIC_RELEASE);
+    __atomic_store_n(&server->base, first, __ATOMIC_RELEASE);
+    return;
+  }
+
+  for (int seqNum = server->base; seqNum < server->nextSeqNum; seqNum++) {
+    if (nextMissing(server, seqNum) != seqNum)
+      server->window[seqNum % windowSize].acked = true;
+  }
+  int base = server->base;
+  while (base < server->nextSeqNum && server->window[base % windowSize].acked)
+    base++;
+  __atomic_store_n(&server->base, base, __ATOMIC_RELEASE);
+}
 
-    // send segment to all Servers with Retries
-    sendPacket(segmentNum, buffer, bufferSize);
+/*
+ * Puts a server that was catching up back in the group window once it has
+ * caught up with the group. With multicast it must also have nothing
+ * outstanding, since the group's next segment is then the next one it gets.
+ */
+void checkCaughtUp(int serverNum) {
+  Server *server = &servers[serverNum];
+
+  if (server->state != SERVER_CATCHUP || server->base < groupBase || server->base == numSegments)
+    return;
+  if (groupName != NULL && (server->nextSeqNum != server->base || server->base != groupNextSeqNum))
+    return;
+  printf("Server %s caught up at sequence number = %d\n", inet_ntoa(server->serverAddr.sin_addr), server->base);
+  server->laggingSince = 0;
+  __atomic_store_n(&server->state, SERVER_ACTIVE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the segment a server's window, receive window and congestion window
+ * stop it from being sent, and for a server in the group window, the group
+ * window too
+ */
+int sendLimit(int serverNum) {
+  Server *server = &servers[serverNum];
+  int window = congestionWindow(&server->congestion);
+  if (server->receiveWindow < window)
+    window = server->receiveWindow;
+  int limit = server->base + window;
+
+  if (server->state == SERVER_ACTIVE && groupBase + groupWindowSize < limit)
+    limit = groupBase + groupWindowSize;
+  int available = __atomic_load_n(&availableSegments, __ATOMIC_ACQUIRE);
+  if (available < limit)
+    limit = available;
+  return limit;
+}
+
+/*
+ * Moves a server's window past the segments before the given one, which the
+ * server already has, as if it had acknowledged them. A window with nothing
+ * outstanding jumps straight there, and one that still has segments
+ * outstanding fills its slots with acknowledged ones up to its limit.
+ */
+void skipSegments(int serverNum, int seqNum) {
+  Server *server = &servers[serverNum];
+
+  if (server->base == server->nextSeqNum) {
+    server->nextSeqNum = seqNum;
+    __atomic_store_n(&server->base, seqNum, __ATOMIC_RELEASE);
+    return;
+  }
+  while (server->nextSeqNum < seqNum && server->nextSeqNum < server->base + windowSize) {
+    Transmission *transmission = &server->window[server->nextSeqNum % windowSize];
+    transmission->acked = true;
+    transmission->retransmitted = false;
+    transmission->repaired = false;
+    server->nextSeqNum++;
+  }
+}
+
+/*
+ * Returns the server relaying the transfer to the given one, or -1 if the
+ * client sends it the transfer itself: a server is only relayed to while
+ * both it and its parent are in the group window
+ */
+int findFeeder(int serverNum) {
+  int parent = servers[serverNum].parent;
+
+  if (parent < 0 || servers[serverNum].state != SERVER_ACTIVE || servers[parent].state != SERVER_ACTIVE)
+    return -1;
+  return parent;
+}
+
+/*
+ * Returns whether a server has acknowledged the given segment
+ */
+bool hasAcked(Server *server, int seqNum) {
+  return seqNum < server->base || (seqNum < server->nextSeqNum && server->window[seqNum % windowSize].acked);
+}
+
+/*
+ * Starts every segment a relayed server's windows allow, which its parent
+ * has been sent and passes on, in its window as sent now. Parents come
+ * before their children, so a segment starts in the window of every server
+ * down the tree in the same round it is sent to the top.
+ */
+void relayNewSegments(int serverNum, int feeder) {
+  Server *server = &servers[serverNum];
+  long long now = currentTimeUsec();
+
+  while (server->nextSeqNum < sendLimit(serverNum) && server->nextSeqNum < servers[feeder].nextSeqNum) {
+    int missing = nextMissing(server, server->nextSeqNum);
+    if (missing > server->nextSeqNum) {
+      skipSegments(serverNum, missing);
+      continue;
+    }
+    Transmission *transmission = &server->window[server->nextSeqNum % windowSize];
+    transmission->firstSentTime = now;
+    transmission->sentTime = now;
+    transmission->acked = false;
+    transmission->retransmitted = false;
+    transmission->repaired = false;
+    congestionSent(&server->congestion, now);
+    countStat(&server->stats.relayed, 1);
+    server->nextSeqNum++;
+  }
+}
+
+/*
+ * Asks the parent of a relayed server to resend it a segment, and restarts
+ * the segment's timer
+ */
+void requestRepair(int seqNum, int serverNum, int feeder) {
+  Repair repair;
+
+  memset(&repair, '\0', sizeof(repair));
+  fillHeader(&repair.hdr, REPAIR_PKT, sessionId, seqNum, dataChecksumType, 0);
+  repair.peer.address = servers[serverNum].serverAddr.sin_addr.s_addr;
+  repair.peer.port = servers[serverNum].serverAddr.sin_port;
+  sendto(sockfd, &repair, sizeof(repair), 0, (struct sockaddr *) &servers[feeder].serverAddr, sizeof(struct sockaddr_in));
+  servers[serverNum].window[seqNum % windowSize].sentTime = currentTimeUsec();
+  servers[serverNum].window[seqNum % windowSize].repaired = true;
+  countStat(&servers[serverNum].stats.repairs, 1);
+}
+
+/*
+ * Resends a segment whose timer expired to a server, asking its parent for
+ * it first if the parent has it, and the client sending it otherwise
+ */
+void resendSegment(int seqNum, int serverNum) {
+  Server *server = &servers[serverNum];
+  Transmission *transmission = &server->window[seqNum % windowSize];
+  int feeder = findFeeder(serverNum);
+  bool repair = feeder >= 0 && !transmission->retransmitted && hasAcked(&servers[feeder], seqNum);
+
+  transmission->retransmitted = true;
+  if (repair) {
+    requestRepair(seqNum, serverNum, feeder);
+  } else {
+    sendSegment(seqNum, serverNum);
+    countStat(&server->stats.retransmits, 1);
+  }
+}
+
+/*
+ * Sends a server every new segment its windows allow that it may be
+ * missing, as fast as its pacing rate allows, unless it is relayed to
+ */
+void sendNewSegments(int serverNum) {
+  Server *server = &servers[serverNum];
+  int feeder = findFeeder(serverNum);
+  if (feeder >= 0) {
+    relayNewSegments(serverNum, feeder);
+    return;
+  }
+  int limit = sendLimit(serverNum);
+
+  while (server->nextSeqNum < limit && congestionSendDelay(&server->congestion, currentTimeUsec()) == 0) {
+    int missing = nextMissing(server, server->nextSeqNum);
+    if (missing > server->nextSeqNum) {
+      skipSegments(serverNum, missing);
+      limit = sendLimit(serverNum);
+      continue;
+    }
+    Transmission *transmission = &server->window[server->nextSeqNum % windowSize];
+    transmission->acked = false;
+    transmission->retransmitted = false;
+    transmission->repaired = false;
+    sendSegment(server->nextSeqNum, serverNum);
+    transmission->firstSentTime = transmission->sentTime;
+    if (server->state == SERVER_ACTIVE && (server->capabilities & CAP_FEC))
+      queueParity(server->nextSeqNum, &server->serverAddr);
+    server->nextSeqNum++;
+  }
+}
+
+/*
+ * Returns the segment the windows, receive windows and congestion windows of
+ * the servers in the group window stop the group from being sent
+ */
+int groupSendLimit() {
+  int limit = groupBase + windowSize;
+
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    Server *server = &servers[serverNum];
+    int window = congestionWindow(&server->congestion);
+    if (server->receiveWindow < window)
+      window = server->receiveWindow;
+    if (server->state == SERVER_ACTIVE && server->base + window < limit)
+      limit = server->base + window;
+  }
+  int available = __atomic_load_n(&availableSegments, __ATOMIC_ACQUIRE);
+  return available < limit ? available : limit;
+}
+
+/*
+ * Returns the number of microseconds until the pacing of every server in
+ * the group window lets the next segment be multicast
+ */
+long long groupSendDelay(long long now) {
+  long long delay = 0;
+
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    long long serverDelay = congestionSendDelay(&servers[serverNum].congestion, now);
+    if (servers[serverNum].state == SERVER_ACTIVE && serverDelay > delay)
+      delay = serverDelay;
+  }
+  return delay;
+}
+
+/*
+ * Returns whether every server in the group window can decompress the
+ * codec segments are compressed with
+ */
+bool groupCanDecompress() {
+  if (compressCodec == CODEC_NONE)
+    return false;
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    if (servers[serverNum].state == SERVER_ACTIVE && !(servers[serverNum].codecs & CODEC_MASK(compressCodec)))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Sends every new segment the windows of the servers in the group window
+ * allow once to the multicast group, compressed if they can all take it, and
+ * starts it in the window of every one of those servers. The group cannot run
+ * ahead of its slowest server here, since every server gets every multicast
+ * segment, and is paced at the rate of its slowest path.
+ */
+void multicastNewSegments() {
+  int limit = groupSendLimit();
+
+  while (groupNextSeqNum < limit && groupSendDelay(currentTimeUsec()) == 0) {
+    Segment segment;
+    loadSegment(groupNextSeqNum, &segment);
+    if (groupCanDecompress())
+      compressSegment(&segment);
+    queueSegment(&segment, &groupAddr);
+    queueParity(groupNextSeqNum, &groupAddr);
+
+    long long now = currentTimeUsec();
+    for (int serverNum = 0; serverNum < numServers; serverNum++) {
+      if (servers[serverNum].state != SERVER_ACTIVE)
+        continue;
+      Transmission *transmission = &servers[serverNum].window[groupNextSeqNum % windowSize];
+      transmission->firstSentTime = now;
+      transmission->sentTime = now;
+      transmission->acked = false;
+      transmission->retransmitted = false;
+      transmission->repaired = false;
+      servers[serverNum].nextSeqNum = groupNextSeqNum + 1;
+      congestionSent(&servers[serverNum].congestion, now);
+      countStat(&servers[serverNum].stats.bytes, segment.size);
+      countStat(&servers[serverNum].stats.packets, 1);
+    }
+    groupNextSeqNum++;
+  }
+}
+
+/*
+ * Retransmits segments whose timer has expired. In Go-Back-N mode a single
+ * timer runs on the oldest unacknowledged segment of each server, and when it
+ * fires every outstanding segment the server has not selectively acked is
+ * resent to it. In selective repeat mode each segment has its own timer per
+ * server and only that segment is resent. Every server uses its own
+ * retransmission timeout, which is backed off once for each round of timer
+ * expiries, and the first expiry of a round tells the congestion controller
+ * of a loss.
+ */
+void checkTimers(int serverNum) {
+  Server *server = &servers[serverNum];
+  long long now = currentTimeUsec();
+  long long timeout = currentRto(serverNum);
+  int lost = INVALID_SEQ_NO;
+
+  if (server->state == SERVER_DROPPED)
+    return;
+
+  if (arqMode == GO_BACK_N) {
+    int first = server->base;
+    if (first >= server->nextSeqNum)
+      return;
+    if (now - server->window[first % windowSize].sentTime < timeout)
+      return;
+    logLimited("Timeout, sequence number = %d\n", first);
+    lost = first;
+    for (int seqNum = first; seqNum < server->nextSeqNum; seqNum++) {
+      Transmission *transmission = &server->window[seqNum % windowSize];
+      if (transmission->acked)
+        continue;
+      resendSegment(seqNum, serverNum);
+    }
+  } else {
+    for (int seqNum = server->base; seqNum < server->nextSeqNum; seqNum++) {
+      Transmission *transmission = &server->window[seqNum % windowSize];
+      if (transmission->acked || now - transmission->sentTime < timeout)
+        continue;
+      logLimited("Timeout, sequence number = %d\n", seqNum);
+      if (lost == INVALID_SEQ_NO)
+        lost = seqNum;
+      resendSegment(seqNum, serverNum);
+    }
+  }
+
+  if (lost == INVALID_SEQ_NO)
+    return;
+  countStat(&server->stats.timeouts, 1);
+  congestionLost(&server->congestion, lost, server->nextSeqNum, server->backoff > 0);
+  if (currentRto(serverNum) < MAX_RTO_USEC)
+    server->backoff++;
+}
+
+/*
+ * Returns the number of microseconds until the earliest retransmission timer
+ * among the segments outstanding to the thread's servers expires, or until
+ * pacing lets a server that has new segments waiting be sent the next one,
+ * or zero if either already has.
+ */
+long long nextTimeout() {
+  long long now = currentTimeUsec();
+  long long earliest = MAX_RTO_USEC;
+
+  if (groupName != NULL && groupNextSeqNum < groupSendLimit())
+    earliest = groupSendDelay(now);
+
+  for (int serverNum = threadNum; serverNum < numServers; serverNum += numThreads) {
+    Server *server = &servers[serverNum];
+    if (server->state == SERVER_DROPPED)
+      continue;
+    if ((groupName == NULL || server->state == SERVER_CATCHUP) && findFeeder(serverNum) < 0
+        && server->nextSeqNum < sendLimit(serverNum)) {
+      long long delay = congestionSendDelay(&server->congestion, now);
+      if (delay < earliest)
+        earliest = delay;
+    }
+    for (int seqNum = server->base; seqNum < server->nextSeqNum; seqNum++) {
+      Transmission *transmission = &server->window[seqNum % windowSize];
+      if (transmission->acked)
+        continue;
+      long long remaining = transmission->sentTime + currentRto(serverNum) - now;
+      if (remaining < earliest)
+        earliest = remaining;
+      if (arqMode == GO_BACK_N)
+        break;
+    }
+  }
+  return earliest > 0 ? earliest : 0;
+}
+
+/*
+ * Wakes every other sender thread, after the group window has moved and
+ * their servers may be sent new segments
+ */
+void wakeThreads() {
+  uint64_t one = 1;
+
+  for (int thread = 0; thread < numThreads; thread++) {
+    if (thread != threadNum && write(threadWakeFds[thread], &one, sizeof(one)) < 0)
+      continue;
+  }
+}
+
+/*
+ * Body of a sender thread, which runs the state machines of its share of the
+ * servers until every one of them has acknowledged the whole file. Acks from
+ * all of its servers are collected with a single poll on the sockets of its
+ * paths, and a timeout only retransmits to the servers still missing the ack.
+ */
+void *senderThread(void *arg) {
+  threadNum = (int) (long) arg;
+  sockfd = threadSockets[threadNum][0];
+
+  Reply replies[ACK_BATCH];
+  struct sockaddr_in ackAddrs[ACK_BATCH];
+  struct iovec ackIov[ACK_BATCH];
+  struct mmsghdr ackMsgs[ACK_BATCH];
+  struct pollfd pfds[MAX_PATHS + 1];
+
+  pfds[0].fd = threadWakeFds[threadNum];
+  pfds[0].events = POLLIN;
+  for (int path = 0; path < numPaths; path++) {
+    pfds[path + 1].fd = threadSockets[threadNum][path];
+    pfds[path + 1].events = POLLIN;
+  }
+
+  if (lagPolicy != LAG_NONE && (activeBases = malloc(numServers * sizeof(int))) == NULL) {
+    printf("Fatal Error allocating server list\n");
+    exit(3);
+  }
+
+  for (int i = 0; i < ACK_BATCH; i++) {
+    ackIov[i].iov_base = &replies[i];
+    ackIov[i].iov_len = sizeof(Reply);
+    memset(&ackMsgs[i].msg_hdr, '\0', sizeof(struct msghdr));
+    ackMsgs[i].msg_hdr.msg_iov = &ackIov[i];
+    ackMsgs[i].msg_hdr.msg_iovlen = 1;
+    ackMsgs[i].msg_hdr.msg_name = &ackAddrs[i];
+  }
+
+  while (true) {
+    // the thread is done once all of its servers have the whole file
+    bool done = true;
+    for (int serverNum = threadNum; serverNum < numServers; serverNum += numThreads)
+      done = done && (servers[serverNum].base == numSegments || servers[serverNum].state == SERVER_DROPPED);
+    if (done)
+      break;
+
+    // send every server the new segments the group window now allows,
+    // multicasting them to the servers in it when there is a group
+    if (lagPolicy != LAG_NONE)
+      checkLaggards();
+    groupBase = findGroupBase();
+    for (int serverNum = threadNum; serverNum < numServers; serverNum += numThreads)
+      checkCaughtUp(serverNum);
+    if (groupName != NULL)
+      multicastNewSegments();
+    for (int serverNum = threadNum; serverNum < numServers; serverNum += numThreads) {
+      if (groupName == NULL || servers[serverNum].state == SERVER_CATCHUP)
+        sendNewSegments(serverNum);
+    }
+    flushSegments();
+
+    // wait for acks from any server until the earliest timer expires or
+    // pacing lets the next segment go, to the microsecond
+    long long waitUsec = nextTimeout();
+    struct timespec wait = { .tv_sec = waitUsec / 1000000, .tv_nsec = waitUsec % 1000000 * 1000 };
+
+    if (ppoll(pfds, numPaths + 1, &wait, NULL) > 0) {
+      uint64_t wakeups;
+      if ((pfds[0].revents & POLLIN) && read(threadWakeFds[threadNum], &wakeups, sizeof(wakeups)) < 0)
+        wakeups = 0;
+
+      // drain every pending ack of every path in bursts, matching servers by
+      // source address
+      for (int path = 0; path < numPaths; path++) {
+        if (!(pfds[path + 1].revents & POLLIN))
+          continue;
+        int n;
+        do {
+          for (int i = 0; i < ACK_BATCH; i++)
+            ackMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+          n = recvmmsg(pfds[path + 1].fd, ackMsgs, ACK_BATCH, MSG_DONTWAIT, NULL);
+          for (int i = 0; i < n; i++) {
+            int serverNum = findServer(&ackAddrs[i]);
+            int size = packetLength(&replies[i].hdr, ackMsgs[i].msg_len);
+            if (serverNum < 0 || serverNum % numThreads != threadNum || size < 0
+                || headerSessionId(&replies[i].hdr) != sessionId)
+              continue;
+            uint16_t type = headerType(&replies[i].hdr);
+            if (size == sizeof(Ack) && type == ACK_PKT)
+              handleAck(serverNum, &replies[i].ack, (long long) findTimestamp(&replies[i].hdr, ackMsgs[i].msg_len, EXT_ECHO));
+            else if (size == sizeof(Join) && type == JOIN_PKT)
+              handleJoin(serverNum);
+            else if (size == sizeof(Ranges) && type == RANGES_PKT)
+              handleRanges(serverNum, &replies[i].ranges);
+          }
+        } while (n == ACK_BATCH);
+      }
+
+      // the acks may have freed room in the stream ring
+      if (streaming) {
+        pthread_mutex_lock(&streamLock);
+        pthread_cond_signal(&streamCond);
+        pthread_mutex_unlock(&streamLock);
+      }
+    }
+
+    for (int serverNum = threadNum; serverNum < numServers; serverNum += numThreads)
+      checkTimers(serverNum);
+    flushSegments();
+
+    if (numThreads > 1 && findGroupBase() > groupBase)
+      wakeThreads();
+  }
+
+  // let the other threads see the last of this thread's acks
+  if (numThreads > 1)
+    wakeThreads();
+  free(activeBases);
+  return NULL;
+}
+
+/*
+ * Writes the counters of every server to the stats stream as one JSON line,
+ * elapsed microseconds into the transfer, marked final once it is over
+ */
+void writeStats(long long elapsed, bool final) {
+  static const char *stateNames[] = { "active", "catchup", "dropped" };
+
+  fprintf(statsFile, "{\"elapsed_us\":%lld,\"final\":%s,\"servers\":[", elapsed, final ? "true" : "false");
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    Server *server = &servers[serverNum];
+    ServerStats *stats = &server->stats;
+    char address[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &server->serverAddr.sin_addr, address, sizeof(address));
+    fprintf(statsFile, "%s{\"server\":\"%s\",\"state\":\"%s\",\"base\":%d,\"bytes\":%llu,"
+            "\"packets\":%llu,\"retransmits\":%llu,\"relayed\":%llu,\"repairs\":%llu,"
+            "\"timeouts\":%llu,\"duplicate_acks\":%llu,"
+            "\"srtt_us\":%lld,\"rtt_p50_us\":%lld,\"rtt_p99_us\":%lld,"
+            "\"completion_p50_us\":%lld,\"completion_p99_us\":%lld}",
+            serverNum > 0 ? "," : "", address, stateNames[__atomic_load_n(&server->state, __ATOMIC_ACQUIRE)],
+            __atomic_load_n(&server->base, __ATOMIC_ACQUIRE), (unsigned long long) loadStat(&stats->bytes),
+            (unsigned long long) loadStat(&stats->packets), (unsigned long long) loadStat(&stats->retransmits),
+            (unsigned long long) loadStat(&stats->relayed), (unsigned long long) loadStat(&stats->repairs),
+            (unsigned long long) loadStat(&stats->timeouts), (unsigned long long) loadStat(&stats->duplicateAcks),
+            __atomic_load_n(&server->srtt, __ATOMIC_RELAXED),
+            histogramQuantile(&stats->rtt, 0.5), histogramQuantile(&stats->rtt, 0.99),
+            histogramQuantile(&stats->completion, 0.5), histogramQuantile(&stats->completion, 0.99));
+  }
+  fprintf(statsFile, "]}\n");
+}
+
+/*
+ * Body of the stats thread, which exports the counters every interval
+ * until the transfer is over
+ */
+void *statsThread(void *arg) {
+  long long startTime = *(long long *) arg;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  pthread_mutex_lock(&statsLock);
+  while (!statsDone) {
+    long long nsec = deadline.tv_nsec + statsIntervalUsec * 1000;
+    deadline.tv_sec += nsec / 1000000000;
+    deadline.tv_nsec = nsec % 1000000000;
+    if (pthread_cond_timedwait(&statsCond, &statsLock, &deadline) == ETIMEDOUT && !statsDone)
+      writeStats(currentTimeUsec() - startTime, false);
+  }
+  pthread_mutex_unlock(&statsLock);
+  return NULL;
+}
+
+/*
+ * Takes a server's answer to the syn, sample microseconds after the syn it
+ * answers was sent if that was the only one, or 0. A server that cannot
+ * verify the checksum the data packets carry is dropped; any other server's
+ * window starts at its cumulative ack, the way a server catching up skips
+ * ahead, unless the group will send it the segments in order.
+ */
+void handleSynAck(int serverNum, SynAck *synAck, long long sample) {
+  Server *server = &servers[serverNum];
+
+  if (server->synced)
+    return;
+  server->synced = true;
+  if (!(be32toh(synAck->checksums) & (1u << dataChecksumType))) {
+    printf("Server %s cannot verify the checksum, dropping it\n", inet_ntoa(server->serverAddr.sin_addr));
+    __atomic_store_n(&server->state, SERVER_DROPPED, __ATOMIC_RELEASE);
+    return;
+  }
+
+  uint32_t window = be32toh(synAck->window);
+  server->codecs = be32toh(synAck->codecs);
+  server->capabilities = be32toh(synAck->capabilities);
+  if (window > 0 && window < (uint32_t) server->receiveWindow)
+    server->receiveWindow = window;
+  if (sample > 0)
+    updateRtt(serverNum, sample);
+
+  int64_t ackNum = headerSeqNum(&synAck->hdr);
+  if (ackNum >= 0 && ackNum < numSegments && groupName == NULL) {
+    server->nextSeqNum = (int) ackNum + 1;
+    __atomic_store_n(&server->base, (int) ackNum + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Builds the syn of a server from the one every server is sent, naming the
+ * server's children if it has any in the relay tree. Returns the size of
+ * the packet.
+ */
+int buildSyn(int serverNum, Syn *syn, TreeSyn *packet) {
+  int first = treeFanout * (serverNum + 1);
+
+  packet->syn = *syn;
+  if (treeFanout == 0 || first >= numServers)
+    return sizeof(Syn);
+
+  memset(&packet->children, '\0', sizeof(Children));
+  for (int child = first; child < first + treeFanout && child < numServers; child++) {
+    Peer *peer = &packet->children.peers[packet->children.numChildren++];
+    peer->address = servers[child].serverAddr.sin_addr.s_addr;
+    peer->port = servers[child].serverAddr.sin_port;
+  }
+  packet->extType = EXT_CHILDREN;
+  packet->extLength = sizeof(Children);
+  packet->syn.hdr.extLength = 2 + sizeof(Children);
+  return sizeof(TreeSyn);
+}
+
+/*
+ * Opens the transfer with every server before any data is sent: sends each
+ * one the syn from the socket of the thread that will drive it, and repeats
+ * it every initial retransmission timeout until every server has answered
+ * or HANDSHAKE_TRIES have gone by. The ranges a resuming server sends along
+ * with its answer are taken too. A server that did not answer relays to
+ * nobody, so it and its children are then sent the transfer directly.
+ */
+void handshake() {
+  Syn syn;
+  struct pollfd pfds[MAX_THREADS];
+  int pending = numServers;
+
+  memset(&syn, '\0', sizeof(syn));
+  fillHeader(&syn.hdr, SYN_PKT, sessionId, INVALID_SEQ_NO, dataChecksumType, 0);
+  syn.hdr.flags = (batching ? FLAG_BATCH : 0) | (blockDigests != NULL ? FLAG_HASHED : 0);
+  syn.fileLength = htobe64(streaming ? STREAM_LENGTH : fileLength);
+  syn.mss = htobe32(mss);
+  syn.window = htobe32(windowSize);
+  syn.fecData = htobe16(fecData);
+  syn.fecParity = fecParity;
+  syn.codecs = htobe32(compressCodec != CODEC_NONE ? CODEC_MASK(compressCodec) : 0);
+
+  for (int thread = 0; thread < numThreads; thread++) {
+    pfds[thread].fd = threadSockets[thread][0];
+    pfds[thread].events = POLLIN;
+  }
+
+  for (int attempt = 0; attempt < HANDSHAKE_TRIES && pending > 0; attempt++) {
+    long long sentTime = currentTimeUsec();
+    for (int serverNum = 0; serverNum < numServers; serverNum++) {
+      TreeSyn packet;
+      if (!servers[serverNum].synced)
+        sendto(threadSockets[serverNum % numThreads][0], &packet, buildSyn(serverNum, &syn, &packet), 0,
+               (struct sockaddr *) &servers[serverNum].serverAddr, sizeof(struct sockaddr_in));
+    }
+
+    long long deadline = sentTime + (long long) TIMEOUT_SEC * 1000000 + TIMEOUT_USEC;
+    long long now;
+    while (pending > 0 && (now = currentTimeUsec()) < deadline) {
+      if (poll(pfds, numThreads, (deadline - now + 999) / 1000) <= 0)
+        continue;
+      for (int thread = 0; thread < numThreads; thread++) {
+        Reply reply;
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        ssize_t size;
+        while ((size = recvfrom(threadSockets[thread][0], &reply, sizeof(reply), MSG_DONTWAIT,
+                                (struct sockaddr *) &addr, &addrLen)) >= 0) {
+          int serverNum = findServer(&addr);
+          addrLen = sizeof(addr);
+          size = packetLength(&reply.hdr, size);
+          if (serverNum < 0 || size < 0 || headerSessionId(&reply.hdr) != sessionId)
+            continue;
+          uint16_t type = headerType(&reply.hdr);
+          if (size == sizeof(SynAck) && type == SYNACK_PKT && !servers[serverNum].synced) {
+            handleSynAck(serverNum, &reply.synAck, attempt == 0 ? currentTimeUsec() - sentTime : 0);
+            pending--;
+          } else if (size == sizeof(Ranges) && type == RANGES_PKT) {
+            handleRanges(serverNum, &reply.ranges);
+          }
+        }
+      }
+    }
+  }
+
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    if (servers[serverNum].synced)
+      continue;
+    printf("Server %s did not answer the handshake, it may still join late\n", inet_ntoa(servers[serverNum].serverAddr.sin_addr));
+    servers[serverNum].parent = -1;
+    for (int child = 0; child < numServers; child++) {
+      if (servers[child].parent == serverNum)
+        servers[child].parent = -1;
+    }
+  }
+}
+
+/*
+ * Returns the oldest segment of a stream some server may still be sent,
+ * from the start of its block with forward error correction, as its parity
+ * is computed from the whole block. The ring slots before it are free.
+ */
+int streamReleased() {
+  int oldest = STREAM_SEGMENTS;
+
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    if (__atomic_load_n(&servers[serverNum].state, __ATOMIC_ACQUIRE) == SERVER_DROPPED)
+      continue;
+    int base = __atomic_load_n(&servers[serverNum].base, __ATOMIC_ACQUIRE);
+    if (base < oldest)
+      oldest = base;
+  }
+  return fecData > 0 ? oldest - oldest % fecData : oldest;
+}
+
+/*
+ * Waits until the stream ring has room for segments up to but not including
+ * the given one, and returns how many segments it has room for in all
+ */
+int waitForStreamRoom(int seqNum) {
+  int room;
+
+  pthread_mutex_lock(&streamLock);
+  while ((room = streamReleased() + streamRingSize) <= seqNum) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 10000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&streamCond, &streamLock, &deadline);
+  }
+  pthread_mutex_unlock(&streamLock);
+  return room;
+}
+
+/*
+ * Makes the segments of the stream before the given one available to the
+ * sender threads and wakes them
+ */
+void publishSegments(int seqNum) {
+  uint64_t one = 1;
+
+  __atomic_store_n(&availableSegments, seqNum, __ATOMIC_RELEASE);
+  for (int thread = 0; thread < numThreads; thread++) {
+    if (write(threadWakeFds[thread], &one, sizeof(one)) < 0)
+      continue;
+  }
+}
+
+/*
+ * Body of the reader thread, which reads a stream into the ring as room
+ * frees up. Each read fills as much of the ring as is free in one piece,
+ * and every segment it completes is made available at once, so a pipe is
+ * drained in large reads and the senders are woken once per read. A
+ * segment is only sent once it holds a full MSS, or at the end of the
+ * stream, which is followed by the EOF segment.
+ */
+void *readerThread(void *arg) {
+  size_t ringBytes = (size_t) streamRingSize * mss;
+  size_t streamLength = 0;
+  int seqNum = 0;
+
+  (void) arg;
+  while (true) {
+    int room = waitForStreamRoom(seqNum);
+    size_t start = streamLength % ringBytes;
+    size_t size = (size_t) (room - seqNum) * mss - streamLength % mss;
+    if (size > ringBytes - start)
+      size = ringBytes - start;
+
+    ssize_t n = read(streamFd, streamData + start, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      printf("Fatal Error reading the file: %s\n", filename);
+      exit(2);
+    }
+    if (n == 0)
+      break;
+
+    streamLength += n;
+    if (streamLength / mss + 1 >= STREAM_SEGMENTS) {
+      printf("Fatal Error the stream is too long for segments of %d bytes, use a larger MSS\n", mss);
+      exit(1);
+    }
+    int complete = streamLength / mss;
+    for (; seqNum < complete; seqNum++)
+      streamSizes[seqNum % streamRingSize] = mss;
+    publishSegments(seqNum);
+  }
+
+  // send the last partial segment, then the EOF segment, once there is room
+  if (streamLength % mss > 0) {
+    streamSizes[seqNum % streamRingSize] = streamLength % mss;
+    seqNum++;
+  }
+  waitForStreamRoom(seqNum);
+  streamSizes[seqNum % streamRingSize] = 0;
+  fileLength = streamLength;
+  __atomic_store_n(&numSegments, seqNum + 1, __ATOMIC_RELEASE);
+  publishSegments(seqNum + 1);
+  return NULL;
+}
+
+/*
+ * Body of a hasher thread, which digests the next block no thread has taken
+ * yet until there are none left. The blocks hashed in order from the start
+ * are chained into the digest of the file and made available to the sender
+ * threads, and once the last one is, so is the EOF segment with the digest
+ * of the file.
+ */
+void *hasherThread(void *arg) {
+  size_t blockBytes = (size_t) HASH_SEGMENTS * mss;
+  int block;
+
+  (void) arg;
+  while ((block = __atomic_fetch_add(&nextHashBlock, 1, __ATOMIC_RELAXED)) < numBlocks) {
+    size_t start = (size_t) block * blockBytes;
+    hashData(fileData + start, fileLength - start < blockBytes ? fileLength - start : blockBytes,
+             blockDigests[block].hash);
+
+    pthread_mutex_lock(&hashLock);
+    blocksHashed[block] = true;
+    int hashed = hashedBlocks;
+    while (hashedBlocks < numBlocks && blocksHashed[hashedBlocks])
+      updateHasher(&fileHasher, blockDigests[hashedBlocks++].hash, HASH_SIZE);
+    if (hashedBlocks == numBlocks)
+      finishHasher(&fileHasher, blockDigests[numBlocks].hash);
+    if (hashedBlocks > hashed)
+      publishSegments(hashedBlocks == numBlocks ? numSegments : hashedBlocks * HASH_SEGMENTS);
+    pthread_mutex_unlock(&hashLock);
+  }
+  return NULL;
+}
+
+/*
+ * Starts hashing the file with the hasher threads, which make its segments
+ * available as they go. The digest of the file starts with its length, and
+ * an empty file has no blocks and is available at once.
+ */
+void startHashing(pthread_t *hashers) {
+  uint64_t length = htobe64(fileLength);
+
+  numBlocks = (numSegments - 1 + HASH_SEGMENTS - 1) / HASH_SEGMENTS;
+  blockDigests = calloc(numBlocks + 1, sizeof(Digest));
+  blocksHashed = calloc(numBlocks + 1, sizeof(bool));
+  if (blockDigests == NULL || blocksHashed == NULL) {
+    printf("Fatal Error allocating digests\n");
+    exit(3);
+  }
+  for (int block = 0; block <= numBlocks; block++) {
+    blockDigests[block].type = EXT_DIGEST;
+    blockDigests[block].length = HASH_SIZE;
+  }
+  initHasher(&fileHasher);
+  updateHasher(&fileHasher, &length, sizeof(length));
+  if (numBlocks == 0) {
+    finishHasher(&fileHasher, blockDigests[0].hash);
+    return;
+  }
+
+  availableSegments = 0;
+  for (int thread = 0; thread < hashThreads; thread++) {
+    if (pthread_create(&hashers[thread], NULL, hasherThread, NULL) != 0) {
+      printf("Fatal Error starting hasher thread %d\n", thread);
+      exit(1);
+    }
+  }
+}
+
+/*
+ * Sends the whole file to all servers, each through its own sliding window.
+ * Up to windowSize segments are outstanding to a server at once, and the
+ * group window slides forward as soon as every server has acknowledged its
+ * oldest segment.
+ */
+void sendFile() {
+  // segments 0..numDataSegments-1 carry the file, the last one is an empty EOF
+  numSegments = streaming ? STREAM_SEGMENTS : (int) ((fileLength + mss - 1) / mss + 1);
+  availableSegments = streaming ? 0 : numSegments;
+
+  // one arena holds the window of every server, each one contiguous
+  windowArena = calloc((size_t) numServers * windowSize, sizeof(Transmission));
+  groupWindowSize = windowSize + lagBound;
+  checksumRing = calloc(groupWindowSize, sizeof(uint64_t));
+  if (windowArena == NULL || checksumRing == NULL) {
+    printf("Fatal Error allocating send window\n");
+    exit(3);
+  }
+
+  // the servers in the group window are all sending blocks that start
+  // inside it, so its blocks and one more on either side fit in the ring
+  if (fecData > 0) {
+    parityRingSize = groupWindowSize / fecData + 2;
+    parityPacketSize = sizeof(Parity) + mss + FEC_SIZE_BYTES;
+    parityRing = calloc(parityRingSize, sizeof(ParityBlock));
+    if (parityRing == NULL) {
+      printf("Fatal Error allocating parity\n");
+      exit(3);
+    }
+    for (int entry = 0; entry < parityRingSize; entry++) {
+      parityRing[entry].block = -1;
+      parityRing[entry].packets = malloc((size_t) fecParity * parityPacketSize);
+      parityRing[entry].checksums = malloc(fecParity * sizeof(uint32_t));
+      if (parityRing[entry].packets == NULL || parityRing[entry].checksums == NULL) {
+        printf("Fatal Error allocating parity\n");
+        exit(3);
+      }
+    }
+  }
+  for (int serverNum = 0; serverNum < numServers; serverNum++)
+    servers[serverNum].window = windowArena + (size_t) serverNum * windowSize;
+
+  if (compressCodec != CODEC_NONE) {
+    compressRing = calloc(groupWindowSize, sizeof(CompressedSlot));
+    if (compressRing == NULL) {
+      printf("Fatal Error allocating compression buffer\n");
+      exit(3);
+    }
+    for (int slot = 0; slot < groupWindowSize; slot++) {
+      if ((compressRing[slot].packet = malloc(sizeof(Compressed) + mss)) == NULL) {
+        printf("Fatal Error allocating compression buffer\n");
+        exit(3);
+      }
+    }
+  }
+
+  // a hashed file is sent as its blocks are digested
+  pthread_t hashers[MAX_THREADS];
+  if (hashThreads > 0 && !streaming)
+    startHashing(hashers);
+
+  // a stream is read a window ahead of the group window, and its ring also
+  // holds the block the group window starts in
+  pthread_t reader;
+  if (streaming) {
+    streamRingSize = groupWindowSize + windowSize + fecData;
+    streamData = malloc((size_t) streamRingSize * mss);
+    streamSizes = calloc(streamRingSize, sizeof(int));
+    if (streamData == NULL || streamSizes == NULL) {
+      printf("Fatal Error allocating stream buffer\n");
+      exit(3);
+    }
+    if (pthread_create(&reader, NULL, readerThread, NULL) != 0) {
+      printf("Fatal Error starting reader thread\n");
+      exit(1);
+    }
+    // the reader may still be waiting on a stream no server is left for
+    pthread_detach(reader);
+  }
+
+  long long startTime = currentTimeUsec();
+  handshake();
+
+  pthread_t stats;
+  if (statsFile != NULL && pthread_create(&stats, NULL, statsThread, &startTime) != 0) {
+    printf("Fatal Error starting stats thread\n");
+    exit(1);
+  }
+
+  pthread_t threads[MAX_THREADS];
+  for (int thread = 0; thread < numThreads; thread++) {
+    if (pthread_create(&threads[thread], NULL, senderThread, (void *) (long) thread) != 0) {
+      printf("Fatal Error starting sender thread %d\n", thread);
+      exit(1);
+    }
+  }
+  for (int thread = 0; thread < numThreads; thread++)
+    pthread_join(threads[thread], NULL);
+  // the hashers have nothing left to do for servers that were all dropped
+  __atomic_store_n(&nextHashBlock, numBlocks, __ATOMIC_RELAXED);
+  for (int thread = 0; blockDigests != NULL && numBlocks > 0 && thread < hashThreads; thread++)
+    pthread_join(hashers[thread], NULL);
+
+  long long elapsed = currentTimeUsec() - startTime;
+  if (statsFile != NULL) {
+    pthread_mutex_lock(&statsLock);
+    statsDone = true;
+    pthread_cond_signal(&statsCond);
+    pthread_mutex_unlock(&statsLock);
+    pthread_join(stats, NULL);
+    writeStats(elapsed, true);
+  }
+
+  // the summary adds up the counters of every server
+  long long totalSent = 0;
+  long long totalRetransmitted = 0;
+  Histogram totalLatency;
+  memset(&totalLatency, '\0', sizeof(totalLatency));
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    totalSent += servers[serverNum].stats.packets;
+    totalRetransmitted += servers[serverNum].stats.retransmits;
+    mergeHistogram(&totalLatency, &servers[serverNum].stats.completion);
+  }
+
+  double seconds = elapsed / 1e6;
+  printf("Summary: %zu bytes in %.3f s, %.2f Mbit/s, %lld packets sent, %lld retransmitted (%.4f), "
+         "completion latency p50 %lld us p99 %lld us\n", fileLength, seconds,
+         seconds > 0 ? fileLength * 8 / seconds / 1e6 : 0, totalSent, totalRetransmitted,
+         totalSent > 0 ? (double) totalRetransmitted / totalSent : 0,
+         histogramQuantile(&totalLatency, 0.5), histogramQuantile(&totalLatency, 0.99));
+
+  for (int entry = 0; entry < parityRingSize; entry++) {
+    free(parityRing[entry].packets);
+    free(parityRing[entry].checksums);
+  }
+  free(parityRing);
+  for (int slot = 0; compressRing != NULL && slot < groupWindowSize; slot++)
+    free(compressRing[slot].packet);
+  free(compressRing);
+  free(windowArena);
+  free(checksumRing);
+  free(blockDigests);
+  free(blocksHashed);
+  // the stream ring is left to the reader, which may still be blocked reading
+}
+
+/*
+ * Returns the session ID of a resumable transfer of the file, an FNV-1a hash
+ * of its name, size, modification time and the MSS, so that a restarted
+ * client sending the same file the same way picks the same one. A batch
+ * gives the size of its image and the latest time any of its files changed.
+ * Whether the file is hashed is part of the way it is sent.
+ */
+uint32_t resumableSessionId(size_t size, time_t mtime) {
+  uint32_t hash = 2166136261u;
+  int64_t fields[4] = { (int64_t) size, mtime, mss, hashThreads > 0 };
+
+  for (const char *c = filename; *c != '\0'; c++)
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  for (size_t i = 0; i < sizeof(fields); i++)
+    hash = (hash ^ ((unsigned char *) fields)[i]) * 16777619u;
+  return hash;
+}
+
+/*
+ * Main method reads the file, calcultes the required number of segments
+ * to be sent, and sends those packets to all servers until entire file
+ * is sent to all servers.
+ */
+int main(int argc, char **argv) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:m:l:L:T:K:P:g:c:f:C:z:H:rFS:")) != -1) {
+    switch (opt) {
+      case 'w':
+        windowSize = atoi(optarg);
+        break;
+      case 'm':
+        arqMode = strcmp(optarg, "sr") == 0 ? SELECTIVE_REPEAT : strcmp(optarg, "gbn") == 0 ? GO_BACK_N : -1;
+        break;
+      case 'l':
+        lagBound = atoi(optarg);
+        break;
+      case 'L':
+        lagPolicy = strcmp(optarg, "drop") == 0 ? LAG_DROP : strcmp(optarg, "catchup") == 0 ? LAG_CATCHUP : -1;
+        break;
+      case 'T':
+        numThreads = atoi(optarg);
+        break;
+      case 'K': {
+        char *addrs = strchr(optarg, ':');
+        numPaths = atoi(optarg);
+        for (char *addr = addrs != NULL ? strtok(addrs + 1, ",") : NULL; addr != NULL; addr = strtok(NULL, ","))
+          if (numPathAddrs < MAX_PATHS)
+            pathAddrs[numPathAddrs++] = addr;
+        break;
+      }
+      case 'P':
+        treeFanout = atoi(optarg);
+        break;
+      case 'g':
+        groupName = optarg;
+        break;
+      case 'c':
+        dataChecksumType = checksumType(optarg);
+        break;
+      case 'z': {
+        char *speed = strchr(optarg, ':');
+        if (speed != NULL) {
+          *speed = '\0';
+          compressSpeed = atoi(speed + 1);
+        }
+        compressCodec = codecType(optarg);
+        break;
+      }
+      case 'C':
+        congestionControl = congestionType(optarg);
+        break;
+      case 'H':
+        hashThreads = atoi(optarg);
+        break;
+      case 'r':
+        resumable = true;
+        break;
+      case 'F':
+        listMode = true;
+        break;
+      case 'S':
+        if ((statsFile = openStatsFile(optarg, &statsIntervalUsec)) == NULL) {
+          printf("Fatal Error opening the stats file %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'f':
+        if (sscanf(optarg, "%d:%d", &fecData, &fecParity) != 2)
+          fecData = -1;
+        break;
+      default:
+        argc = 0;
+    }
+  }
+
+  if(argc - optind < 4 || arqMode < 0 || windowSize < 1 || windowSize > MAX_WINDOW || dataChecksumType < 0
+     || numThreads < 1 || numThreads > MAX_THREADS || numPaths < 1 || numPaths > MAX_PATHS
+     || treeFanout < 0 || treeFanout > MAX_CHILDREN || (treeFanout > 0 && groupName != NULL) || lagBound < 0 || lagBound > MAX_WINDOW
+     || lagPolicy < 0 || (lagPolicy != LAG_NONE && lagBound == 0) || fecData < 0 || congestionControl < 0
+     || compressCodec < 0 || compressSpeed < 1 || hashThreads < 0 || hashThreads > MAX_THREADS
+     || (fecData > 0 && (fecParity < 1 || fecData + fecParity > FEC_MAX_SYMBOLS))) {
+    printf("Usage %s [-w window] [-m gbn|sr] [-l lag] [-L drop|catchup] [-T threads] [-K paths[:address,...]] [-P fanout] [-g group] [-c inet|crc32c] [-f data:parity] [-C none|reno|bbr] [-z lz4[:speed]] [-H hashers] [-r] [-F] [-S path[:msec]] <server-i hostname> <server port> <filename> <MSS>\n", argv[0]);
+    exit(0);
+  }
+
+  // parse serverPort, filename and mss
+  serverPort = atoi(argv[argc - 3]);
+  filename = argv[argc - 2];
+  mss = atoi(argv[argc - 1]);
+
+  if (mss < 1 || mss > (fecData > 0 ? MAX_FEC_MSS : MAX_MSS)) {
+    printf("Fatal Error MSS must be between 1 and %d\n", fecData > 0 ? MAX_FEC_MSS : MAX_MSS);
+    exit(1);
+  }
+
+  // calculate num of severs from number of arguments
+  numServers = argc - optind - 3;
+
+  // a multicast packet serves every server and a relayed one the servers
+  // down the tree, so they all share one thread, and there is no use for
+  // more threads than servers
+  if (groupName != NULL || treeFanout > 0)
+    numThreads = 1;
+  if (numThreads > numServers)
+    numThreads = numServers;
+
+  servers = calloc(numServers, sizeof(Server));
+  if (servers == NULL) {
+    printf("Fatal Error allocating server list\n");
+    exit(3);
+  }
+
+  // open a datagram socket for every path of every sender thread, with
+  // buffers large enough to hold a window's worth of packets for all of its
+  // servers, bound to the next local address of the paths if any are given
+  int pathCount = 0;
+  for (int thread = 0; thread < numThreads; thread++) {
+    for (int path = 0; path < numPaths; path++) {
+      int bufferSize = SOCKET_BUFFER_SIZE;
+      int socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+      if (socketFd < 0) {
+        printf("Fatal Error opening the sockets\n");
+        exit(1);
+      }
+      setsockopt(socketFd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+      setsockopt(socketFd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+      // a kernel without UDP GSO does not know the option
+      int gsoSize;
+      socklen_t gsoLength = sizeof(gsoSize);
+      if (getsockopt(socketFd, SOL_UDP, UDP_SEGMENT, &gsoSize, &gsoLength) < 0)
+        segmentOffload = false;
+      if (numPathAddrs > 0) {
+        struct sockaddr_in localAddr;
+        memset(&localAddr, '\0', sizeof(struct sockaddr_in));
+        localAddr.sin_family = AF_INET;
+        localAddr.sin_addr.s_addr = inet_addr(pathAddrs[pathCount++ % numPathAddrs]);
+        if (bind(socketFd, (struct sockaddr *) &localAddr, sizeof(localAddr)) < 0) {
+          printf("Fatal Error binding a path to %s\n", inet_ntoa(localAddr.sin_addr));
+          exit(1);
+        }
+      }
+      threadSockets[thread][path] = socketFd;
+    }
+    threadWakeFds[thread] = eventfd(0, EFD_NONBLOCK);
+    if (threadWakeFds[thread] < 0) {
+      printf("Fatal Error opening the sockets\n");
+      exit(1);
+    }
+  }
+
+  // populate servers data structure
+  for (int serverNum = 0; serverNum <  numServers; serverNum++) {
+
+    servers[serverNum].rto = (long long) TIMEOUT_SEC * 1000000 + TIMEOUT_USEC;
+    // until a server answers the handshake, it is taken to support everything
+    servers[serverNum].receiveWindow = windowSize;
+    servers[serverNum].capabilities = CAP_FEC | CAP_RANGES;
+    initCongestion(&servers[serverNum].congestion, congestionControl, windowSize);
+    servers[serverNum].parent = treeFanout > 0 && serverNum >= treeFanout ? serverNum / treeFanout - 1 : -1;
+
+    memset(&servers[serverNum].serverAddr, '\0', sizeof(struct sockaddr_in));
+    servers[serverNum].serverAddr.sin_family = AF_INET;
+    servers[serverNum].serverAddr.sin_port = htons(serverPort);
+    servers[serverNum].serverAddr.sin_addr.s_addr = inet_addr(argv[optind + serverNum]);
+  }
+
+  buildServerTable();
+
+  // pick the session ID, falling back to the clock without an entropy source
+  if (getrandom(&sessionId, sizeof(sessionId), 0) != sizeof(sessionId))
+    sessionId = (uint32_t) currentTimeUsec() ^ (uint32_t) getpid();
+
+  if (groupName != NULL)
+    setupGroup();
+
+  int fd;
+  struct stat fileStat;
+  fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+  if(fd < 0 || fstat(fd, &fileStat) < 0) {
+    printf("Fatal Error opening the file: %s\n", filename);
+    exit(1);
+  }
+
+  // a directory or a list of files is sent as the image of a batch, and
+  // anything else but a regular file is read as a stream instead of mapped
+  time_t mtime = fileStat.st_mtime;
+  batching = listMode || S_ISDIR(fileStat.st_mode);
+  streaming = !batching && !S_ISREG(fileStat.st_mode);
+  streamFd = fd;
+  fileLength = streaming ? 0 : fileStat.st_size;
+  if (batching)
+    fileData = mapBatch(filename, listMode, &fileLength, &mtime);
+  if (streaming && lagPolicy == LAG_CATCHUP) {
+    printf("Fatal Error a stream cannot be replayed to a lagging server, use -L drop\n");
+    exit(1);
+  }
+  if (streaming && resumable) {
+    printf("Fatal Error a stream cannot be resumed\n");
+    exit(1);
+  }
+  if (streaming && hashThreads > 0) {
+    printf("Fatal Error a stream cannot be hashed\n");
+    exit(1);
+  }
+  // the segments and the EOF segment have to be numbered within MAX_SEGMENTS
+  if ((fileLength + mss - 1) / mss + 1 > MAX_SEGMENTS) {
+    printf("Fatal Error the file is too large for segments of %d bytes, use a larger MSS\n", mss);
+    exit(1);
+  }
+  if (resumable)
+    sessionId = resumableSessionId(fileLength, mtime);
+
+  // an empty file has nothing to map and is sent as just the EOF segment
+  if (!streaming && !batching && fileLength > 0) {
+    fileData = mmap(NULL, fileLength, PROT_READ, MAP_SHARED, fd, 0);
+    if (fileData == MAP_FAILED) {
+      printf("Fatal Error mapping the file: %s\n", filename);
+      exit(2);
+    }
+    madvise((void *) fileData, fileLength, MADV_SEQUENTIAL);
+  }
+
+  // send all segments to all servers with retries
+  sendFile();
+
+  // the transfer did not reach every server if any was dropped
+  int status = 0;
+  for (int serverNum = 0; serverNum < numServers; serverNum++) {
+    if (servers[serverNum].state == SERVER_DROPPED) {
+      printf("Server %s was dropped\n", inet_ntoa(servers[serverNum].serverAddr.sin_addr));
+      status = 4;
+    }
+  }
 
-    segmentNum++;
+  if (batching)
+    unmapBatch(fileData, fileLength);
+  else if (!streaming && fileLength > 0)
+    munmap((void *) fileData, fileLength);
+  close(fd);
+  for (int thread = 0; thread < numThreads; thread++) {
+    for (int path = 0; path < numPaths; path++)
+      close(threadSockets[thread][path]);
+    close(threadWakeFds[thread]);
   }
-  // Signal end of file by sending buffer of size 0
-  sendPacket(segmentNum, buffer, 0);
+  return status;
 }
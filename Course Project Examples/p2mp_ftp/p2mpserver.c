@@ -6,86 +6,341 @@
  * responds appropriately based on the results of the previously mentioned
  * actions.
  *
- * The server uses udp to send acknowledgements to the P2MP-FTP clients using
- * a stop-and-wait ARQ.
+ * Every transfer is a session named by the session ID a client puts in each
+ * header, with its own receive state and output file. By default the server
+ * takes a single session, writes it to the file given, and exits once it is
+ * complete. With -d it runs as a daemon instead, taking any number of
+ * concurrent sessions and writing each one to the file name with the
+ * session ID appended in hex. The socket and a timer for delayed acks and
+ * idle sessions are watched with epoll.
+ *
+ * A daemon started with -n runs that many workers, each a thread pinned to
+ * its own core with its own socket bound to the port with SO_REUSEPORT,
+ * its own sessions and its own writer thread. A BPF program attached to the
+ * sockets steers every packet to a worker by its session ID, so a session
+ * is only ever touched by one worker and the workers share no state.
+ *
+ * The server uses udp to send acknowledgements to the P2MP-FTP clients. Each
+ * ack is cumulative and carries a selective ack bitmap of the packets
+ * received beyond it, and echoes the timestamp of the latest data packet of
+ * its session so the client can time the round trip. A receive window
+ * larger than one buffers out-of-sequence packets, which the bitmap then
+ * reports so a selective repeat client only resends the holes, and writes
+ * them out as soon as the hole before them fills.
+ *
+ * Datagrams are drained from the socket in bursts with recvmmsg, and one ack
+ * describing the whole burst is sent with sendmmsg. Where the kernel supports
+ * UDP GRO it merges a run of datagrams of one flow into a single one on the
+ * way in, along with the size they were cut at, so a run from a client
+ * sending with GSO crosses the UDP stack once, and the burst loop cuts it
+ * back into its datagrams. With -a and -t acks are also delayed until that
+ * many packets have arrived or that many microseconds have passed, except
+ * that a packet out of sequence, a duplicate, or one that fills a hole is
+ * acked right away.
+ *
+ * Received data is written to the file by a separate writer thread with
+ * pwritev, so a slow disk never holds up the receive loop; with -p space
+ * for the file is also reserved ahead of the writes with fallocate. The
+ * segments a worker buffers, caches and hands to its writer live in buffers
+ * of a pool it recycles them through (see pool.h), so receiving allocates
+ * nothing once the windows and the write ring have filled.
+ *
+ * A transfer opens with the client's syn, which gives the file size and the
+ * MSS, and is answered with a syn ack listing what the server supports and
+ * how far it already is. From then on every segment of a file is written
+ * straight to its place in the file and tracked in a bitmap of the whole
+ * file, and a segment is only taken if it has the exact size its place in
+ * the file calls for. A stream, with no size known up front, is taken in
+ * sequence through the receive window instead.
+ *
+ * A packet from the middle of a transfer the server has not seen the start
+ * of, as when the server starts late, gets a join request sent back instead
+ * of an ack. The client's answer gives the file size and the MSS as a syn
+ * would, so the server keeps up with the live stream while the client
+ * resends the segments it missed.
+ *
+ * A client using forward error correction follows every block of segments
+ * with parity packets. Once a session has seen one, or a syn saying they
+ * will follow, it keeps a copy of the segments it receives, and as soon as
+ * it holds as many of a block's parity symbols as the block is missing
+ * segments, it rebuilds the missing ones and takes them as if they had
+ * arrived, without any retransmission.
+ *
+ * With -j every session keeps a journal next to its file, named after it with
+ * .journal appended, holding a bitmap of the segments written to the file.
+ * Every session then needs the size of the file, from its syn or by joining,
+ * and its journal is checkpointed once a second by the writer thread, after
+ * the data it describes has been synced, so it never claims a segment that a
+ * crash could lose. A session that finds a journal of its own resumes from
+ * it, and tells the client the ranges of segments it is still missing, so a
+ * restarted server or client only transfers what never made it to disk. The
+ * journal is removed once the file is complete.
+ *
+ * A session whose syn names children passes every data and parity packet
+ * it takes for the first time on to each of them, from one copy with one
+ * sendmmsg per burst, and keeps the data packets it relayed in a ring so
+ * that it can answer the client's requests to repair a child itself. Such
+ * a session lingers once complete, so its children can still be repaired,
+ * before a server outside of daemon mode exits.
+ *
+ * A session whose syn or join answer is flagged FLAG_HASHED verifies its
+ * file block by block as it is written. Once it holds every segment of a
+ * block and the block's digest, it has the writer thread read the block
+ * back from the file and hash it behind the writes, so what is checked is
+ * what is on disk. A block that does not match is dropped from the bitmap
+ * and fetched again, and the EOF segment is only taken, and the file only
+ * complete, once every block matches and so does the digest of the file.
+ * A journal keeps the digests of the blocks verified so far, and a session
+ * resuming from it fetches every other block again.
+ *
+ * A session whose syn or join answer is flagged FLAG_BATCH carries the
+ * image of a batch of files (see batch.h). Once all of it is on disk, the
+ * writer thread unpacks it into a directory named like the file would have
+ * been, and removes the image.
+ *
+ * Compressed data packets are decompressed as soon as their checksum is
+ * verified, and every ack lists the codecs the server can decompress, so a
+ * client only compresses once it knows the server can take it.
+ *
+ * Packets are dropped with the packet loss probability given to simulate a
+ * lossy path, and with -D and -R they are also delayed and reordered (see
+ * emulator.h). The emulator of every worker is seeded from the clock, or
+ * from the seed given with -s so that a run can be repeated.
+ *
+ * With -S every worker writes its counters to the path given, or stderr for
+ * -, as a line of JSON every second or every msec milliseconds given: the
+ * datagrams and bytes received, checksum failures, emulated losses,
+ * retransmissions the client flagged, duplicates, acks sent, segments
+ * rebuilt from parity, packets relayed and repaired, blocks verified and
+ * found corrupt, the time the receive loop spent blocked on a full
+ * write ring and the bytes of its segment pool, plus a last line marked
+ * final when it stops. Messages about single packets are rate limited, so a
+ * burst of losses cannot slow the receive loop down by printing.
+ *
+ * The server binds the address of its network interface, or the one given
+ * with -b.
+ *
+ * With -g the server also joins an IP multicast group so that it receives
+ * the packets a multicast client sends once to the whole group. Acks are
+ * always sent back to the client over unicast, from the server's address
+ * even though the group takes a socket bound to any address, since the
+ * client tells its servers apart by the address their acks come from.
  *
  * Run as:
- * ./p2mpserver <port> <filename> <packet loss probability>
+ * ./p2mpserver [-w window] [-a packets] [-t usec] [-p] [-j] [-d] [-n workers] [-b address] [-g group] [-s seed] [-D usec[:jitter]] [-R prob[:usec]] [-S path[:msec]] <port> <filename> <packet loss probability>
  *
  * Author: Aasiyah Feisal (anfeisal)
  */
 
-#define _BSD_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <netdb.h>
+#include <limits.h>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-#define DATA_PKT 0b0101010101010101
-#define ACK_PKT  0b1010101010101010
-#define MAX_MSS 1024
-#define INVALID_SEQ_NO -1
+#include "checksum.h"
+#include "compress.h"
+#include "emulator.h"
+#include "fec.h"
+#include "p2mp.h"
+#include "pool.h"
+#include "stats.h"
+#include "writer.h"
 
-/*
- * Header structure which contains a 32-bit sequence number, a 16-bit
- * checksum of the data part being received, and a 16-bit field which
- * determines the type of the packet sent (data packet vs. ack packet)
- */
-typedef struct header_t {
-  int32_t seqNum;
-  int16_t checksum;
-  int16_t type;
-} Header;
+#define RECV_BATCH 32
+#define WRITE_RING 1024
+#define SESSION_BUCKETS 4096
+#define SESSION_TIMEOUT_USEC 30000000
+#define SESSION_LINGER_USEC 2000000
+#define SWEEP_USEC 1000000
+#define MAX_WORKERS 64
+#define FEC_PENDING 16
+#define RANGES_USEC 50000
+#define REORDER_GAP_USEC 1000
+#define JOURNAL_MAGIC 0x4A50324D
+#define STATS_INTERVAL_USEC 1000000
+#define RELAY_BATCH (RECV_BATCH * MAX_CHILDREN)
+#define MIN_RELAY_CACHE 64
+#define BLOCK_OPEN 0
+#define BLOCK_VERIFYING 1
+#define BLOCK_VERIFIED 2
 
 /*
  * Packet structure which contains header information and a buffer
- * array that holds data to be sent to server
+ * array that holds data to be sent to server, allocated large enough for
+ * the biggest datagram UDP can carry since the client picks the MSS
  */
 typedef struct packet_t {
   Header hdr;
-  char data[MAX_MSS];
+  char data[];
 } Packet;
 
-/* Acknowledgement structure which contains header information. */
-typedef struct ack_t {
-  Header hdr;
-} Ack;
+/*
+ * Slot structure for one entry of the receive window, which holds a copy
+ * of an out-of-sequence packet's data, in a buffer of the worker's pool,
+ * until every packet before it has been received.
+ */
+typedef struct slot_t {
+  bool filled;
+  int size;
+  char *data;
+} Slot;
 
 /*
- * Calculates the checksum for the packet being received
+ * Cached structure holding a copy of a segment a session using forward
+ * error correction has received, so the other segments of its block can be
+ * rebuilt from it, or of a data packet a session relayed, so it can be
+ * resent to a child that lost it. A seqNum of INVALID_SEQ_NO marks an empty
+ * entry.
  */
-int16_t calculateChecksum(char *buffer, int bufferSize) {
-  int16_t sum = 0;
-  int16_t word16;
+typedef struct cached_t {
+  int seqNum;
+  int size;
+  char *data;
+} Cached;
 
-  // make 16 bit words out of every two adjacent 8 bit words and
-  // calculate the sum of all 16 bit words
-  for (int i = 0; i < bufferSize - 1; i = i + 2) {
-    word16 = ((buffer[i] << 8) & 0xFF00) + (buffer[i+1] & 0xFF);
-    sum = sum + word16;
-  }
+/*
+ * FecBlock structure for a block of segments a session has received parity
+ * symbols for, which are kept until every segment of the block has been
+ * received or rebuilt. A block without parity is unused.
+ */
+typedef struct fec_block_t {
+  int blockStart;
+  int numData;
+  int numParity;
+  int symbolSize;
+  unsigned char *parity;
+  bool present[FEC_MAX_SYMBOLS];
+} FecBlock;
 
-  // if bufferSize is odd, add the last byte after shifting 8 bits
-  if ((bufferSize % 2) != 0) {
-    word16 = ((buffer[bufferSize - 1] << 8) & 0xFF00);
-    sum = sum + word16;
-  }
+/*
+ * Journal structure at the start of a session's progress journal, followed
+ * by the bitmap of the segments that are safely in the file, and for a
+ * hashed session by a Digest per block, of type 0 for a block that was not
+ * verified. It names the session and the layout of its file, so a restarted
+ * server can tell whether a journal belongs to a transfer it hears of, and
+ * whether the file is the image of a batch, FLAG_BATCH, or hashed,
+ * FLAG_HASHED.
+ */
+typedef struct journal_t {
+  uint32_t magic;
+  uint32_t sessionId;
+  uint64_t fileLength;
+  int32_t segmentSize;
+  int32_t numSegments;
+  uint32_t flags;
+  uint32_t reserved;
+} Journal;
 
-  // Take the one's complement of sum
-  sum = ~sum;
+/*
+ * Session structure for one transfer from a client. A session opened by its
+ * client's syn knows the layout of the file from the start, and one that
+ * joined late is waiting for the client's answer to its join request; once it
+ * has either, a session of a file tracks which of the numSegments segments it
+ * has received in a bitmap instead of the receive window. A session using
+ * forward error correction also keeps a ring of the last segments it received
+ * and the blocks it has parity for, and a session with a journal whether its
+ * bitmap has changed since the last checkpoint and whether its client should
+ * be told the ranges it is missing. The timestamp of the latest data packet
+ * is kept to be echoed in the next ack, and a session whose file is the image
+ * of a batch is unpacked once complete. A session its syn gave children
+ * relays to them, and keeps a ring of the data packets it relayed to answer
+ * their repairs. A hashed session keeps the digest of every block and whether
+ * the block is open, being verified or verified, and the digest of the file;
+ * a digest of type 0 is not known yet. Besides the receive state, a session
+ * is linked into a chain of the session table, the list of sessions waiting
+ * for a delayed ack, and the list of sessions that received packets in the
+ * current burst.
+ */
+typedef struct session_t {
+  uint32_t sessionId;
+  struct sockaddr_in clientAddr;
+  bool synced;
+  int expectedSeqNum;
+  off_t fileOffset;
+  Slot *window;
+  bool joining;
+  int numSegments;
+  int segmentSize;
+  uint64_t *received;
+  uint64_t fileLength;
+  Cached *fecCache;
+  FecBlock *fecBlocks;
+  int fileFd;
+  char *filePath;
+  bool batch;
+  bool hashed;
+  int numBlocks;
+  Digest *digests;
+  uint8_t *blockStates;
+  int blocksVerified;
+  Digest fileDigest;
+  bool verified;
+  struct sockaddr_in children[MAX_CHILDREN];
+  int numChildren;
+  Cached *relayCache;
+  int relayCacheSize;
+  int journalFd;
+  char *journalPath;
+  bool journalDirty;
+  bool rangesNow;
+  long long lastRanges;
+  bool done;
+  long long lastActivity;
+  uint64_t echo;
+  int unackedPackets;
+  long long firstUnackedTime;
+  bool ackNow;
+  bool delayed;
+  bool touched;
+  struct session_t *nextInBucket;
+  struct session_t *prevDelayed;
+  struct session_t *nextDelayed;
+  struct session_t *nextTouched;
+} Session;
 
-  return sum;
-}
+/*
+ * WorkerStats structure for the counters of one worker: the datagrams and
+ * bytes it received, those dropped for a bad checksum or by the emulated
+ * path, the segments the client flagged as resent, the segments it already
+ * had, the acks it sent, the segments it rebuilt from parity, the
+ * packets it relayed to children and resent to them on repair requests, and
+ * the blocks it verified and found corrupt. Only the worker writes them.
+ */
+typedef struct worker_stats_t {
+  uint64_t datagrams;
+  uint64_t bytes;
+  uint64_t checksumFailures;
+  uint64_t losses;
+  uint64_t retransmits;
+  uint64_t duplicates;
+  uint64_t acks;
+  uint64_t rebuilt;
+  uint64_t relayed;
+  uint64_t repairs;
+  uint64_t verified;
+  uint64_t corrupt;
+} WorkerStats;
 
 /**
  * getIPv4()
@@ -130,116 +385,1849 @@ int getIPv4(char * ipv4) {
     return 0;
 }
 
+/* Receive window size supplied through -w */
+int windowSize = 1;
+/* Number of packets and microseconds an ack may be delayed, from -a and -t */
+int ackEvery = 1;
+long long ackDelayUsec = 0;
+/* Whether to keep taking sessions, from -d */
+bool daemonMode = false;
+/* Output file name, or the prefix of each session's in daemon mode */
+char *outputName;
+/* Probability that a packet is dropped to simulate loss */
+double packetLossProb;
+/* Delay and jitter of the emulated path, from -D, and the probability that
+ * a packet is held back the reorder gap on top, from -R */
+long long pathDelayUsec = 0;
+long long pathJitterUsec = 0;
+double reorderProb = 0;
+long long reorderGapUsec = REORDER_GAP_USEC;
+/* Seed of the emulators, from -s or the clock */
+uint64_t emulatorSeed;
+/* Whether to reserve space for the files ahead of the writes, from -p */
+bool preallocate = false;
+/* Whether every session keeps a progress journal, from -j */
+bool journaling = false;
+/* Segments a session using forward error correction keeps copies of */
+int fecCacheSize;
+/* Stream the statistics are exported to as JSON lines and how often, from -S */
+FILE *statsFile = NULL;
+long long statsIntervalUsec = STATS_INTERVAL_USEC;
+/* Number of workers, from -n, and the socket each one receives on */
+int numWorkers = 1;
+int workerSockets[MAX_WORKERS];
+/* Control message naming the address everything is sent from, or of length
+ * 0 to leave it to the kernel. A socket receiving a multicast group is bound
+ * to the wildcard address, and without it the kernel would pick a source by
+ * route, which need not be the address the client knows the server by. */
+union { char buf[CMSG_SPACE(sizeof(struct in_pktinfo))]; struct cmsghdr align; } sourceControl;
+size_t sourceControlLength = 0;
+
 /*
- * Main method listens on the designated port specified by the command line
- * arguments, and receives data from the client on this port.
- *
- * When it receives a data packet, it computes the checksum and checks whether
- * it is in-sequence, and if so, it sends an ACK segment (using UDP) to the
- * client; it then writes the received data into a file whose name is provided
- * in the command line. If the packet received is out-ofsequence, an ACK for
- * the last received in-sequence packet is sent; if the checksum is incorrect,
- * the receiver does nothing.
+ * Everything below is owned by one worker, so each worker thread has its
+ * own copy
  */
-int main(int argc, char **argv) {
 
-  if(argc != 4) {
-    printf("Usage %s <port> <filename> <packet loss probability>\n", argv[0]);
-    exit(0);
+/* Socket the worker's sessions are received on */
+__thread int sockfd;
+/* Index of the worker, which the BPF program steers its sessions to */
+__thread int workerNum;
+/* Writer thread shared by every session of the worker */
+__thread Writer *writer;
+/* Buffers for the segments the worker's sessions keep and write */
+__thread Pool *pool;
+/* Emulated path every datagram the worker receives goes through */
+__thread Emulator *emulator;
+/* Counters of the worker, exported with -S, since it started */
+__thread WorkerStats stats;
+__thread long long statsStart;
+/* Set once the only session has completed outside of daemon mode */
+__thread bool finished = false;
+
+/* Segment of the last compressed data packet, once decompressed */
+__thread char inflated[MAX_UDP_PAYLOAD];
+
+/* Sessions chained in buckets by session ID */
+__thread Session *sessionTable[SESSION_BUCKETS];
+__thread int numSessions;
+/* Sessions waiting for a delayed ack, oldest first */
+__thread Session *delayedHead;
+__thread Session *delayedTail;
+/* Sessions that received packets in the current burst */
+__thread Session *touchedHead;
+
+/* Acks queued for the next sendmmsg, with the timestamps they echo */
+__thread Ack ackQueue[RECV_BATCH];
+__thread Timestamp ackEchoes[RECV_BATCH];
+__thread struct sockaddr_in ackAddrs[RECV_BATCH];
+__thread struct iovec ackIov[RECV_BATCH][2];
+__thread struct mmsghdr ackMsgs[RECV_BATCH];
+__thread int ackQueueLength;
+
+/* Packets relayed to the children of sessions, queued for the next
+ * sendmmsg, and the buffers to give back after it: parity packets, which
+ * are only queued, and the packets the relay rings dropped meanwhile */
+__thread struct sockaddr_in relayAddrs[RELAY_BATCH];
+__thread struct iovec relayIov[RELAY_BATCH];
+__thread struct mmsghdr relayMsgs[RELAY_BATCH];
+__thread int relayQueueLength;
+__thread char *relayRetired[RELAY_BATCH];
+__thread int relayRetiredLength;
+
+/*
+ * Returns the current time of the monotonic clock in microseconds
+ */
+long long currentTimeUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns the worker the given session is steered to. This matches the BPF
+ * program, which loads the session ID from the packet in network byte order,
+ * as it is sent.
+ */
+int sessionWorker(uint32_t sessionId) {
+  return sessionId % numWorkers;
+}
+
+/*
+ * Returns the bucket of the session table for the given session ID
+ */
+Session **sessionBucket(uint32_t sessionId) {
+  return &sessionTable[(sessionId * 2654435761u) % SESSION_BUCKETS];
+}
+
+/*
+ * Returns the session with the given ID, or NULL if there is none
+ */
+Session *findSession(uint32_t sessionId) {
+  Session *session = *sessionBucket(sessionId);
+  while (session != NULL && session->sessionId != sessionId)
+    session = session->nextInBucket;
+  return session;
+}
+
+/*
+ * Returns the segment after the last one of a block of a hashed session,
+ * the EOF segment for its last block
+ */
+int blockEnd(Session *session, int block) {
+  int end = (block + 1) * HASH_SEGMENTS;
+  return end < session->numSegments - 1 ? end : session->numSegments - 1;
+}
+
+/*
+ * Starts verifying the blocks of a session laid out in its bitmap, whose
+ * client hashes them
+ */
+void enableVerify(Session *session) {
+  session->hashed = true;
+  session->numBlocks = (session->numSegments - 1 + HASH_SEGMENTS - 1) / HASH_SEGMENTS;
+  session->digests = calloc(session->numBlocks + 1, sizeof(Digest));
+  session->blockStates = calloc(session->numBlocks + 1, sizeof(uint8_t));
+  if (session->digests == NULL || session->blockStates == NULL) {
+    printf("Fatal Error allocating a session\n");
+    exit(1);
   }
+}
 
-  int port = atoi(argv[1]);
-  char *filename = argv[2];
+/*
+ * Reads the digests of the blocks a hashed session had verified from its
+ * journal, at offset, and drops every other block from its bitmap, since
+ * the digests of those are gone. Returns whether it could.
+ */
+bool readDigests(Session *session, int journalFd, off_t offset) {
+  enableVerify(session);
+  size_t size = (size_t) session->numBlocks * sizeof(Digest);
+  if (pread(journalFd, session->digests, size, offset) != (ssize_t) size) {
+    free(session->digests);
+    free(session->blockStates);
+    session->digests = NULL;
+    session->blockStates = NULL;
+    session->hashed = false;
+    return false;
+  }
 
-  // Generate random probability loss number
-  double packetLossProb;
-  sscanf(argv[3], "%lf", &packetLossProb);
-  srand(time(NULL)); // clear seed
+  for (int block = 0; block < session->numBlocks; block++) {
+    Digest *digest = &session->digests[block];
+    if (digest->type == EXT_DIGEST && digest->length == HASH_SIZE) {
+      session->blockStates[block] = BLOCK_VERIFIED;
+      session->blocksVerified++;
+      continue;
+    }
+    memset(digest, '\0', sizeof(Digest));
+    for (int seqNum = block * HASH_SEGMENTS; seqNum < blockEnd(session, block); seqNum++)
+      session->received[seqNum / 64] &= ~((uint64_t) 1 << (seqNum % 64));
+  }
+  return true;
+}
 
-  int sockfd;
-  struct sockaddr_in serverAddr, clientAddr;
-  char buffer[MAX_MSS];
-  int bufferSize =  0;
-  socklen_t clientAddrSize;
+/*
+ * Reads a journal and the bitmap after it into a session, if the journal
+ * belongs to the session and describes a file it can hold, and the digests
+ * after that of a hashed session. Returns whether it did.
+ */
+bool readJournal(Session *session, int journalFd) {
+  Journal journal;
 
-  int expectedSeqNum = 0;
-  int lastSeqNum = INVALID_SEQ_NO;
-  int16_t checksum;
-  Packet dataPacket;
-  Ack ackPacket;
-  char hostbuffer[100];
+  if (pread(journalFd, &journal, sizeof(journal), 0) != sizeof(journal) || journal.magic != JOURNAL_MAGIC
+      || journal.sessionId != session->sessionId || journal.segmentSize <= 0 || journal.segmentSize > MAX_UDP_PAYLOAD
+      || (journal.fileLength + journal.segmentSize - 1) / journal.segmentSize + 1 > MAX_SEGMENTS
+      || journal.numSegments != (int) ((journal.fileLength + journal.segmentSize - 1) / journal.segmentSize + 1))
+    return false;
 
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  size_t bitmapSize = (journal.numSegments + 63) / 64 * sizeof(uint64_t);
+  session->received = malloc(bitmapSize);
+  if (session->received == NULL) {
+    printf("Fatal Error allocating a session\n");
+    exit(1);
+  }
+  if (pread(journalFd, session->received, bitmapSize, sizeof(journal)) != (ssize_t) bitmapSize) {
+    free(session->received);
+    session->received = NULL;
+    return false;
+  }
+  session->fileLength = journal.fileLength;
+  session->segmentSize = journal.segmentSize;
+  session->numSegments = journal.numSegments;
+  session->batch = journal.flags & FLAG_BATCH;
+  if ((journal.flags & FLAG_HASHED) && !readDigests(session, journalFd, sizeof(journal) + bitmapSize)) {
+    free(session->received);
+    session->received = NULL;
+    return false;
+  }
+  return true;
+}
 
-  memset(&serverAddr, '\0', sizeof(serverAddr));
+/*
+ * Queues a checkpoint of a session's bitmap to its journal, along with the
+ * digests of the blocks it has verified, which the writer thread writes
+ * once the segments the bitmap has so far are synced
+ */
+void checkpointJournal(Session *session) {
+  size_t bitmapSize = (session->numSegments + 63) / 64 * sizeof(uint64_t);
+  size_t digestsSize = session->hashed ? (size_t) session->numBlocks * sizeof(Digest) : 0;
+  char *snapshot = malloc(sizeof(Journal) + bitmapSize + digestsSize);
+  if (snapshot == NULL) {
+    printf("Fatal Error allocating a journal checkpoint\n");
+    exit(1);
+  }
 
-  char ipAddr[16];
-  if(getIPv4(ipAddr) != 0) {
-    printf("Fata Error no IP address found\n");
+  Journal *journal = (Journal *) snapshot;
+  journal->magic = JOURNAL_MAGIC;
+  journal->sessionId = session->sessionId;
+  journal->fileLength = session->fileLength;
+  journal->segmentSize = session->segmentSize;
+  journal->numSegments = session->numSegments;
+  journal->flags = (session->batch ? FLAG_BATCH : 0) | (session->hashed ? FLAG_HASHED : 0);
+  journal->reserved = 0;
+  memcpy(journal + 1, session->received, bitmapSize);
+  Digest *digests = (Digest *) (snapshot + sizeof(Journal) + bitmapSize);
+  for (int block = 0; block < session->numBlocks && session->hashed; block++) {
+    if (session->blockStates[block] == BLOCK_VERIFIED)
+      digests[block] = session->digests[block];
+    else
+      memset(&digests[block], '\0', sizeof(Digest));
+  }
+  queueCheckpoint(writer, session->fileFd, session->journalFd, snapshot, sizeof(Journal) + bitmapSize + digestsSize);
+  session->journalDirty = false;
+}
+
+/*
+ * Opens a new session and its output file. Returns NULL if the session
+ * cannot be taken: outside of daemon mode once there is a session already,
+ * and in daemon mode if its file exists, so that a stray packet of an old
+ * session never overwrites the file it completed. A file with a journal
+ * next to it was never completed though: the session resumes it if the
+ * journal is its own, and starts it over otherwise.
+ */
+Session *openSession(uint32_t sessionId) {
+  char sessionFile[PATH_MAX];
+  char journalFile[PATH_MAX + sizeof(".journal")];
+  int flags = O_RDWR | O_CREAT | O_TRUNC;
+  int journalFd = -1;
+
+  if (!daemonMode && numSessions > 0)
+    return NULL;
+
+  if (daemonMode) {
+    snprintf(sessionFile, sizeof(sessionFile), "%s.%08x", outputName, sessionId);
+    flags = O_RDWR | O_CREAT | O_EXCL;
+  } else {
+    snprintf(sessionFile, sizeof(sessionFile), "%s", outputName);
+  }
+
+  Session *session = calloc(1, sizeof(Session));
+  if (session == NULL || (session->window = calloc(windowSize, sizeof(Slot))) == NULL) {
+    printf("Fatal Error allocating a session\n");
     exit(1);
   }
-  printf("Server ip address: %s\n", ipAddr);
+  session->sessionId = sessionId;
 
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_addr.s_addr = inet_addr(ipAddr);
-  serverAddr.sin_port = htons(port);
+  if (journaling) {
+    snprintf(journalFile, sizeof(journalFile), "%s.journal", sessionFile);
+    if ((journalFd = open(journalFile, O_RDWR)) >= 0)
+      flags = readJournal(session, journalFd) ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC;
+  }
 
-  FILE* file;
-  if((file = fopen(filename, "wb")) == NULL) {
-    printf("Fatal Error opening the file: %s\n", filename);
+  int fileFd = open(sessionFile, flags, 0644);
+  if (fileFd < 0 && session->received != NULL) {
+    // the journal outlived its file, so there is nothing to resume
+    free(session->received);
+    free(session->digests);
+    free(session->blockStates);
+    session->received = NULL;
+    session->digests = NULL;
+    session->blockStates = NULL;
+    session->hashed = false;
+    session->blocksVerified = 0;
+    fileFd = open(sessionFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  }
+  if (fileFd >= 0 && journaling && session->received == NULL) {
+    if (journalFd < 0)
+      journalFd = open(journalFile, O_RDWR | O_CREAT, 0644);
+    else if (ftruncate(journalFd, 0) < 0)
+      printf("Fatal Error clearing %s\n", journalFile);
+  }
+  if (fileFd < 0 || (journaling && journalFd < 0)) {
+    if (!daemonMode) {
+      printf("Fatal Error opening the file: %s\n", sessionFile);
+      exit(1);
+    }
+    printf("Ignoring session %08x, cannot create %s\n", sessionId, sessionFile);
+    if (fileFd >= 0)
+      close(fileFd);
+    if (journalFd >= 0)
+      close(journalFd);
+    free(session->received);
+    free(session->digests);
+    free(session->blockStates);
+    free(session->window);
+    free(session);
+    return NULL;
+  }
+  session->fileFd = fileFd;
+  session->journalFd = journalFd;
+  if ((session->filePath = strdup(sessionFile)) == NULL
+      || (journaling && (session->journalPath = strdup(journalFile)) == NULL)) {
+    printf("Fatal Error allocating a session\n");
     exit(1);
   }
 
-  bind(sockfd, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-  clientAddrSize = sizeof(clientAddr);
+  if (session->received != NULL) {
+    // anything past the end of the file is preallocated space, not data
+    if (ftruncate(fileFd, session->fileLength) < 0)
+      printf("Fatal Error trimming %s\n", sessionFile);
+    int seqNum = 0;
+    while (seqNum < session->numSegments && (session->received[seqNum / 64] >> (seqNum % 64) & 1))
+      seqNum++;
+    session->expectedSeqNum = seqNum;
+    session->done = seqNum == session->numSegments;
+    finished = session->done && !daemonMode;
+    session->rangesNow = true;
+    printf("Session %08x resumed at sequence number = %d, writing %s\n", sessionId, session->expectedSeqNum, sessionFile);
+  } else {
+    printf("Session %08x started, writing %s\n", sessionId, sessionFile);
+  }
+
+  Session **bucket = sessionBucket(sessionId);
+  session->nextInBucket = *bucket;
+  *bucket = session;
+  numSessions++;
+  return session;
+}
 
-  while (1) {
-    int f_recv_size = recvfrom(sockfd, &dataPacket, sizeof(Packet), 0, (struct sockaddr*)&clientAddr, &clientAddrSize);
-    if((f_recv_size > 0) && (dataPacket.hdr.type == DATA_PKT)) {
-      bufferSize =  f_recv_size - sizeof(Header);
+/*
+ * Takes a session off the list of sessions waiting for a delayed ack
+ */
+void cancelDelayedAck(Session *session) {
+  if (!session->delayed)
+    return;
+  if (session->prevDelayed != NULL)
+    session->prevDelayed->nextDelayed = session->nextDelayed;
+  else
+    delayedHead = session->nextDelayed;
+  if (session->nextDelayed != NULL)
+    session->nextDelayed->prevDelayed = session->prevDelayed;
+  else
+    delayedTail = session->prevDelayed;
+  session->delayed = false;
+}
 
-      // verify checksum
-      if ((checksum = calculateChecksum(dataPacket.data, bufferSize)) != dataPacket.hdr.checksum) {
+/*
+ * Has a message leave from the server's own address when one is set, see
+ * sourceControl
+ */
+void setSource(struct msghdr *msg) {
+  if (sourceControlLength > 0) {
+    msg->msg_control = sourceControl.buf;
+    msg->msg_controllen = sourceControlLength;
+  }
+}
+
+/*
+ * Sends a single packet to an address from the worker's socket
+ */
+void sendPacket(const void *packet, size_t size, struct sockaddr_in *addr) {
+  struct iovec iov = { .iov_base = (void *) packet, .iov_len = size };
+  struct msghdr msg;
+
+  memset(&msg, '\0', sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  setSource(&msg);
+  sendmsg(sockfd, &msg, 0);
+}
+
+/*
+ * Sends every queued relayed packet with one sendmmsg, and gives back the
+ * buffers no longer needed once they are sent
+ */
+void flushRelays() {
+  int sent = 0;
+
+  while (sent < relayQueueLength) {
+    int n = sendmmsg(sockfd, relayMsgs + sent, relayQueueLength - sent, 0);
+    sent += n > 0 ? n : 1;
+  }
+  for (int i = 0; i < relayRetiredLength; i++)
+    returnBuffer(relayRetired[i]);
+  relayQueueLength = 0;
+  relayRetiredLength = 0;
+}
+
+/*
+ * Queues a packet to a child
+ */
+void queueRelay(struct sockaddr_in *child, char *packet, int size) {
+  if (relayQueueLength == RELAY_BATCH)
+    flushRelays();
+
+  int entry = relayQueueLength++;
+  relayAddrs[entry] = *child;
+  relayIov[entry].iov_base = packet;
+  relayIov[entry].iov_len = size;
+  memset(&relayMsgs[entry].msg_hdr, '\0', sizeof(struct msghdr));
+  relayMsgs[entry].msg_hdr.msg_name = &relayAddrs[entry];
+  relayMsgs[entry].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  relayMsgs[entry].msg_hdr.msg_iov = &relayIov[entry];
+  relayMsgs[entry].msg_hdr.msg_iovlen = 1;
+  setSource(&relayMsgs[entry].msg_hdr);
+}
+
+/*
+ * Passes a packet the session takes for the first time on to all of its
+ * children, flagged as relayed, from one copy. A data packet is kept in the
+ * relay ring in place of the oldest one, which may still be queued and is
+ * only given back once the queue is sent, and a parity packet is given
+ * back as soon as it is.
+ */
+void relayPacket(Session *session, int seqNum, Packet *packet, int size, uint16_t type) {
+  if (relayQueueLength + session->numChildren > RELAY_BATCH)
+    flushRelays();
+
+  char *copy = takeBuffer(pool, size);
+  memcpy(copy, packet, size);
+  ((Header *) copy)->flags |= FLAG_RELAYED;
+
+  char *retired = copy;
+  if (type != FEC_PKT) {
+    Cached *cached = &session->relayCache[seqNum % session->relayCacheSize];
+    retired = cached->data;
+    cached->seqNum = seqNum;
+    cached->size = size;
+    cached->data = copy;
+  }
+  if (retired != NULL)
+    relayRetired[relayRetiredLength++] = retired;
+  for (int i = 0; i < session->numChildren; i++)
+    queueRelay(&session->children[i], copy, size);
+  countStat(&stats.relayed, session->numChildren);
+}
+
+/*
+ * Answers a repair request by resending the segment to the child it names,
+ * if the session still holds its copy. Children the session was not given
+ * are never sent anything.
+ */
+void repairChild(Session *session, int64_t seqNum, Peer *peer) {
+  for (int i = 0; i < session->numChildren; i++) {
+    struct sockaddr_in *child = &session->children[i];
+    if (child->sin_addr.s_addr != peer->address || child->sin_port != peer->port)
+      continue;
+    Cached *cached = seqNum >= 0 ? &session->relayCache[seqNum % session->relayCacheSize] : NULL;
+    if (cached == NULL || cached->seqNum != seqNum || cached->data == NULL)
+      return;
+    queueRelay(child, cached->data, cached->size);
+    countStat(&stats.repairs, 1);
+    session->lastActivity = currentTimeUsec();
+    return;
+  }
+}
+
+/*
+ * Closes a session, discarding any out-of-sequence packets it still holds.
+ * Its file is closed by the writer thread once its data is written, and its
+ * journal, checkpointed one last time, is removed along with it if the file
+ * is complete and kept to resume from otherwise.
+ */
+void closeSession(Session *session) {
+  Session **link = sessionBucket(session->sessionId);
+  while (*link != session)
+    link = &(*link)->nextInBucket;
+  *link = session->nextInBucket;
+  numSessions--;
+
+  cancelDelayedAck(session);
+  for (int i = 0; i < windowSize; i++) {
+    if (session->window[i].filled)
+      returnBuffer(session->window[i].data);
+  }
+  if (session->journalDirty)
+    checkpointJournal(session);
+  if (session->batch && session->done) {
+    queueUnpack(writer, session->fileFd, session->filePath);
+  } else {
+    queueClose(writer, session->fileFd);
+    free(session->filePath);
+  }
+  if (session->journalFd >= 0 && session->done) {
+    queueRemove(writer, session->journalFd, session->journalPath);
+  } else {
+    if (session->journalFd >= 0)
+      queueClose(writer, session->journalFd);
+    free(session->journalPath);
+  }
+
+  if (session->fecCache != NULL) {
+    for (int i = 0; i < fecCacheSize; i++) {
+      if (session->fecCache[i].data != NULL)
+        returnBuffer(session->fecCache[i].data);
+    }
+    for (int i = 0; i < FEC_PENDING; i++)
+      free(session->fecBlocks[i].parity);
+  }
+
+  if (session->relayCache != NULL) {
+    for (int i = 0; i < session->relayCacheSize; i++) {
+      if (session->relayCache[i].data != NULL)
+        returnBuffer(session->relayCache[i].data);
+    }
+  }
+
+  printf("Session %08x %s\n", session->sessionId, session->done ? "completed" : "timed out");
+  // a session that relays stays until its children are served
+  if (session->done && !daemonMode)
+    finished = true;
+  free(session->digests);
+  free(session->blockStates);
+  free(session->relayCache);
+  free(session->fecCache);
+  free(session->fecBlocks);
+  free(session->received);
+  free(session->window);
+  free(session);
+}
+
+/*
+ * Sends every queued acknowledgement with one sendmmsg
+ */
+void flushAcks() {
+  int sent = 0;
+
+  while (sent < ackQueueLength) {
+    int n = sendmmsg(sockfd, ackMsgs + sent, ackQueueLength - sent, 0);
+    sent += n > 0 ? n : 1;
+  }
+  ackQueueLength = 0;
+}
+
+/*
+ * Returns whether a session that is not waiting on the segment for its next
+ * in-sequence packet has received the given one, either buffered in its
+ * receive window or, for a session that joined late, in its bitmap
+ */
+bool hasReceived(Session *session, int seqNum) {
+  if (session->received != NULL)
+    return seqNum < session->numSegments && (session->received[seqNum / 64] >> (seqNum % 64) & 1);
+  return seqNum < session->expectedSeqNum + windowSize && session->window[seqNum % windowSize].filled;
+}
+
+/*
+ * Queues an acknowledgement of everything the session has received so far
+ * to its client: the last in-sequence packet and a bitmap of the buffered
+ * packets after it, followed by the echo of the latest timestamp if the
+ * client sent one.
+ */
+void queueAck(Session *session) {
+  if (ackQueueLength == RECV_BATCH)
+    flushAcks();
+
+  int entry = ackQueueLength++;
+  Ack *ackPacket = &ackQueue[entry];
+  int sackBase = session->expectedSeqNum + 1;
+  uint64_t sackBits = 0;
+  for (int bit = 0; bit < SACK_BITS; bit++) {
+    if (hasReceived(session, sackBase + bit))
+      sackBits |= (uint64_t) 1 << bit;
+  }
+  fillHeader(&ackPacket->hdr, ACK_PKT, session->sessionId, session->expectedSeqNum - 1, CHECKSUM_INET, 0);
+  ackPacket->sackBase = htobe64(sackBase);
+  ackPacket->sackBits = htobe64(sackBits);
+  ackPacket->codecs = htobe32(SUPPORTED_CODECS);
+
+  ackAddrs[entry] = session->clientAddr;
+  ackIov[entry][0].iov_base = ackPacket;
+  ackIov[entry][0].iov_len = sizeof(Ack);
+  memset(&ackMsgs[entry].msg_hdr, '\0', sizeof(struct msghdr));
+  ackMsgs[entry].msg_hdr.msg_name = &ackAddrs[entry];
+  ackMsgs[entry].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  ackMsgs[entry].msg_hdr.msg_iov = ackIov[entry];
+  ackMsgs[entry].msg_hdr.msg_iovlen = 1;
+  setSource(&ackMsgs[entry].msg_hdr);
+  if (session->echo > 0) {
+    Timestamp *echo = &ackEchoes[entry];
+    echo->type = EXT_ECHO;
+    echo->length = sizeof(echo->usec);
+    echo->usec = htobe64(session->echo);
+    ackPacket->hdr.extLength = sizeof(Timestamp);
+    ackIov[entry][1].iov_base = echo;
+    ackIov[entry][1].iov_len = sizeof(Timestamp);
+    ackMsgs[entry].msg_hdr.msg_iovlen = 2;
+  }
+
+  session->unackedPackets = 0;
+  session->ackNow = false;
+  cancelDelayedAck(session);
+  countStat(&stats.acks, 1);
+}
+
+/*
+ * Sends the client a request to join the transfer a session has come in on
+ * in the middle of
+ */
+void sendJoinRequest(Session *session) {
+  Join request;
+
+  memset(&request, '\0', sizeof(request));
+  fillHeader(&request.hdr, JOIN_PKT, session->sessionId, INVALID_SEQ_NO, CHECKSUM_INET, 0);
+  sendPacket(&request, sizeof(request), &session->clientAddr);
+}
+
+/*
+ * Sends the client of a session with a bitmap the ranges of segments it is
+ * still missing, at most once every RANGES_USEC
+ */
+void sendRanges(Session *session) {
+  Ranges ranges;
+  uint32_t numRanges = 0;
+  long long now = currentTimeUsec();
+
+  if (session->received == NULL || session->done || now - session->lastRanges < RANGES_USEC)
+    return;
+
+  memset(&ranges, '\0', sizeof(ranges));
+  fillHeader(&ranges.hdr, RANGES_PKT, session->sessionId, session->expectedSeqNum - 1, CHECKSUM_INET, 0);
+
+  int seqNum = session->expectedSeqNum;
+  while (seqNum < session->numSegments && numRanges < MAX_RANGES) {
+    int start = seqNum;
+    while (seqNum < session->numSegments && !hasReceived(session, seqNum))
+      seqNum++;
+    ranges.ranges[2 * numRanges] = htobe64(start);
+    ranges.ranges[2 * numRanges + 1] = htobe64(seqNum);
+    numRanges++;
+    while (seqNum < session->numSegments && hasReceived(session, seqNum))
+      seqNum++;
+  }
+  // the holes that do not fit are covered by running the last range to the end
+  if (seqNum < session->numSegments)
+    ranges.ranges[2 * numRanges - 1] = htobe64(session->numSegments);
+  ranges.numRanges = htobe32(numRanges);
+
+  sendPacket(&ranges, sizeof(ranges), &session->clientAddr);
+  session->lastRanges = now;
+  session->rangesNow = false;
+}
+
+/*
+ * Lays a session out for a file of the given length and MSS, as told by its
+ * client. The session then knows where every segment goes in the file, and
+ * starts tracking the whole file in a bitmap. A stream has no known length,
+ * so a session of one takes it in sequence through its receive window
+ * instead, and keeps no journal. Returns whether the layout was valid.
+ */
+bool layoutSession(Session *session, uint64_t fileLength, int mss) {
+  if (mss <= 0 || mss > MAX_UDP_PAYLOAD)
+    return false;
+
+  if (fileLength == STREAM_LENGTH) {
+    if (session->journalFd >= 0) {
+      close(session->journalFd);
+      unlink(session->journalPath);
+      session->journalFd = -1;
+    }
+    return true;
+  }
+  if ((fileLength + mss - 1) / mss + 1 > MAX_SEGMENTS)
+    return false;
+
+  session->fileLength = fileLength;
+  session->segmentSize = mss;
+  session->numSegments = (fileLength + mss - 1) / mss + 1;
+  session->received = calloc((session->numSegments + 63) / 64, sizeof(uint64_t));
+  if (session->received == NULL) {
+    printf("Fatal Error allocating a session\n");
+    exit(1);
+  }
+  session->journalDirty = session->journalFd >= 0;
+  return true;
+}
+
+/*
+ * Takes the client's answer to a session's join request
+ */
+void joinSession(Session *session, Join *answer) {
+  if (!session->joining || !layoutSession(session, be64toh(answer->fileLength), (int) be32toh(answer->mss)))
+    return;
+
+  session->joining = false;
+  session->batch = session->received != NULL && (answer->hdr.flags & FLAG_BATCH);
+  if (session->received != NULL && (answer->hdr.flags & FLAG_HASHED) && !session->hashed)
+    enableVerify(session);
+  if (session->received == NULL)
+    printf("Session %08x joined a stream\n", session->sessionId);
+  else
+    printf("Session %08x joined, %d segments of %d bytes%s%s\n", session->sessionId, session->numSegments,
+           session->segmentSize, session->batch ? " of a batch" : "", session->hashed ? ", hashed" : "");
+}
+
+/*
+ * Hands a segment to the writer thread, which takes ownership of data, at
+ * the offset following the segments before it. Every segment but the last
+ * is a full MSS, so this is seqNum * MSS. A segment of size 0 signals end of
+ * file.
+ */
+void writeSegment(Session *session, char *data, int size) {
+  queueWrite(writer, session->fileFd, session->fileOffset, data, size);
+  session->fileOffset += size;
+  session->expectedSeqNum++;
+  if (size == 0) {
+    session->done = true;
+    finished = !daemonMode && session->numChildren == 0;
+  }
+}
+
+/*
+ * Returns the size a segment of a session laid out in its bitmap must have:
+ * the MSS, the rest of the file for the last data segment, and 0 for the EOF
+ * segment after it
+ */
+int segmentLength(Session *session, int seqNum) {
+  uint64_t offset = (uint64_t) seqNum * session->segmentSize;
+  if (offset >= session->fileLength)
+    return 0;
+  return session->fileLength - offset < (uint64_t) session->segmentSize ? (int) (session->fileLength - offset) : session->segmentSize;
+}
+
+/*
+ * Keeps the digest a data packet of a hashed session carries: that of its
+ * block if it is the last segment of one, or that of the file if it is the
+ * EOF segment. A digest is carried outside of the checksum, so one already
+ * checked against the block is never replaced.
+ */
+void takeDigest(Session *session, int seqNum, const Header *hdr, int size) {
+  const uint8_t *hash = findExtension(hdr, size, EXT_DIGEST, HASH_SIZE);
+  Digest *digest;
+
+  if (hash == NULL || seqNum < 0 || seqNum >= session->numSegments)
+    return;
+  if (seqNum == session->numSegments - 1) {
+    if (session->verified)
+      return;
+    digest = &session->fileDigest;
+  } else {
+    int block = seqNum / HASH_SEGMENTS;
+    if (seqNum != blockEnd(session, block) - 1 || session->blockStates[block] != BLOCK_OPEN)
+      return;
+    digest = &session->digests[block];
+  }
+  digest->type = EXT_DIGEST;
+  digest->length = HASH_SIZE;
+  memcpy(digest->hash, hash, HASH_SIZE);
+}
+
+/*
+ * Hands a block of a hashed session to the writer thread to be verified
+ * behind the writes of its segments, once the session has all of them. A
+ * block whose last segment came without its digest, as a segment rebuilt
+ * from parity does, has that segment fetched again instead, since that is
+ * the one that carries it.
+ */
+void checkBlock(Session *session, int block) {
+  int start = block * HASH_SEGMENTS;
+  int end = blockEnd(session, block);
+
+  if (session->blockStates[block] != BLOCK_OPEN)
+    return;
+  // a block starts on a word of the bitmap, as HASH_SEGMENTS is a multiple
+  // of 64
+  for (int seqNum = start; seqNum < end; seqNum += 64) {
+    uint64_t bits = end - seqNum >= 64 ? UINT64_MAX : ((uint64_t) 1 << (end - seqNum)) - 1;
+    if ((session->received[seqNum / 64] & bits) != bits)
+      return;
+  }
+  if (session->digests[block].type != EXT_DIGEST) {
+    session->received[(end - 1) / 64] &= ~((uint64_t) 1 << ((end - 1) % 64));
+    session->rangesNow = true;
+    return;
+  }
+
+  Verification *verification = malloc(sizeof(Verification));
+  if (verification == NULL) {
+    printf("Fatal Error allocating a verification\n");
+    exit(1);
+  }
+  verification->sessionId = session->sessionId;
+  verification->block = block;
+  memcpy(verification->digest, session->digests[block].hash, HASH_SIZE);
+  uint64_t length = segmentLength(session, end - 1) + (uint64_t) (end - 1 - start) * session->segmentSize;
+  queueVerify(writer, session->fileFd, (off_t) start * session->segmentSize, (int) length, verification);
+  session->blockStates[block] = BLOCK_VERIFYING;
+}
+
+/*
+ * Returns whether every block of a hashed session has been verified and
+ * the digest of the file matches their digests. A digest of the file that
+ * does not is taken to have been damaged itself, and the next one the EOF
+ * segment brings is checked instead.
+ */
+bool checkFile(Session *session) {
+  uint8_t hash[HASH_SIZE];
+  Hasher hasher;
+
+  if (session->verified)
+    return true;
+  if (session->blocksVerified < session->numBlocks || session->fileDigest.type != EXT_DIGEST)
+    return false;
+
+  uint64_t length = htobe64(session->fileLength);
+  initHasher(&hasher);
+  updateHasher(&hasher, &length, sizeof(length));
+  for (int block = 0; block < session->numBlocks; block++)
+    updateHasher(&hasher, session->digests[block].hash, HASH_SIZE);
+  finishHasher(&hasher, hash);
+  if (memcmp(hash, session->fileDigest.hash, HASH_SIZE) != 0) {
+    logLimited("Session %08x file digest does not match its blocks\n", session->sessionId);
+    session->fileDigest.type = 0;
+    return false;
+  }
+  session->verified = true;
+  printf("Session %08x verified all %d blocks\n", session->sessionId, session->numBlocks);
+  return true;
+}
+
+/*
+ * Handles a segment of a session laid out in its bitmap. Knowing the MSS,
+ * the session writes any segment it has not received yet straight to its
+ * place in the file, and is done once it has every segment. Knowing the
+ * length of the file as well, it takes a segment only if it has exactly the
+ * size that segment must have. A hashed session checks every block it
+ * completes, and holds off the EOF segment until all of them check out.
+ */
+void receiveJoined(Session *session, int seqNum, char *segment, int bufferSize) {
+  if (seqNum < 0 || seqNum >= session->numSegments || bufferSize != segmentLength(session, seqNum)
+      || (session->received[seqNum / 64] >> (seqNum % 64) & 1)) {
+    // already received and its ack may have been lost, or not of this file,
+    // and the client may not know what else has been
+    countStat(&stats.duplicates, 1);
+    session->ackNow = true;
+    session->rangesNow = true;
+    return;
+  }
+  if (session->hashed && seqNum == session->numSegments - 1 && !checkFile(session)) {
+    // the client keeps resending it until then, and learns of blocks to resend
+    session->ackNow = true;
+    session->rangesNow = true;
+    return;
+  }
+
+  char *data = takeBuffer(pool, bufferSize);
+  memcpy(data, segment, bufferSize);
+  queueWrite(writer, session->fileFd, (off_t) seqNum * session->segmentSize, data, bufferSize);
+  session->received[seqNum / 64] |= (uint64_t) 1 << (seqNum % 64);
+  session->journalDirty = session->journalFd >= 0;
+  if (session->hashed && seqNum < session->numSegments - 1)
+    checkBlock(session, seqNum / HASH_SEGMENTS);
+
+  if (seqNum != session->expectedSeqNum)
+    session->ackNow = true;
+  while (session->expectedSeqNum < session->numSegments && hasReceived(session, session->expectedSeqNum))
+    session->expectedSeqNum++;
+  if (session->expectedSeqNum == session->numSegments) {
+    session->done = true;
+    finished = !daemonMode && session->numChildren == 0;
+  }
+}
+
+/*
+ * Handles a segment of a session whose checksum has been verified. An
+ * in-sequence packet is written to the file along with any buffered packets
+ * it makes in-sequence; an out-of-sequence packet inside the receive window
+ * is buffered. Anything but an in-sequence packet that leaves no hole behind
+ * asks for the next ack to go out right away, so the client learns about
+ * holes and lost acks without waiting for the ack delay.
+ */
+void receivePacket(Session *session, int seqNum, char *segment, int bufferSize) {
+  if (session->unackedPackets++ == 0) {
+    // the ack for this packet may be delayed, oldest sessions first
+    session->firstUnackedTime = currentTimeUsec();
+    session->prevDelayed = delayedTail;
+    session->nextDelayed = NULL;
+    if (delayedTail != NULL)
+      delayedTail->nextDelayed = session;
+    else
+      delayedHead = session;
+    delayedTail = session;
+    session->delayed = true;
+  }
+
+  if (session->done) {
+    // everything has been received and the last ack may have been lost
+    countStat(&stats.duplicates, 1);
+    session->ackNow = true;
+  } else if (session->received != NULL) {
+    receiveJoined(session, seqNum, segment, bufferSize);
+  } else if (seqNum == session->expectedSeqNum) {
+    // in-sequence, write it and flush buffered packets that now are too
+    char *data = takeBuffer(pool, bufferSize);
+    memcpy(data, segment, bufferSize);
+    writeSegment(session, data, bufferSize);
+
+    Slot *slot = &session->window[session->expectedSeqNum % windowSize];
+    while (!session->done && windowSize > 1 && slot->filled) {
+      writeSegment(session, slot->data, slot->size);
+      slot->filled = false;
+      slot = &session->window[session->expectedSeqNum % windowSize];
+      session->ackNow = true;
+    }
+  } else if (seqNum > session->expectedSeqNum && seqNum < session->expectedSeqNum + windowSize) {
+    // out-sequence but inside the window, buffer it
+    Slot *slot = &session->window[seqNum % windowSize];
+    if (!slot->filled) {
+      slot->data = takeBuffer(pool, bufferSize);
+      memcpy(slot->data, segment, bufferSize);
+      slot->size = bufferSize;
+      slot->filled = true;
+    } else {
+      countStat(&stats.duplicates, 1);
+    }
+    session->ackNow = true;
+  } else {
+    // already received and its ack may have been lost, or beyond the window
+    countStat(&stats.duplicates, seqNum < session->expectedSeqNum);
+    session->ackNow = true;
+  }
+
+  if (session->done)
+    session->ackNow = true;
+}
+
+/*
+ * Returns whether a session has received the given segment one way or
+ * another, so the segment no longer needs rebuilding
+ */
+bool segmentDone(Session *session, int seqNum) {
+  return session->done || seqNum < session->expectedSeqNum || hasReceived(session, seqNum);
+}
+
+/*
+ * Returns the copy a session keeps of the given segment, or NULL if it has
+ * none
+ */
+Cached *cachedSegment(Session *session, int seqNum) {
+  Cached *cached = &session->fecCache[seqNum % fecCacheSize];
+  return cached->seqNum == seqNum ? cached : NULL;
+}
+
+/*
+ * Keeps a copy of a segment for rebuilding the others of its block, in
+ * place of the oldest one
+ */
+void cacheSegment(Session *session, int seqNum, char *segment, int bufferSize) {
+  Cached *cached = &session->fecCache[seqNum % fecCacheSize];
+
+  if (cached->seqNum == seqNum)
+    return;
+  if (cached->data != NULL)
+    returnBuffer(cached->data);
+  cached->data = takeBuffer(pool, bufferSize);
+  memcpy(cached->data, segment, bufferSize);
+  cached->size = bufferSize;
+  cached->seqNum = seqNum;
+}
+
+/*
+ * Starts keeping copies of the segments of a session once its client turns
+ * out to send parity
+ */
+void enableFec(Session *session) {
+  session->fecCache = calloc(fecCacheSize, sizeof(Cached));
+  session->fecBlocks = calloc(FEC_PENDING, sizeof(FecBlock));
+  if (session->fecCache == NULL || session->fecBlocks == NULL) {
+    printf("Fatal Error allocating a session\n");
+    exit(1);
+  }
+  for (int i = 0; i < fecCacheSize; i++)
+    session->fecCache[i].seqNum = INVALID_SEQ_NO;
+}
+
+/*
+ * Rebuilds the segments of a block that a session is missing, once it holds
+ * at least as many parity symbols as there are segments missing, and hands
+ * every segment of the block it has not received to it in sequence, the
+ * rebuilt ones and any it had to drop for being beyond its window. The
+ * block is freed once nothing of it is left to rebuild.
+ */
+void recoverBlock(Session *session, FecBlock *block) {
+  unsigned char *symbols[FEC_MAX_SYMBOLS];
+  unsigned char *parity[FEC_MAX_SYMBOLS];
+  bool dataPresent[FEC_MAX_SYMBOLS];
+  int numMissing = 0;
+  int numParity = 0;
+  bool done = true;
+
+  for (int i = 0; i < block->numData; i++) {
+    dataPresent[i] = cachedSegment(session, block->blockStart + i) != NULL;
+    numMissing += !dataPresent[i];
+    done = done && segmentDone(session, block->blockStart + i);
+  }
+  for (int j = 0; j < block->numParity; j++)
+    numParity += block->present[j];
+  if (!done && numMissing > numParity)
+    return;
+
+  if (!done && numMissing > 0) {
+    unsigned char *buffer = calloc(block->numData, block->symbolSize);
+    if (buffer == NULL) {
+      printf("Fatal Error allocating a block\n");
+      exit(1);
+    }
+    for (int i = 0; i < block->numData; i++) {
+      symbols[i] = buffer + (size_t) i * block->symbolSize;
+      Cached *cached = cachedSegment(session, block->blockStart + i);
+      if (cached == NULL)
         continue;
+      // a segment that does not fit the symbols cannot be part of the block
+      if (cached->size > block->symbolSize - FEC_SIZE_BYTES) {
+        free(buffer);
+        free(block->parity);
+        block->parity = NULL;
+        return;
       }
+      symbols[i][0] = cached->size & 0xFF;
+      symbols[i][1] = cached->size >> 8;
+      memcpy(symbols[i] + FEC_SIZE_BYTES, cached->data, cached->size);
+    }
+    for (int j = 0; j < block->numParity; j++)
+      parity[j] = block->parity + (size_t) j * block->symbolSize;
+
+    fecDecode(block->numData, block->numParity, symbols, dataPresent, parity, block->present, block->symbolSize);
+    for (int i = 0; i < block->numData; i++) {
+      int size = symbols[i][0] | symbols[i][1] << 8;
+      if (!dataPresent[i] && size <= block->symbolSize - FEC_SIZE_BYTES) {
+        logLimited("Rebuilt sequence number = %d\n", block->blockStart + i);
+        countStat(&stats.rebuilt, 1);
+        cacheSegment(session, block->blockStart + i, (char *) symbols[i] + FEC_SIZE_BYTES, size);
+      }
+    }
+    free(buffer);
+  }
 
-      int randNum = rand() % 100;
-      double randPacketLossProb = ((double) randNum / 100);
+  for (int i = 0; i < block->numData; i++) {
+    int seqNum = block->blockStart + i;
+    Cached *cached = cachedSegment(session, seqNum);
+    if (!segmentDone(session, seqNum) && cached != NULL)
+      receivePacket(session, seqNum, cached->data, cached->size);
+  }
 
-      if (randPacketLossProb <= packetLossProb) {
-        //ignore received message
-        printf("Packet loss, sequence number = %d\n", dataPacket.hdr.seqNum);
-        continue;
-      } else if (dataPacket.hdr.seqNum == expectedSeqNum) {
-        // ELSE IF in-sequence, then send properly
-        ackPacket.hdr.seqNum = expectedSeqNum;
-        ackPacket.hdr.checksum = 0;
-        ackPacket.hdr.type = ACK_PKT;
-
-        sendto(sockfd, &ackPacket, sizeof(Ack), 0, (struct sockaddr*)&clientAddr, clientAddrSize);
-
-        //Write received data to file
-        fwrite(dataPacket.data, 1, bufferSize, file);
-        lastSeqNum = expectedSeqNum;
-        expectedSeqNum++;
-      } else if (dataPacket.hdr.seqNum != expectedSeqNum) {
-        // ELSE IF out-sequence, then send ack of last in-sequence packet
-        ackPacket.hdr.seqNum = lastSeqNum;
-        ackPacket.hdr.checksum = 0;
-        ackPacket.hdr.type = ACK_PKT;
-
-        sendto(sockfd, &ackPacket, sizeof(Ack), 0, (struct sockaddr*)&clientAddr, clientAddrSize);
+  free(block->parity);
+  block->parity = NULL;
+}
+
+/*
+ * Handles a parity packet of a session whose checksum has been verified,
+ * keeping its symbol with the others of its block and rebuilding the
+ * block if it now can be. A symbol is coded over the session's segment
+ * size, and parity of any other size is dropped. A new block replaces the
+ * oldest pending one when there is no room left.
+ */
+void receiveParity(Session *session, int blockStart, Parity *info, int symbolSize) {
+  int numData = be16toh(info->numData);
+
+  if (blockStart < 0 || numData < 1 || numData + info->numParity > FEC_MAX_SYMBOLS
+      || info->index >= info->numParity || session->segmentSize <= 0
+      || symbolSize != session->segmentSize + FEC_SIZE_BYTES)
+    return;
+  if (session->fecCache == NULL)
+    enableFec(session);
+
+  FecBlock *block = NULL;
+  for (int i = 0; i < FEC_PENDING && block == NULL; i++) {
+    if (session->fecBlocks[i].parity != NULL && session->fecBlocks[i].blockStart == blockStart)
+      block = &session->fecBlocks[i];
+  }
+
+  if (block == NULL) {
+    bool done = true;
+    for (int i = 0; i < numData; i++)
+      done = done && segmentDone(session, blockStart + i);
+    if (done)
+      return;
+
+    block = &session->fecBlocks[0];
+    for (int i = 0; i < FEC_PENDING && block->parity != NULL; i++) {
+      if (session->fecBlocks[i].parity == NULL || session->fecBlocks[i].blockStart < block->blockStart)
+        block = &session->fecBlocks[i];
+    }
+    free(block->parity);
+    block->parity = calloc(info->numParity, symbolSize);
+    if (block->parity == NULL) {
+      printf("Fatal Error allocating a block\n");
+      exit(1);
+    }
+    block->blockStart = blockStart;
+    block->numData = numData;
+    block->numParity = info->numParity;
+    block->symbolSize = symbolSize;
+    memset(block->present, '\0', sizeof(block->present));
+  } else if (block->numData != numData || block->numParity != info->numParity
+             || block->symbolSize != symbolSize) {
+    return;
+  }
+
+  memcpy(block->parity + (size_t) info->index * symbolSize, (char *) (info + 1), symbolSize);
+  block->present[info->index] = true;
+  recoverBlock(session, block);
+}
+
+/*
+ * Keeps a copy of a segment of a session using forward error correction,
+ * and rebuilds the block it belongs to if the segment completes enough of
+ * it
+ */
+void receiveFecSegment(Session *session, int seqNum, char *segment, int bufferSize) {
+  cacheSegment(session, seqNum, segment, bufferSize);
+
+  for (int i = 0; i < FEC_PENDING; i++) {
+    FecBlock *block = &session->fecBlocks[i];
+    if (block->parity != NULL && seqNum >= block->blockStart && seqNum < block->blockStart + block->numData)
+      recoverBlock(session, block);
+  }
+}
+
+/*
+ * Starts relaying a session to the children its syn names, keeping the last
+ * packets it relayed, twice the client's window of them, for repairs
+ */
+void enableRelay(Session *session, const Children *children, int window) {
+  session->numChildren = children->numChildren < MAX_CHILDREN ? children->numChildren : MAX_CHILDREN;
+  for (int i = 0; i < session->numChildren; i++) {
+    memset(&session->children[i], '\0', sizeof(struct sockaddr_in));
+    session->children[i].sin_family = AF_INET;
+    session->children[i].sin_addr.s_addr = children->peers[i].address;
+    session->children[i].sin_port = children->peers[i].port;
+  }
+
+  session->relayCacheSize = window > 0 && window <= MAX_WINDOW ? 2 * window : 2 * MAX_WINDOW;
+  if (session->relayCacheSize < MIN_RELAY_CACHE)
+    session->relayCacheSize = MIN_RELAY_CACHE;
+  if ((session->relayCache = calloc(session->relayCacheSize, sizeof(Cached))) == NULL) {
+    printf("Fatal Error allocating a session\n");
+    exit(1);
+  }
+  for (int i = 0; i < session->relayCacheSize; i++)
+    session->relayCache[i].seqNum = INVALID_SEQ_NO;
+  printf("Session %08x relays to %d servers\n", session->sessionId, session->numChildren);
+}
+
+/*
+ * Takes the syn opening a session, and answers it with what the session
+ * has received so far and what the server supports. Only the first syn lays
+ * the session out, unless the session already has its layout from its
+ * journal; a repeated one, sent because an answer was lost, is only
+ * answered. A session laid out in its bitmap takes any segment of the file,
+ * so its window is the largest there is.
+ */
+void synSession(Session *session, Syn *syn, int size) {
+  if (!session->synced) {
+    if (session->received == NULL && session->expectedSeqNum == 0
+        && !layoutSession(session, be64toh(syn->fileLength), (int) be32toh(syn->mss)))
+      return;
+    session->synced = true;
+    session->joining = false;
+    session->batch = session->received != NULL && (syn->hdr.flags & FLAG_BATCH);
+    if (session->received != NULL && (syn->hdr.flags & FLAG_HASHED) && !session->hashed)
+      enableVerify(session);
+    if (be16toh(syn->fecData) > 0 && session->fecCache == NULL)
+      enableFec(session);
+    const Children *children = findExtension(&syn->hdr, size, EXT_CHILDREN, sizeof(Children));
+    if (children != NULL && children->numChildren > 0)
+      enableRelay(session, children, (int) be32toh(syn->window));
+    if (session->received == NULL)
+      printf("Session %08x opened a stream\n", session->sessionId);
+    else
+      printf("Session %08x opened, %d segments of %d bytes%s%s\n", session->sessionId, session->numSegments,
+             session->segmentSize, session->batch ? " of a batch" : "", session->hashed ? ", hashed" : "");
+  }
+
+  SynAck answer;
+  memset(&answer, '\0', sizeof(answer));
+  fillHeader(&answer.hdr, SYNACK_PKT, session->sessionId, session->expectedSeqNum - 1, CHECKSUM_INET, 0);
+  answer.window = htobe32(session->received != NULL ? MAX_WINDOW : windowSize);
+  answer.checksums = htobe32(SUPPORTED_CHECKSUMS);
+  answer.codecs = htobe32(SUPPORTED_CODECS);
+  answer.capabilities = htobe32(CAP_FEC | CAP_RANGES);
+  sendPacket(&answer, sizeof(answer), &session->clientAddr);
+}
+
+/*
+ * Adds a session to the list of sessions that received packets in the
+ * current burst, once
+ */
+void touchSession(Session *session) {
+  if (session->touched)
+    return;
+  session->touched = true;
+  session->nextTouched = touchedHead;
+  touchedHead = session;
+}
+
+/*
+ * Verifies one received datagram and passes it to its session, opening a
+ * new session for a syn or a packet of a transfer the server has not seen
+ * before. A session opened in the middle of its transfer asks the client to
+ * join. Packets of another version of the protocol, and sequence numbers
+ * past what a session can hold, are ignored.
+ */
+void handleDatagram(Packet *dataPacket, int recvSize, struct sockaddr_in *clientAddr) {
+  int length = packetLength(&dataPacket->hdr, recvSize);
+  if (length < 0)
+    return;
+  uint16_t type = headerType(&dataPacket->hdr);
+  uint32_t sessionId = headerSessionId(&dataPacket->hdr);
+  int64_t wireSeqNum = headerSeqNum(&dataPacket->hdr);
+
+  if ((size_t) length == sizeof(Join) && type == JOIN_PKT) {
+    Session *session = findSession(sessionId);
+    if (session != NULL)
+      joinSession(session, (Join *) dataPacket);
+    return;
+  }
+  if ((size_t) length == sizeof(Repair) && type == REPAIR_PKT) {
+    Session *session = findSession(sessionId);
+    if (session != NULL && session->numChildren > 0)
+      repairChild(session, wireSeqNum, &((Repair *) dataPacket)->peer);
+    return;
+  }
+  if ((size_t) length == sizeof(Syn) && type == SYN_PKT) {
+    Session *session = findSession(sessionId);
+    if (session == NULL && (session = openSession(sessionId)) == NULL)
+      return;
+    session->clientAddr = *clientAddr;
+    session->lastActivity = currentTimeUsec();
+    synSession(session, (Syn *) dataPacket, recvSize);
+    touchSession(session);
+    return;
+  }
+
+  if (type != DATA_PKT && type != FEC_PKT && type != ZDATA_PKT)
+    return;
+  if (type == FEC_PKT && (size_t) length < sizeof(Header) + sizeof(Parity))
+    return;
+  if (type == ZDATA_PKT && (size_t) length < sizeof(Header) + sizeof(Compressed))
+    return;
+  if (wireSeqNum < INVALID_SEQ_NO || wireSeqNum >= MAX_SEGMENTS)
+    return;
+
+  int seqNum = (int) wireSeqNum;
+  int bufferSize = length - sizeof(Header);
+
+  // verify checksum
+  uint32_t checksum = calculateChecksum(dataPacket->hdr.checksumType, dataPacket->data, bufferSize);
+  if (checksum != be32toh(dataPacket->hdr.checksum)) {
+    countStat(&stats.checksumFailures, 1);
+    return;
+  }
+
+  if (emulateLoss(emulator)) {
+    //ignore received message
+    logLimited("Packet loss, sequence number = %d\n", seqNum);
+    countStat(&stats.losses, 1);
+    return;
+  }
+
+  // a compressed segment is taken as the segment it decompresses to
+  char *segment = dataPacket->data;
+  if (type == ZDATA_PKT) {
+    Compressed *compressed = (Compressed *) dataPacket->data;
+    int size = decompressData(compressed->codec, compressed + 1, bufferSize - sizeof(Compressed),
+                              inflated, sizeof(inflated));
+    if (size < 0 || size != be16toh(compressed->size))
+      return;
+    segment = inflated;
+    bufferSize = size;
+    type = DATA_PKT;
+  }
+
+  // multicast packets reach every worker, which keep only their own sessions
+  if (sessionWorker(sessionId) != workerNum)
+    return;
+
+  // a relayed packet is only taken by a session opened by its client
+  bool relayed = dataPacket->hdr.flags & FLAG_RELAYED;
+  Session *session = findSession(sessionId);
+  if (session == NULL) {
+    if (seqNum < 0 || type != DATA_PKT || relayed)
+      return;
+    if ((session = openSession(sessionId)) == NULL)
+      return;
+    // a session with a journal needs to know the layout of the file from the
+    // start, unless it found it in the journal
+    session->joining = session->received == NULL && (journaling || seqNum >= windowSize);
+  }
+
+  if (!relayed)
+    session->clientAddr = *clientAddr;
+  session->lastActivity = currentTimeUsec();
+  uint64_t timestamp = findTimestamp(&dataPacket->hdr, recvSize, EXT_TIMESTAMP);
+  if (timestamp > 0)
+    session->echo = timestamp;
+  if (dataPacket->hdr.flags & FLAG_RETRANSMIT)
+    countStat(&stats.retransmits, 1);
+  // pass on what the session takes for the first time to its children
+  if (session->numChildren > 0 && !session->joining && !session->done
+      && (type == FEC_PKT || (seqNum >= 0 && !segmentDone(session, seqNum))))
+    relayPacket(session, seqNum, dataPacket, recvSize, type);
+  if (session->joining) {
+    // nothing can be rebuilt before the client answers
+  } else if (type == FEC_PKT) {
+    receiveParity(session, seqNum, (Parity *) dataPacket->data, bufferSize - sizeof(Parity));
+  } else {
+    if (session->hashed)
+      takeDigest(session, seqNum, &dataPacket->hdr, recvSize);
+    receivePacket(session, seqNum, segment, bufferSize);
+    if (session->fecCache != NULL && seqNum >= 0)
+      receiveFecSegment(session, seqNum, segment, bufferSize);
+  }
+
+  touchSession(session);
+}
+
+/*
+ * Takes the blocks the writer thread has verified since the last time. A
+ * block that matches its digest counts towards the file, and once the last
+ * one does, the EOF segment the session held off is taken. A block that
+ * does not match is dropped from the bitmap, so the ranges the client is
+ * told next have it send the block again. Either way the session is acked
+ * with the next burst.
+ */
+void takeVerifiedBlocks() {
+  Verification *verification = takeVerifications(writer);
+
+  while (verification != NULL) {
+    Verification *next = verification->next;
+    Session *session = findSession(verification->sessionId);
+    int block = verification->block;
+    if (session != NULL && session->hashed && block < session->numBlocks
+        && session->blockStates[block] == BLOCK_VERIFYING) {
+      session->journalDirty = session->journalFd >= 0;
+      if (verification->intact) {
+        countStat(&stats.verified, 1);
+        session->blockStates[block] = BLOCK_VERIFIED;
+        session->blocksVerified++;
+        if (!session->done && session->fileDigest.type == EXT_DIGEST && checkFile(session))
+          receiveJoined(session, session->numSegments - 1, inflated, 0);
+      } else {
+        logLimited("Session %08x block %d does not match its digest, fetching it again\n", session->sessionId, block);
+        countStat(&stats.corrupt, 1);
+        session->blockStates[block] = BLOCK_OPEN;
+        int start = block * HASH_SEGMENTS;
+        for (int seqNum = start; seqNum < blockEnd(session, block); seqNum++)
+          session->received[seqNum / 64] &= ~((uint64_t) 1 << (seqNum % 64));
+        if (start < session->expectedSeqNum)
+          session->expectedSeqNum = start;
+        session->rangesNow = true;
+      }
+      session->ackNow = true;
+      touchSession(session);
+    }
+    free(verification);
+    verification = next;
+  }
+}
+
+/*
+ * Acks every session that received packets in the last burst, unless its
+ * ack may still be delayed, tells the client of a session that should know
+ * which segments it is missing, and repeats the join request of every
+ * session still waiting for an answer
+ */
+void ackTouchedSessions() {
+  while (touchedHead != NULL) {
+    Session *session = touchedHead;
+    touchedHead = session->nextTouched;
+    session->touched = false;
+    if (session->joining) {
+      sendJoinRequest(session);
+      continue;
+    }
+    if (session->rangesNow)
+      sendRanges(session);
+    if (session->ackNow || session->unackedPackets >= ackEvery)
+      queueAck(session);
+  }
+}
+
+/*
+ * Sends the delayed acks that are due by now
+ */
+void sendDueAcks(long long now) {
+  while (delayedHead != NULL && delayedHead->firstUnackedTime + ackDelayUsec <= now)
+    queueAck(delayedHead);
+}
+
+/*
+ * Checkpoints the journal of every session whose bitmap has changed, and
+ * closes the sessions that have completed and lingered long enough to ack
+ * any retransmission of their last packet, and those whose client has gone
+ * quiet before completing
+ */
+void sweepSessions(long long now) {
+  for (int bucket = 0; bucket < SESSION_BUCKETS; bucket++) {
+    Session *session = sessionTable[bucket];
+    while (session != NULL) {
+      Session *next = session->nextInBucket;
+      long long idle = now - session->lastActivity;
+      if (session->journalDirty)
+        checkpointJournal(session);
+      if (idle > (session->done ? SESSION_LINGER_USEC : SESSION_TIMEOUT_USEC))
+        closeSession(session);
+      session = next;
+    }
+  }
+}
+
+/*
+ * Handles every datagram the emulated path has held that is due by now
+ */
+void releaseHeld(long long now) {
+  struct sockaddr_in clientAddr;
+  void *datagram;
+  int size;
+
+  while (!finished && (datagram = releaseDatagram(emulator, now, &size, &clientAddr)) != NULL) {
+    handleDatagram(datagram, size, &clientAddr);
+    free(datagram);
+  }
+}
+
+/*
+ * Writes the counters of the worker to the stats stream as one JSON line,
+ * marked final once the worker is stopping
+ */
+void writeStats(long long now, bool final) {
+  fprintf(statsFile, "{\"worker\":%d,\"elapsed_us\":%lld,\"final\":%s,\"sessions\":%d,"
+          "\"datagrams\":%llu,\"bytes\":%llu,\"checksum_failures\":%llu,\"losses\":%llu,"
+          "\"retransmits\":%llu,\"duplicates\":%llu,\"acks\":%llu,\"rebuilt\":%llu,"
+          "\"relayed\":%llu,\"repairs\":%llu,\"verified_blocks\":%llu,\"corrupt_blocks\":%llu,"
+          "\"disk_blocked_us\":%lld,\"pool_bytes\":%lld}\n",
+          workerNum, now - statsStart, final ? "true" : "false", numSessions,
+          (unsigned long long) loadStat(&stats.datagrams), (unsigned long long) loadStat(&stats.bytes),
+          (unsigned long long) loadStat(&stats.checksumFailures), (unsigned long long) loadStat(&stats.losses),
+          (unsigned long long) loadStat(&stats.retransmits), (unsigned long long) loadStat(&stats.duplicates),
+          (unsigned long long) loadStat(&stats.acks), (unsigned long long) loadStat(&stats.rebuilt),
+          (unsigned long long) loadStat(&stats.relayed), (unsigned long long) loadStat(&stats.repairs),
+          (unsigned long long) loadStat(&stats.verified), (unsigned long long) loadStat(&stats.corrupt),
+          writerBlockedUsec(writer), poolBytes(pool));
+}
+
+/*
+ * Arms the timer for the next delayed ack or held datagram that is due, or
+ * the next sweep or stats export
+ */
+void armTimer(int timerfd, long long nextSweep, long long nextStats) {
+  long long deadline = nextSweep;
+  if (statsFile != NULL && nextStats < deadline)
+    deadline = nextStats;
+  if (delayedHead != NULL && delayedHead->firstUnackedTime + ackDelayUsec < deadline)
+    deadline = delayedHead->firstUnackedTime + ackDelayUsec;
+  long long release = nextRelease(emulator);
+  if (release >= 0 && release < deadline)
+    deadline = release;
+
+  struct itimerspec timer;
+  memset(&timer, '\0', sizeof(timer));
+  timer.it_value.tv_sec = deadline / 1000000;
+  timer.it_value.tv_nsec = (deadline % 1000000) * 1000;
+  if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+    timer.it_value.tv_nsec = 1;
+  timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/*
+ * Opens a socket bound to the server's address and port. With more than one
+ * worker, every worker's socket joins one SO_REUSEPORT group on the port.
+ */
+int openSocket(struct sockaddr_in *serverAddr, char *ipAddr, char *groupName) {
+  int socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+  int enable = 1;
+
+  if (numWorkers > 1 && setsockopt(socketFd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+    printf("Fatal Error setting SO_REUSEPORT\n");
+    exit(1);
+  }
+
+  // packets addressed to the group are only delivered to a wildcard bind
+  if (groupName != NULL) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(groupName);
+    mreq.imr_interface.s_addr = inet_addr(ipAddr);
+    if (!IN_MULTICAST(ntohl(mreq.imr_multiaddr.s_addr))
+        || setsockopt(socketFd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+      printf("Fatal Error joining multicast group %s\n", groupName);
+      exit(1);
+    }
+  }
+
+  if (bind(socketFd, (struct sockaddr*)serverAddr, sizeof(*serverAddr)) < 0) {
+    printf("Fatal Error binding port %d\n", ntohs(serverAddr->sin_port));
+    exit(1);
+  }
+
+  // a kernel without UDP GRO just keeps delivering datagrams one by one
+  setsockopt(socketFd, SOL_UDP, UDP_GRO, &enable, sizeof(enable));
+  return socketFd;
+}
+
+/*
+ * Returns the size of the datagrams the kernel merged into a received
+ * message with UDP GRO, or size, the size of the message, if it holds one
+ */
+int mergedSize(struct msghdr *msg, int size) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int segmentSize;
+      memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+      if (segmentSize > 0 && segmentSize < size)
+        return segmentSize;
+    }
+  }
+  return size;
+}
+
+/*
+ * Attaches the BPF program that picks the socket of the reuseport group for
+ * every unicast packet: the session ID at its offset in the header, which the
+ * kernel loads in network byte order as it is sent, modulo the number of
+ * workers. Sockets are numbered in the order they were bound, so socket i
+ * belongs to worker i.
+ */
+void attachSteering(int socketFd) {
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(Header, sessionId)),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, numWorkers),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+  struct sock_fprog program = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+  if (setsockopt(socketFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+    printf("Fatal Error attaching the session steering program\n");
+    exit(1);
+  }
+}
+
+/*
+ * Body of a worker thread, which receives datagrams on the worker's socket,
+ * verifies them and passes them to their sessions, and acks those sessions,
+ * until the only session completes outside of daemon mode.
+ */
+void *workerThread(void *arg) {
+  workerNum = (int) (long) arg;
+  sockfd = workerSockets[workerNum];
+  emulator = startEmulator(packetLossProb, pathDelayUsec, pathJitterUsec, reorderProb, reorderGapUsec,
+                           emulatorSeed + workerNum);
+
+  // keep the worker on one core so its sessions stay in that core's cache
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(workerNum % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  // buffers for one burst of datagrams, each large enough for any MSS or a
+  // run merged by GRO, with room for the size the run was cut at
+  char *recvBuffers = malloc((size_t) RECV_BATCH * MAX_UDP_PAYLOAD);
+  struct sockaddr_in clientAddrs[RECV_BATCH];
+  struct iovec recvIov[RECV_BATCH];
+  struct mmsghdr recvMsgs[RECV_BATCH];
+  union { char buf[CMSG_SPACE(sizeof(int))]; struct cmsghdr align; } recvControl[RECV_BATCH];
+  if (recvBuffers == NULL) {
+    printf("Fatal Error allocating receive buffers\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < RECV_BATCH; i++) {
+    recvIov[i].iov_base = recvBuffers + (size_t) i * MAX_UDP_PAYLOAD;
+    recvIov[i].iov_len = MAX_UDP_PAYLOAD;
+    memset(&recvMsgs[i].msg_hdr, '\0', sizeof(struct msghdr));
+    recvMsgs[i].msg_hdr.msg_iov = &recvIov[i];
+    recvMsgs[i].msg_hdr.msg_iovlen = 1;
+    recvMsgs[i].msg_hdr.msg_name = &clientAddrs[i];
+  }
+
+  writer = startWriter(WRITE_RING, preallocate);
+  pool = startPool();
+
+  // wait on the socket, on one timer for delayed acks and idle sessions, and
+  // on the blocks the writer has verified
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  int verifiedFd = writerEventFd(writer);
+  int epfd = epoll_create1(0);
+  struct epoll_event event = { .events = EPOLLIN, .data.fd = sockfd };
+  epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event);
+  event.data.fd = timerfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &event);
+  event.data.fd = verifiedFd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, verifiedFd, &event);
+  if (timerfd < 0 || epfd < 0) {
+    printf("Fatal Error setting up the event loop\n");
+    exit(1);
+  }
+
+  statsStart = currentTimeUsec();
+  long long nextSweep = statsStart + SWEEP_USEC;
+  long long nextStats = statsStart + statsIntervalUsec;
+
+  while (!finished) {
+    armTimer(timerfd, nextSweep, nextStats);
+
+    struct epoll_event events[3];
+    int numEvents = epoll_wait(epfd, events, 3, -1);
+    if (numEvents < 0 && errno != EINTR) {
+      printf("Fatal Error waiting for events\n");
+      exit(1);
+    }
+
+    for (int e = 0; e < numEvents; e++) {
+      if (events[e].data.fd == sockfd) {
+        // drain the socket in bursts, then ack every session that was touched
+        int numReceived;
+        do {
+          for (int i = 0; i < RECV_BATCH; i++) {
+            recvMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            recvMsgs[i].msg_hdr.msg_control = recvControl[i].buf;
+            recvMsgs[i].msg_hdr.msg_controllen = sizeof(recvControl[i].buf);
+          }
+          numReceived = recvmmsg(sockfd, recvMsgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+          long long now = currentTimeUsec();
+          for (int i = 0; i < numReceived && !finished; i++) {
+            // cut a merged run back into its datagrams, each handled alone
+            char *datagram = recvIov[i].iov_base;
+            int length = recvMsgs[i].msg_len;
+            int segmentSize = mergedSize(&recvMsgs[i].msg_hdr, length);
+            int offset = 0;
+            countStat(&stats.bytes, length);
+            do {
+              int size = length - offset < segmentSize ? length - offset : segmentSize;
+              countStat(&stats.datagrams, 1);
+              if (!holdDatagram(emulator, datagram + offset, size, &clientAddrs[i], now))
+                handleDatagram((Packet *) (datagram + offset), size, &clientAddrs[i]);
+              offset += size;
+            } while (offset < length && !finished);
+          }
+          ackTouchedSessions();
+          flushAcks();
+          flushRelays();
+        } while (numReceived == RECV_BATCH && !finished);
+      } else if (events[e].data.fd == verifiedFd) {
+        takeVerifiedBlocks();
+        ackTouchedSessions();
+        flushAcks();
+      } else {
+        uint64_t expirations;
+        long long now = currentTimeUsec();
+        if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+          printf("Fatal Error reading the timer\n");
+        releaseHeld(now);
+        ackTouchedSessions();
+        sendDueAcks(now);
+        flushAcks();
+        flushRelays();
+        if (now >= nextSweep) {
+          sweepSessions(now);
+          nextSweep = now + SWEEP_USEC;
+        }
+        if (statsFile != NULL && now >= nextStats) {
+          writeStats(now, false);
+          nextStats = now + statsIntervalUsec;
+        }
       }
+    }
+  }
 
-      // buffer size 0 signals end of file
-      if (bufferSize == 0)
+  flushRelays();
+  for (int bucket = 0; bucket < SESSION_BUCKETS; bucket++) {
+    while (sessionTable[bucket] != NULL)
+      closeSession(sessionTable[bucket]);
+  }
+  close(epfd);
+  close(timerfd);
+  if (statsFile != NULL)
+    writeStats(currentTimeUsec(), true);
+  stopWriter(writer);
+  stopPool(pool);
+  stopEmulator(emulator);
+  free(recvBuffers);
+  return NULL;
+}
+
+/*
+ * Main method listens on the designated port specified by the command line
+ * arguments, and receives data from the clients on this port.
+ *
+ * When it receives a data packet, it computes the checksum and checks whether
+ * it is in-sequence, and if so, it writes the received data into the file of
+ * its session. If the checksum is incorrect, the receiver does nothing.
+ * Either way the ACK segments (using UDP) sent to the client report the last
+ * received in-sequence packet.
+ *
+ * With a receive window larger than one, an out-of-sequence packet that falls
+ * inside the window is buffered and reported in the selective ack bitmap, and
+ * is written to the file once the packets before it have arrived.
+ */
+int main(int argc, char **argv) {
+  char *groupName = NULL;
+  char *bindName = NULL;
+  int opt;
+
+  emulatorSeed = (uint64_t) time(NULL);
+  while ((opt = getopt(argc, argv, "w:a:t:pjdn:b:g:s:D:R:S:")) != -1) {
+    switch (opt) {
+      case 'w':
+        windowSize = atoi(optarg);
         break;
-    } else {
-      printf("Fatal Error recvfrom failed\n");
-      exit(0);
+      case 'a':
+        ackEvery = atoi(optarg);
+        break;
+      case 't':
+        ackDelayUsec = atoll(optarg);
+        break;
+      case 'p':
+        preallocate = true;
+        break;
+      case 'j':
+        journaling = true;
+        break;
+      case 'd':
+        daemonMode = true;
+        break;
+      case 'n':
+        numWorkers = atoi(optarg);
+        break;
+      case 'b':
+        bindName = optarg;
+        break;
+      case 'g':
+        groupName = optarg;
+        break;
+      case 's':
+        emulatorSeed = strtoull(optarg, NULL, 0);
+        break;
+      case 'D':
+        if (sscanf(optarg, "%lld:%lld", &pathDelayUsec, &pathJitterUsec) < 1)
+          pathDelayUsec = -1;
+        break;
+      case 'R':
+        if (sscanf(optarg, "%lf:%lld", &reorderProb, &reorderGapUsec) < 1)
+          reorderProb = -1;
+        break;
+      case 'S':
+        if ((statsFile = openStatsFile(optarg, &statsIntervalUsec)) == NULL) {
+          printf("Fatal Error opening the stats file %s\n", optarg);
+          exit(1);
+        }
+        break;
+      default:
+        argc = 0;
+    }
+  }
+
+  // a single session is only ever received by one worker
+  if(argc - optind != 3 || windowSize < 1 || windowSize > MAX_WINDOW || ackEvery < 1 || ackDelayUsec < 0
+     || numWorkers < 1 || numWorkers > MAX_WORKERS || (numWorkers > 1 && !daemonMode)
+     || pathDelayUsec < 0 || pathJitterUsec < 0 || reorderProb < 0 || reorderProb > 1 || reorderGapUsec < 0) {
+    printf("Usage %s [-w window] [-a packets] [-t usec] [-p] [-j] [-d] [-n workers] [-b address] [-g group] [-s seed] [-D usec[:jitter]] [-R prob[:usec]] [-S path[:msec]] <port> <filename> <packet loss probability>\n", argv[0]);
+    exit(0);
+  }
+
+  int port = atoi(argv[optind]);
+  outputName = argv[optind + 1];
+
+  // a block can span a whole window beyond the oldest segment not received
+  fecCacheSize = windowSize + FEC_MAX_SYMBOLS;
+
+  // Generate random probability loss number
+  sscanf(argv[optind + 2], "%lf", &packetLossProb);
+
+  struct sockaddr_in serverAddr;
+  memset(&serverAddr, '\0', sizeof(serverAddr));
+
+  char ipAddr[16];
+  if (bindName != NULL) {
+    snprintf(ipAddr, sizeof(ipAddr), "%s", bindName);
+  } else if(getIPv4(ipAddr) != 0) {
+    printf("Fata Error no IP address found\n");
+    exit(1);
+  }
+  printf("Server ip address: %s\n", ipAddr);
+
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_addr.s_addr = inet_addr(ipAddr);
+  serverAddr.sin_port = htons(port);
+  if (groupName != NULL) {
+    // the group takes a wildcard bind, so name the source of what is sent
+    struct cmsghdr *cmsg = &sourceControl.align;
+    struct in_pktinfo info;
+    memset(&info, '\0', sizeof(info));
+    info.ipi_spec_dst = serverAddr.sin_addr;
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(info));
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+    sourceControlLength = CMSG_SPACE(sizeof(info));
+    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  }
+
+  // bind every worker's socket before any packet can be steered to one
+  for (int i = 0; i < numWorkers; i++)
+    workerSockets[i] = openSocket(&serverAddr, ipAddr, groupName);
+  if (numWorkers > 1)
+    attachSteering(workerSockets[0]);
+
+  pthread_t workers[MAX_WORKERS];
+  for (int i = 0; i < numWorkers; i++) {
+    if (pthread_create(&workers[i], NULL, workerThread, (void *) (long) i) != 0) {
+      printf("Fatal Error starting worker %d\n", i);
+      exit(1);
     }
   }
 
-  close(sockfd);
-  fclose(file);
+  for (int i = 0; i < numWorkers; i++) {
+    pthread_join(workers[i], NULL);
+    close(workerSockets[i]);
+  }
 }
@@ -0,0 +1,137 @@
+/*
+ * Segment buffer pool of the P2MP-FTP server. See pool.h.
+ *
+ * Each buffer is preceded by a header naming its pool and size class, so it
+ * can be given back without either. The owner takes buffers from a private
+ * free list per class. Other threads push the buffers they give back onto a
+ * second, shared list per class with a compare and swap, and the owner
+ * takes that whole list over with one exchange once its own list runs dry.
+ * As only the owner ever removes buffers from the shared list, and always
+ * all of them at once, a buffer can never be pushed and popped under anyone
+ * (the ABA problem), and no lock is needed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "p2mp.h"
+#include "pool.h"
+
+/* Smallest size class, and the number of classes up to MAX_UDP_PAYLOAD */
+#define MIN_BUFFER 256
+#define NUM_CLASSES 9
+/* Bytes of buffers carved from the system at a time */
+#define CHUNK_SIZE (1 << 20)
+/* Space taken by a buffer's header, which keeps its data cache line aligned */
+#define HEADER_SIZE 64
+
+typedef struct buffer_t {
+  struct buffer_t *next;
+  Pool *pool;
+  int sizeClass;
+} Buffer;
+
+/* A chunk of buffers, the link to the next one taking its first line */
+typedef struct chunk_t {
+  struct chunk_t *next;
+} Chunk;
+
+struct pool_t {
+  Buffer *owned[NUM_CLASSES];
+  Chunk *chunks;
+  long long bytes;
+  // written by other threads, so kept off the lines the owner works on
+  char padding[64];
+  Buffer *returned[NUM_CLASSES];
+};
+
+/*
+ * Starts an empty pool
+ */
+Pool *startPool(void) {
+  Pool *pool = calloc(1, sizeof(Pool));
+  if (pool == NULL) {
+    printf("Fatal Error allocating the segment pool\n");
+    exit(1);
+  }
+  return pool;
+}
+
+/*
+ * Carves a new chunk into buffers of the given class, onto the owner's list
+ */
+static void growPool(Pool *pool, int sizeClass) {
+  size_t stride = HEADER_SIZE + ((size_t) MIN_BUFFER << sizeClass);
+  size_t count = CHUNK_SIZE / stride > 0 ? CHUNK_SIZE / stride : 1;
+  char *chunk;
+
+  if (posix_memalign((void **) &chunk, HEADER_SIZE, HEADER_SIZE + count * stride) != 0) {
+    printf("Fatal Error allocating segment buffers\n");
+    exit(1);
+  }
+  ((Chunk *) chunk)->next = pool->chunks;
+  pool->chunks = (Chunk *) chunk;
+  pool->bytes += HEADER_SIZE + count * stride;
+
+  for (size_t i = 0; i < count; i++) {
+    Buffer *buffer = (Buffer *) (chunk + HEADER_SIZE + i * stride);
+    buffer->pool = pool;
+    buffer->sizeClass = sizeClass;
+    buffer->next = pool->owned[sizeClass];
+    pool->owned[sizeClass] = buffer;
+  }
+}
+
+/*
+ * Returns a buffer of at least size bytes, from the owner's list of its
+ * class, else from the buffers other threads gave back, else from a new
+ * chunk
+ */
+char *takeBuffer(Pool *pool, int size) {
+  int sizeClass = 0;
+  while (sizeClass < NUM_CLASSES - 1 && (MIN_BUFFER << sizeClass) < size)
+    sizeClass++;
+
+  if (pool->owned[sizeClass] == NULL)
+    pool->owned[sizeClass] = __atomic_exchange_n(&pool->returned[sizeClass], NULL, __ATOMIC_ACQUIRE);
+  if (pool->owned[sizeClass] == NULL)
+    growPool(pool, sizeClass);
+
+  Buffer *buffer = pool->owned[sizeClass];
+  pool->owned[sizeClass] = buffer->next;
+  return (char *) buffer + HEADER_SIZE;
+}
+
+/*
+ * Pushes a buffer onto the shared list of its pool and class
+ */
+void returnBuffer(char *data) {
+  Buffer *buffer = (Buffer *) (data - HEADER_SIZE);
+  Buffer **head = &buffer->pool->returned[buffer->sizeClass];
+
+  buffer->next = __atomic_load_n(head, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(head, &buffer->next, buffer, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Returns the bytes allocated to the pool's chunks
+ */
+long long poolBytes(Pool *pool) {
+  return pool->bytes;
+}
+
+/*
+ * Frees every chunk of the pool, and the pool
+ */
+void stopPool(Pool *pool) {
+  while (pool->chunks != NULL) {
+    Chunk *next = pool->chunks->next;
+    free(pool->chunks);
+    pool->chunks = next;
+  }
+  free(pool);
+}
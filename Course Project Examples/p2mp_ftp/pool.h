@@ -0,0 +1,47 @@
+/*
+ * Segment buffer pool for the P2MP-FTP server.
+ *
+ * Every segment a worker keeps, buffered out of sequence in a receive
+ * window, cached for rebuilding its block, or queued to the writer thread,
+ * lives in a buffer taken from the worker's pool instead of one from
+ * malloc. Buffers come in power of two size classes carved from large
+ * chunks, and a buffer given back goes onto a free list of its class, so
+ * once a transfer has filled its windows and the write ring, receiving a
+ * segment allocates nothing.
+ *
+ * Only the worker owning a pool takes buffers from it, but any thread may
+ * give one back, as the writer thread does once a segment is written.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct pool_t Pool;
+
+/*
+ * Starts an empty pool, which grows a chunk at a time as buffers are taken
+ */
+Pool *startPool(void);
+
+/*
+ * Returns a buffer of at least size bytes, up to MAX_UDP_PAYLOAD. Only the
+ * thread that started the pool may take buffers from it.
+ */
+char *takeBuffer(Pool *pool, int size);
+
+/*
+ * Gives a buffer back to the pool it was taken from, from any thread
+ */
+void returnBuffer(char *data);
+
+/*
+ * Returns the number of bytes the pool has allocated from the system
+ */
+long long poolBytes(Pool *pool);
+
+/*
+ * Frees the pool and every buffer in it, once all of them are back
+ */
+void stopPool(Pool *pool);
+
+#endif
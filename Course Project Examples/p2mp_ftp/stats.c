@@ -0,0 +1,138 @@
+/*
+ * Transfer statistics shared by the P2MP-FTP client and server. See stats.h
+ * for the histogram layout.
+ *
+ * A value v of 8 or more whose highest set bit is bit b falls in bucket
+ * (b - 3) * 8 + (v >> (b - 3)), where v >> (b - 3) keeps the top four bits
+ * and so is between 8 and 15. Below 8 the bucket is the value itself, which
+ * the same formula continues without a gap.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+/* Second the calling thread last logged in, how many messages it printed in
+ * it, and how many it has suppressed since it last printed one */
+static __thread time_t logSecond;
+static __thread int logCount;
+static __thread long long logSuppressed;
+
+/*
+ * Returns the bucket a value is counted in
+ */
+static int bucketOf(long long value) {
+  if (value < 8)
+    return value < 0 ? 0 : (int) value;
+  int shift = 63 - __builtin_clzll((unsigned long long) value) - 3;
+  return shift * 8 + (int) (value >> shift);
+}
+
+/*
+ * Returns the lowest value counted in a bucket
+ */
+static long long bucketValue(int bucket) {
+  if (bucket < 16)
+    return bucket;
+  return (long long) (bucket % 8 + 8) << (bucket / 8 - 1);
+}
+
+/*
+ * Counts a value, negative values as 0
+ */
+void recordValue(Histogram *histogram, long long value) {
+  countStat(&histogram->counts[bucketOf(value)], 1);
+}
+
+/*
+ * Adds the counts of from to into
+ */
+void mergeHistogram(Histogram *into, const Histogram *from) {
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    into->counts[bucket] += from->counts[bucket];
+}
+
+/*
+ * Returns the lowest value of the bucket holding the given quantile
+ */
+long long histogramQuantile(const Histogram *histogram, double quantile) {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+
+  // take one snapshot, so the counts add up even while they are written
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    counts[bucket] = loadStat(&histogram->counts[bucket]);
+    total += counts[bucket];
+  }
+  if (total == 0)
+    return 0;
+
+  // the rank of the value, counting from 1, that the quantile falls on
+  uint64_t rank = (uint64_t) (quantile * total);
+  if (rank < 1)
+    rank = 1;
+  if (rank > total)
+    rank = total;
+
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += counts[bucket];
+    if (seen >= rank)
+      return bucketValue(bucket);
+  }
+  return bucketValue(HISTOGRAM_BUCKETS - 1);
+}
+
+/*
+ * Opens the stream statistics are exported to and sets their interval
+ */
+FILE *openStatsFile(char *spec, long long *intervalUsec) {
+  char *colon = strrchr(spec, ':');
+  if (colon != NULL) {
+    *intervalUsec = atoll(colon + 1) * 1000;
+    *colon = '\0';
+  }
+  if (*intervalUsec <= 0)
+    return NULL;
+  if (strcmp(spec, "-") == 0)
+    return stderr;
+
+  FILE *file = fopen(spec, "w");
+  if (file != NULL)
+    setvbuf(file, NULL, _IOLBF, 0);
+  return file;
+}
+
+/*
+ * Prints a message unless the calling thread has used up its burst for the
+ * current second
+ */
+void logLimited(const char *format, ...) {
+  struct timespec ts;
+  va_list args;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  if (ts.tv_sec != logSecond) {
+    logSecond = ts.tv_sec;
+    logCount = 0;
+  }
+  if (logCount == LOG_BURST) {
+    logSuppressed++;
+    return;
+  }
+  logCount++;
+
+  if (logSuppressed > 0) {
+    printf("(%lld messages suppressed)\n", logSuppressed);
+    logSuppressed = 0;
+  }
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
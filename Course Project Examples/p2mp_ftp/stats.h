@@ -0,0 +1,83 @@
+/*
+ * Transfer statistics shared by the P2MP-FTP client and server.
+ *
+ * Counters are only ever written by the thread that owns them, with relaxed
+ * atomic stores rather than locked read-modify-write instructions, so the
+ * hot path pays for a plain add, and any other thread can read them at any
+ * time to export them.
+ *
+ * A histogram counts values such as latencies in microseconds in log-linear
+ * buckets: exact below 16, and eight buckets per power of two above, so any
+ * value is placed within 12.5% of itself in a few hundred counters, without
+ * a division or a loop. Its buckets are counters like any other.
+ *
+ * Both programs export their counters with -S as one JSON object per line,
+ * periodically and once more when they are done, which scripts can follow
+ * with tail or feed to a collector without any parsing library.
+ *
+ * Messages logged on the hot path go through logLimited(), which lets each
+ * thread print LOG_BURST of them a second and counts the rest, so a burst of
+ * losses cannot throttle the loop that reports them.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HISTOGRAM_BUCKETS 512
+#define LOG_BURST 20
+
+typedef struct histogram_t {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/*
+ * Adds n to a counter that only the calling thread writes
+ */
+static inline void countStat(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reads a counter that another thread may be writing
+ */
+static inline uint64_t loadStat(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * Counts a value, negative values as 0, in a histogram that only the
+ * calling thread writes
+ */
+void recordValue(Histogram *histogram, long long value);
+
+/*
+ * Adds the counts of from to into, neither of which may be written
+ * meanwhile
+ */
+void mergeHistogram(Histogram *into, const Histogram *from);
+
+/*
+ * Returns the lowest value of the bucket holding the given quantile, from 0
+ * to 1, of the values counted, or 0 if there are none
+ */
+long long histogramQuantile(const Histogram *histogram, double quantile);
+
+/*
+ * Opens the stream statistics are exported to, given as path[:msec] where
+ * a path of - is stderr, and sets the export interval from msec, or to
+ * intervalUsec's current value if none is given. Returns NULL if the file
+ * cannot be opened or the interval is not positive.
+ */
+FILE *openStatsFile(char *spec, long long *intervalUsec);
+
+/*
+ * Prints a message like printf unless the calling thread has already
+ * printed LOG_BURST in the current second. The first message printed after
+ * some were suppressed says how many.
+ */
+void logLimited(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Writer thread of the P2MP-FTP server. See writer.h.
+ *
+ * The ring indices are only ever advanced by one side each, the receive loop
+ * publishing at head and the writer consuming at tail, so no lock is needed.
+ * Two semaphores count the filled and free slots, which both orders the
+ * slot contents between the threads and lets either side sleep instead of
+ * spinning when the ring is empty or full.
+ *
+ * A run of segments that follow each other in the same file, as a receive
+ * window flushes once a hole fills, is written with a single pwritev of up
+ * to WRITE_BATCH segments.
+ *
+ * A block is verified VERIFY_CHUNK bytes at a time, so a block of any size
+ * takes the same buffer. The verified blocks are pushed onto a list with a
+ * compare and swap, which the receive loop takes over whole with one
+ * exchange, the way a segment pool takes back its buffers (see pool.c).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "batch.h"
+#include "hash.h"
+#include "pool.h"
+#include "writer.h"
+
+/* Space reserved ahead of the writes at a time when preallocating */
+#define PREALLOCATE_CHUNK (64 << 20)
+/* Most segments written with one pwritev */
+#define WRITE_BATCH 64
+/* Bytes of a block read back at a time to verify it */
+#define VERIFY_CHUNK (1 << 20)
+
+/*
+ * One segment waiting to be written. An entry without data closes its file
+ * instead, and removes it if it has a path, or unpacks the batch image at
+ * the path if it is marked to, or verifies size bytes at offset if it has a
+ * verification, or stops the thread if it has no file either. A checkpoint
+ * syncs syncFd before it writes.
+ */
+typedef struct write_t {
+  int fd;
+  off_t offset;
+  int size;
+  char *data;
+  int syncFd;
+  char *path;
+  bool unpack;
+  Verification *verification;
+} Write;
+
+/* Space reserved in a file and the end of the data written to it */
+typedef struct space_t {
+  off_t allocated;
+  off_t written;
+} Space;
+
+struct writer_t {
+  Write *ring;
+  int ringSlots;
+  unsigned head;
+  unsigned tail;
+  sem_t filled;
+  sem_t free;
+  bool preallocate;
+  Space *space;
+  int spaceFds;
+  long long blockedUsec;
+  char *scratch;
+  int eventFd;
+  Verification *verified;
+  pthread_t thread;
+};
+
+/*
+ * Reserves space in the file up to a chunk past end. The file is cut back to
+ * the end of the data written when it is closed.
+ */
+static void reserveSpace(Writer *writer, int fd, off_t end) {
+  if (fd >= writer->spaceFds) {
+    int spaceFds = fd * 2 + 1;
+    Space *space = realloc(writer->space, spaceFds * sizeof(Space));
+    if (space == NULL)
+      return;
+    memset(space + writer->spaceFds, '\0', (spaceFds - writer->spaceFds) * sizeof(Space));
+    writer->space = space;
+    writer->spaceFds = spaceFds;
+  }
+
+  // a file that already has data, as when a transfer resumes, keeps it
+  Space *space = &writer->space[fd];
+  struct stat fileStat;
+  if (space->allocated == 0 && fstat(fd, &fileStat) == 0)
+    space->allocated = space->written = fileStat.st_size;
+  if (end > space->written)
+    space->written = end;
+  if (end <= space->allocated)
+    return;
+  off_t length = end - space->allocated + PREALLOCATE_CHUNK;
+  if (fallocate(fd, 0, space->allocated, length) < 0) {
+    // the file system cannot preallocate, so just write without it
+    writer->preallocate = false;
+    return;
+  }
+  space->allocated += length;
+}
+
+/*
+ * Closes a file, first cutting off the space reserved past its data
+ */
+static void closeFile(Writer *writer, int fd) {
+  if (fd < writer->spaceFds && writer->space[fd].allocated > 0) {
+    if (ftruncate(fd, writer->space[fd].written) < 0)
+      printf("Fatal Error trimming the preallocated file\n");
+    writer->space[fd].allocated = 0;
+    writer->space[fd].written = 0;
+  }
+  close(fd);
+}
+
+/*
+ * Writes the whole of count entries of the ring from the tail on, which
+ * follow each other in one file, retrying short writes
+ */
+static void writeFully(Writer *writer, int count) {
+  struct iovec iov[WRITE_BATCH];
+  Write *first = &writer->ring[writer->tail % writer->ringSlots];
+  off_t offset = first->offset;
+
+  for (int i = 0; i < count; i++) {
+    Write *entry = &writer->ring[(writer->tail + i) % writer->ringSlots];
+    iov[i].iov_base = entry->data;
+    iov[i].iov_len = entry->size;
+  }
+
+  struct iovec *next = iov;
+  while (count > 0) {
+    ssize_t n = pwritev(first->fd, next, count, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      printf("Fatal Error writing the file\n");
+      exit(1);
+    }
+    offset += n;
+    // skip what was written, which may end inside a segment
+    while (count > 0 && (size_t) n >= next->iov_len) {
+      n -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *) next->iov_base + n;
+      next->iov_len -= n;
+    }
+  }
+}
+
+/*
+ * Reads a block back from its file and hashes it, and hands its
+ * verification back to the receive loop. A block cut short by the end of
+ * the file is not intact.
+ */
+static void verifyBlock(Writer *writer, Write *entry) {
+  Verification *verification = entry->verification;
+  uint8_t digest[HASH_SIZE];
+  Hasher hasher;
+  off_t offset = entry->offset;
+  off_t end = entry->offset + entry->size;
+  bool complete = true;
+
+  initHasher(&hasher);
+  while (offset < end) {
+    size_t size = end - offset < VERIFY_CHUNK ? (size_t) (end - offset) : VERIFY_CHUNK;
+    ssize_t n = pread(entry->fd, writer->scratch, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      complete = false;
+      break;
+    }
+    updateHasher(&hasher, writer->scratch, n);
+    offset += n;
+  }
+  finishHasher(&hasher, digest);
+  verification->intact = complete && memcmp(digest, verification->digest, HASH_SIZE) == 0;
+
+  uint64_t one = 1;
+  verification->next = __atomic_load_n(&writer->verified, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&writer->verified, &verification->next, verification, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  if (write(writer->eventFd, &one, sizeof(one)) < 0)
+    printf("Fatal Error signalling a verified block\n");
+}
+
+/*
+ * Returns whether an entry is a segment to be written right after prev
+ */
+static bool followsWrite(const Write *entry, const Write *prev) {
+  return entry->data != NULL && entry->syncFd < 0 && entry->fd == prev->fd
+         && entry->offset == prev->offset + prev->size;
+}
+
+/*
+ * Body of the writer thread, which writes segments in the order they were
+ * queued until it takes the stop marker from the ring. Entries it has
+ * already waited for while looking for a run are kept count of in taken.
+ */
+static void *writerThread(void *arg) {
+  Writer *writer = arg;
+  int taken = 0;
+
+  while (true) {
+    if (taken == 0) {
+      sem_wait(&writer->filled);
+      taken = 1;
+    }
+    Write *entry = &writer->ring[writer->tail % writer->ringSlots];
+    if (entry->data == NULL && entry->fd < 0)
+      return NULL;
+
+    int count = 1;
+    if (entry->verification != NULL) {
+      verifyBlock(writer, entry);
+    } else if (entry->data == NULL && entry->unpack) {
+      closeFile(writer, entry->fd);
+      int count = unpackBatch(entry->path);
+      if (count < 0)
+        printf("Could not unpack the batch into %s, keeping its image\n", entry->path);
+      else
+        printf("Unpacked %d files and directories into %s\n", count, entry->path);
+      free(entry->path);
+    } else if (entry->data == NULL) {
+      closeFile(writer, entry->fd);
+      if (entry->path != NULL && unlink(entry->path) < 0)
+        printf("Fatal Error removing %s\n", entry->path);
+      free(entry->path);
+    } else if (entry->syncFd >= 0) {
+      // the journal must never claim data that could still be lost
+      fdatasync(entry->syncFd);
+      writeFully(writer, 1);
+      fdatasync(entry->fd);
+      free(entry->data);
+    } else {
+      // gather the segments queued right behind this one in the file
+      Write *last = entry;
+      while (count < WRITE_BATCH) {
+        if (count == taken && sem_trywait(&writer->filled) < 0)
+          break;
+        taken += count == taken;
+        Write *next = &writer->ring[(writer->tail + count) % writer->ringSlots];
+        if (!followsWrite(next, last))
+          break;
+        last = next;
+        count++;
+      }
+      if (writer->preallocate)
+        reserveSpace(writer, entry->fd, last->offset + last->size);
+      writeFully(writer, count);
+      for (int i = 0; i < count; i++)
+        returnBuffer(writer->ring[(writer->tail + i) % writer->ringSlots].data);
+    }
+
+    writer->tail += count;
+    taken -= count;
+    for (int i = 0; i < count; i++)
+      sem_post(&writer->free);
+  }
+}
+
+/*
+ * Returns the current time of the monotonic clock in microseconds
+ */
+static long long monotonicUsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Publishes one entry at the head of the ring, waiting for a free slot and
+ * counting the time spent waiting
+ */
+static void pushWrite(Writer *writer, int fd, off_t offset, char *data, int size, int syncFd, char *path, bool unpack,
+                      Verification *verification) {
+  if (sem_trywait(&writer->free) < 0) {
+    long long start = monotonicUsec();
+    while (sem_wait(&writer->free) < 0 && errno == EINTR)
+      ;
+    writer->blockedUsec += monotonicUsec() - start;
+  }
+  Write *entry = &writer->ring[writer->head % writer->ringSlots];
+  entry->fd = fd;
+  entry->offset = offset;
+  entry->size = size;
+  entry->data = data;
+  entry->syncFd = syncFd;
+  entry->path = path;
+  entry->unpack = unpack;
+  entry->verification = verification;
+  writer->head++;
+  sem_post(&writer->filled);
+}
+
+/*
+ * Starts a writer thread with a ring of ringSlots segments
+ */
+Writer *startWriter(int ringSlots, bool preallocate) {
+  Writer *writer = calloc(1, sizeof(Writer));
+  if (writer == NULL || (writer->ring = calloc(ringSlots, sizeof(Write))) == NULL) {
+    printf("Fatal Error allocating the write ring\n");
+    exit(1);
+  }
+  writer->ringSlots = ringSlots;
+  writer->preallocate = preallocate;
+  writer->scratch = malloc(VERIFY_CHUNK);
+  writer->eventFd = eventfd(0, EFD_NONBLOCK);
+  if (writer->scratch == NULL || writer->eventFd < 0) {
+    printf("Fatal Error allocating the write ring\n");
+    exit(1);
+  }
+  sem_init(&writer->filled, 0, 0);
+  sem_init(&writer->free, 0, ringSlots);
+
+  if (pthread_create(&writer->thread, NULL, writerThread, writer) != 0) {
+    printf("Fatal Error starting the writer thread\n");
+    exit(1);
+  }
+  return writer;
+}
+
+/*
+ * Queues size bytes of data to be written to fd at offset, taking ownership
+ * of data. Empty segments have nothing to write and are given back here.
+ */
+void queueWrite(Writer *writer, int fd, off_t offset, char *data, int size) {
+  if (size == 0) {
+    returnBuffer(data);
+    return;
+  }
+  pushWrite(writer, fd, offset, data, size, -1, NULL, false, NULL);
+}
+
+/*
+ * Queues fd to be closed behind the segments queued before it
+ */
+void queueClose(Writer *writer, int fd) {
+  pushWrite(writer, fd, 0, NULL, 0, -1, NULL, false, NULL);
+}
+
+/*
+ * Queues a journal checkpoint behind the segments queued before it
+ */
+void queueCheckpoint(Writer *writer, int fd, int journalFd, char *journal, int size) {
+  pushWrite(writer, journalFd, 0, journal, size, fd, NULL, false, NULL);
+}
+
+/*
+ * Queues fd to be closed and path removed behind the segments queued
+ * before it
+ */
+void queueRemove(Writer *writer, int fd, char *path) {
+  pushWrite(writer, fd, 0, NULL, 0, -1, path, false, NULL);
+}
+
+/*
+ * Queues fd to be closed and the batch image at path unpacked behind the
+ * segments queued before it
+ */
+void queueUnpack(Writer *writer, int fd, char *path) {
+  pushWrite(writer, fd, 0, NULL, 0, -1, path, true, NULL);
+}
+
+/*
+ * Queues a block to be verified behind the segments queued before it
+ */
+void queueVerify(Writer *writer, int fd, off_t offset, int size, Verification *verification) {
+  pushWrite(writer, fd, offset, NULL, size, -1, NULL, false, verification);
+}
+
+/*
+ * Takes over the list of verified blocks, clearing the eventfd first so a
+ * block verified meanwhile signals it again
+ */
+Verification *takeVerifications(Writer *writer) {
+  uint64_t count;
+
+  if (read(writer->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    printf("Fatal Error reading the verified blocks\n");
+  return __atomic_exchange_n(&writer->verified, NULL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the eventfd signalling verified blocks
+ */
+int writerEventFd(Writer *writer) {
+  return writer->eventFd;
+}
+
+/*
+ * Returns the microseconds spent waiting for a full ring
+ */
+long long writerBlockedUsec(Writer *writer) {
+  return writer->blockedUsec;
+}
+
+/*
+ * Queues the stop marker behind every segment, then waits for the thread
+ */
+void stopWriter(Writer *writer) {
+  pushWrite(writer, -1, 0, NULL, 0, -1, NULL, false, NULL);
+  pthread_join(writer->thread, NULL);
+  sem_destroy(&writer->filled);
+  sem_destroy(&writer->free);
+  Verification *verification = writer->verified;
+  while (verification != NULL) {
+    Verification *next = verification->next;
+    free(verification);
+    verification = next;
+  }
+  close(writer->eventFd);
+  free(writer->scratch);
+  free(writer->space);
+  free(writer->ring);
+  free(writer);
+}
@@ -0,0 +1,117 @@
+/*
+ * Asynchronous file writer for the P2MP-FTP server.
+ *
+ * The receive loop hands each segment it has accepted to a writer thread
+ * through a single producer, single consumer ring, and the thread stores it
+ * with pwrite at the segment's offset in the file. The receive path only
+ * ever waits on storage when the ring is full, so a slow disk shows up as
+ * backpressure instead of datagrams dropped by a full socket buffer.
+ *
+ * Checkpoints of a transfer's progress journal go through the same ring, so
+ * a journal is only ever written once the data it describes has been, and
+ * so does the unpacking of a batch once its image is complete.
+ *
+ * So do the blocks of a hashed transfer to verify: once a block's segments
+ * are written, the thread reads the block back from the file and checks it
+ * against its digest (see hash.h), and hands the result back to the
+ * receive loop, waking it through an eventfd.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+typedef struct writer_t Writer;
+
+/*
+ * Verification structure for a block of a session's file to check against
+ * its digest, which the writer thread hands back with intact set if the
+ * block read back from the file matches it
+ */
+typedef struct verification_t {
+  struct verification_t *next;
+  uint32_t sessionId;
+  int block;
+  bool intact;
+  uint8_t digest[HASH_SIZE];
+} Verification;
+
+/*
+ * Starts a writer thread with a ring of ringSlots segments. With preallocate
+ * set, space is reserved with fallocate ahead of the writes so a large file
+ * is laid out contiguously on disk, and cut back to the data written when
+ * the file is closed.
+ */
+Writer *startWriter(int ringSlots, bool preallocate);
+
+/*
+ * Queues size bytes of data to be written to fd at offset. The writer takes
+ * ownership of data, which must be a buffer of a segment pool (see pool.h),
+ * and gives it back once written. Blocks only while the ring is full.
+ */
+void queueWrite(Writer *writer, int fd, off_t offset, char *data, int size);
+
+/*
+ * Queues fd to be closed once every segment queued before it is written
+ */
+void queueClose(Writer *writer, int fd);
+
+/*
+ * Queues size bytes of journal to be written at the start of journalFd
+ * once every segment queued before it has been written and synced to fd,
+ * taking ownership of journal as queueWrite() does
+ */
+void queueCheckpoint(Writer *writer, int fd, int journalFd, char *journal, int size);
+
+/*
+ * Queues fd to be closed and the file at path removed once every segment
+ * queued before it is written, taking ownership of path, which must come
+ * from malloc
+ */
+void queueRemove(Writer *writer, int fd, char *path);
+
+/*
+ * Queues fd to be closed and the batch image at path unpacked into a
+ * directory of the same name (see batch.h) once every segment queued before
+ * it is written, taking ownership of path as queueRemove() does
+ */
+void queueUnpack(Writer *writer, int fd, char *path);
+
+/*
+ * Queues the size bytes of fd at offset to be verified against the digest
+ * of verification once every segment queued before it is written, taking
+ * ownership of verification, which must come from malloc
+ */
+void queueVerify(Writer *writer, int fd, off_t offset, int size, Verification *verification);
+
+/*
+ * Returns the list of blocks verified since the last call, linked through
+ * next, and clears the eventfd that signals them. The caller frees every
+ * entry.
+ */
+Verification *takeVerifications(Writer *writer);
+
+/*
+ * Returns the eventfd that becomes readable once a block has been verified
+ */
+int writerEventFd(Writer *writer);
+
+/*
+ * Returns the number of microseconds the thread queueing writes has spent
+ * waiting for room in a full ring, which is the time the receive loop was
+ * held up by the disk
+ */
+long long writerBlockedUsec(Writer *writer);
+
+/*
+ * Waits until every queued segment has been written, then stops the writer
+ * thread and frees the ring
+ */
+void stopWriter(Writer *writer);
+
+#endif